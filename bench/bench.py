@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""
+End to end benchmark of gbooru against tests/fake_server.py
+
+Every scenario starts a stand-in server with its size distribution, latency and bandwidth,
+downloads all posts into a scratch dir and prints images/s, MB/s, CPU time and peak RSS of the gbooru summary.
+--save writes the results as JSON, --baseline compares with saved results and fails
+if a scenario lost more than --tolerance of its images/s or grew its peak RSS by more.
+
+    python3 bench/bench.py ./gbooru
+    python3 bench/bench.py ./gbooru --save before.json
+    python3 bench/bench.py ./gbooru --baseline before.json
+    python3 bench/bench.py ./gbooru --only api
+"""
+import argparse
+import json
+import os
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "tests"))
+import harness  # noqa: E402
+
+
+class Scenario:
+    def __init__(self, name, posts, server_args, options=()):
+        self.name = name
+        self.posts = posts
+        self.server_args = ["--posts", posts] + list(server_args)
+        self.options = list(options)
+
+
+SMALL = ["--min-size", 5000, "--max-size", 60000]
+MIXED = ["--size-dist", "lognormal", "--min-size", 20000, "--max-size", 4000000]
+
+SCENARIOS = [
+    Scenario("html small", 2000, SMALL),
+    Scenario("api small", 2000, SMALL, ["--api"]),
+    Scenario("api mixed sizes", 400, MIXED, ["--api"]),
+    Scenario("api mixed writers 2", 400, MIXED, ["--api", "--writers", 2]),
+    Scenario("api small pack", 2000, SMALL, ["--api", "--pack"]),
+    Scenario("api small sharded", 2000, SMALL, ["--api", "--sharded"]),
+    Scenario("api latency 50 ms", 1000, SMALL + ["--latency", 50], ["--api"]),
+    Scenario("api 1 MB/s per conn", 300, MIXED + ["--bandwidth", 1024], ["--api"]),
+]
+
+
+def run_scenario(binary, scenario):
+    with harness.FakeServer(*scenario.server_args) as server, harness.scratch_dir() as cwd:
+        return harness.download(binary, server, cwd, *scenario.options)
+
+
+def compare(result, baseline, tolerance):
+    """Regression notes of result against baseline result of same scenario"""
+    notes = []
+    if result["images_per_second"] < baseline["images_per_second"] * (1 - tolerance):
+        notes.append("images/s %.1f -> %.1f" % (baseline["images_per_second"], result["images_per_second"]))
+    if result["peak_rss_mb"] > baseline["peak_rss_mb"] * (1 + tolerance):
+        notes.append("peak RSS %.1f -> %.1f MB" % (baseline["peak_rss_mb"], result["peak_rss_mb"]))
+    return notes
+
+
+def main():
+    parser = argparse.ArgumentParser(description="gbooru benchmark against local stand-in server")
+    parser.add_argument("binary", nargs="?", default="./gbooru")
+    parser.add_argument("--only", help="run scenarios with this text in name")
+    parser.add_argument("--save", help="write results to JSON file")
+    parser.add_argument("--baseline", help="compare with results of --save")
+    parser.add_argument("--tolerance", type=float, default=0.2, help="allowed regression, 0.2 is 20%%")
+    args = parser.parse_args()
+
+    baseline = {}
+    if args.baseline:
+        with open(args.baseline) as file:
+            baseline = json.load(file)
+
+    print("%-22s %7s %9s %8s %8s %8s %9s" % ("scenario", "images", "images/s", "MB/s", "user s", "sys s", "RSS MB"))
+    results = {}
+    failed = False
+    for scenario in SCENARIOS:
+        if args.only and args.only not in scenario.name:
+            continue
+        run = run_scenario(args.binary, scenario)
+        if run.images is None or run.images_per_second is None:
+            print("%-22s no summary, exit code %d" % (scenario.name, run.returncode))
+            print(run.output[-2000:])
+            failed = True
+            continue
+
+        result = {key: getattr(run, key) or 0 for key in ("images", "megabytes", "seconds", "images_per_second",
+                                                          "megabytes_per_second", "user_seconds", "system_seconds",
+                                                          "peak_rss_mb")}
+        results[scenario.name] = result
+        notes = []
+        if run.images != scenario.posts or run.lost_posts != 0:
+            notes.append("%d of %d posts, %d lost" % (run.images, scenario.posts, run.lost_posts))
+        if scenario.name in baseline:
+            notes += compare(result, baseline[scenario.name], args.tolerance)
+        failed |= bool(notes)
+        print("%-22s %7d %9.1f %8.2f %8.2f %8.2f %9.1f%s" % (
+            scenario.name, run.images, run.images_per_second, run.megabytes_per_second or 0,
+            run.user_seconds or 0, run.system_seconds or 0, run.peak_rss_mb or 0,
+            "  FAIL: " + ", ".join(notes) if notes else ""), flush=True)
+
+    if args.save:
+        with open(args.save, "w") as file:
+            json.dump(results, file, indent=2)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
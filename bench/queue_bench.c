@@ -0,0 +1,219 @@
+/*
+    Contention benchmark of download queue with many producers and consumers
+
+    list    old unbounded linked list queue, malloc and signal per item
+    ring    bounded ring buffer, tsq_push / tsq_pop per item
+    batch   bounded ring buffer, tsq_push_batch of a listing page / tsq_pop_batch
+
+    Usage: queue_bench [<items_per_producer>]
+*/
+#define GELBOORU_DOWNLOADER_IMPLEMENTATION
+#include "../gelbooru_downloader.h"
+#include <stdatomic.h>
+
+#define BENCH_PUSH_BATCH    42  // posts of HTML listing page
+#define BENCH_POP_BATCH     16
+
+
+/*
+    Old queue
+*/
+
+typedef struct TSQ_Node {
+    void *data;
+    struct TSQ_Node *next;
+} TSQ_Node;
+
+typedef struct ListQueue {
+    TSQ_Node *head;
+    TSQ_Node *tail;
+    int size;
+    int max_size;
+    int closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ListQueue;
+
+void list_queue_init(ListQueue *queue) {
+    memset(queue, 0, sizeof(ListQueue));
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+}
+
+void list_queue_close(ListQueue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+int list_queue_push(ListQueue *queue, void *data) {
+    TSQ_Node *new_node = (TSQ_Node*) malloc(sizeof(TSQ_Node));
+    if (new_node == NULL) return -1;
+    new_node->data = data;
+    new_node->next = NULL;
+
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->tail == NULL) {
+        queue->head = new_node;
+        queue->tail = new_node;
+    } else {
+        queue->tail->next = new_node;
+        queue->tail = new_node;
+    }
+    queue->size++;
+    if (queue->size > queue->max_size) queue->max_size = queue->size;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+void* list_queue_pop(ListQueue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->head == NULL && !queue->closed) {
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    }
+    if (queue->head == NULL) {
+        pthread_mutex_unlock(&queue->mutex);
+        return NULL;
+    }
+    TSQ_Node *node = queue->head;
+    void *data = node->data;
+    queue->head = node->next;
+    if (queue->head == NULL) queue->tail = NULL;
+    queue->size--;
+    pthread_mutex_unlock(&queue->mutex);
+
+    free(node);
+    return data;
+}
+
+
+/*
+    Benchmark
+*/
+
+enum { BENCH_LIST, BENCH_RING, BENCH_BATCH };
+
+typedef struct bench_run {
+    int mode;
+    long items_per_producer;
+    ListQueue list;
+    ThreadSafeQueue *ring;
+    atomic_llong consumed;
+    atomic_llong checksum;
+} bench_run;
+
+void* bench_producer(void *arg) {
+    bench_run *run = (bench_run*) arg;
+    void *items[BENCH_PUSH_BATCH];
+    int count = 0;
+    for (long i = 1; i <= run->items_per_producer; i++) {
+        void *item = (void*) (intptr_t) i;
+        if (run->mode == BENCH_LIST) {
+            list_queue_push(&run->list, item);
+        } else if (run->mode == BENCH_RING) {
+            tsq_push(run->ring, item);
+        } else {
+            items[count++] = item;
+            if (count == BENCH_PUSH_BATCH) {
+                tsq_push_batch(run->ring, items, count);
+                count = 0;
+            }
+        }
+    }
+    if (count > 0) tsq_push_batch(run->ring, items, count);
+    return NULL;
+}
+
+void* bench_consumer(void *arg) {
+    bench_run *run = (bench_run*) arg;
+    long long consumed = 0, checksum = 0;
+    if (run->mode == BENCH_LIST) {
+        void *item;
+        while ((item = list_queue_pop(&run->list)) != NULL) {
+            consumed++;
+            checksum += (intptr_t) item;
+        }
+    } else if (run->mode == BENCH_RING) {
+        void *item;
+        while ((item = tsq_pop(run->ring)) != NULL) {
+            consumed++;
+            checksum += (intptr_t) item;
+        }
+    } else {
+        void *items[BENCH_POP_BATCH];
+        int count;
+        while ((count = tsq_pop_batch(run->ring, items, BENCH_POP_BATCH)) > 0) {
+            for (int i = 0; i < count; i++) checksum += (intptr_t) items[i];
+            consumed += count;
+        }
+    }
+    atomic_fetch_add(&run->consumed, consumed);
+    atomic_fetch_add(&run->checksum, checksum);
+    return NULL;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run one configuration, returns 0 if every item was consumed once */
+int bench_queue(int mode, int producers, int consumers, long items_per_producer) {
+    static const char *names[] = { "list", "ring", "batch" };
+    bench_run run;
+    memset(&run, 0, sizeof(run));
+    run.mode = mode;
+    run.items_per_producer = items_per_producer;
+    if (mode == BENCH_LIST) {
+        list_queue_init(&run.list);
+    } else {
+        run.ring = tsq_create_bounded(TSQ_DEFAULT_CAPACITY);
+        if (run.ring == NULL) return -1;
+    }
+
+    pthread_t *producer_threads = (pthread_t*) malloc(sizeof(pthread_t) * producers);
+    pthread_t *consumer_threads = (pthread_t*) malloc(sizeof(pthread_t) * consumers);
+    double started = bench_now();
+    for (int i = 0; i < consumers; i++) pthread_create(&consumer_threads[i], NULL, bench_consumer, &run);
+    for (int i = 0; i < producers; i++) pthread_create(&producer_threads[i], NULL, bench_producer, &run);
+    for (int i = 0; i < producers; i++) pthread_join(producer_threads[i], NULL);
+    if (mode == BENCH_LIST) list_queue_close(&run.list);
+    else tsq_close(run.ring);
+    for (int i = 0; i < consumers; i++) pthread_join(consumer_threads[i], NULL);
+    double seconds = bench_now() - started;
+
+    long long total = (long long) producers * items_per_producer;
+    long long expected_checksum = (long long) producers * items_per_producer * (items_per_producer + 1) / 2;
+    int max_depth = mode == BENCH_LIST ? run.list.max_size : TSQ_DEFAULT_CAPACITY;
+    printf("%-6s %3d producers %3d consumers  %7.2f M items/s  %6.1f ns/item  max depth %d%s\n",
+        names[mode], producers, consumers, total / seconds / 1e6, seconds / total * 1e9, max_depth,
+        mode == BENCH_LIST ? "" : " (capacity)");
+
+    int failed = atomic_load(&run.consumed) != total || atomic_load(&run.checksum) != expected_checksum;
+    if (failed) printf("%s: consumed %lld of %lld items\n", names[mode], (long long) atomic_load(&run.consumed), total);
+    if (run.ring != NULL) tsq_destroy(run.ring);
+    free(producer_threads);
+    free(consumer_threads);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    long items_per_producer = argc > 1 ? atol(argv[1]) : 200000;
+    if (items_per_producer <= 0) {
+        printf("Usage: queue_bench [<items_per_producer>]\n");
+        return 1;
+    }
+
+    // parser threads push, downloader threads pop
+    int configs[][2] = { {1, 1}, {4, 2}, {4, 8}, {16, 16}, {32, 4} };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        for (int mode = BENCH_LIST; mode <= BENCH_BATCH; mode++) {
+            failed |= bench_queue(mode, configs[i][0], configs[i][1], items_per_producer) != 0;
+        }
+    }
+    return failed;
+}
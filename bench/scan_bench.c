@@ -0,0 +1,343 @@
+/*
+    Microbenchmark of listing page scanners against the old POSIX regex path
+
+    Regex path: gelbooru_parse_image_hashes and gelbooru_parse_max_pid as they were,
+    regcomp per call and one regexec loop per output over the whole page,
+    gelbooru_parse_tags with its own regex over autocomplete JSON.
+    Scanner path: gelbooru_parse_posts_html (one pass for hashes and max pid) and gelbooru_parse_tags.
+
+    Usage: scan_bench [<saved_page.html> ...]
+    Without pages a synthetic listing page of real page size is used.
+*/
+#define GELBOORU_DOWNLOADER_IMPLEMENTATION
+#include "../gelbooru_downloader.h"
+#include <regex.h>
+#include <stdarg.h>
+
+#define BENCH_MIN_SECONDS   0.5
+
+
+/*
+    Old regex path
+*/
+
+vector* regex_parse_image_hashes(gelbooru_raw_data* page_html) {
+    if (page_html == NULL || page_html->data == NULL) return NULL;
+    const char *pattern = "thumbnail_([a-f0-9]+)\\.jpg";
+    regex_t regex;
+    regmatch_t matches[2];
+
+    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) {
+        printf("Failed to compile regex\n");
+        return NULL;
+    }
+
+    vector* image_hash_list = vector_create();
+    if (image_hash_list == NULL) {
+        regfree(&regex);
+        return NULL;
+    }
+    char *cursor = page_html->data;
+    while (regexec(&regex, cursor, 2, matches, 0) == 0) {
+        int len = matches[1].rm_eo - matches[1].rm_so;
+        char *hash = malloc(len + 1);
+        if (hash == NULL) break;
+
+        strncpy(hash, cursor + matches[1].rm_so, len);
+        hash[len] = '\0';
+        if (vector_push_back(image_hash_list, hash) != 0) {
+            free(hash);
+            break;
+        }
+        cursor += matches[0].rm_eo;
+    }
+    regfree(&regex);
+    return image_hash_list;
+}
+
+int regex_parse_max_pid(gelbooru_raw_data* page_html) {
+    if (page_html == NULL || page_html->data == NULL) return -1;
+    int max_pid = -1;
+    const char *pattern = "pid=([0-9]+)";
+    regex_t regex;
+    regmatch_t pmatch[2];
+
+    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) {
+        printf("Failed to compile regex\n");
+        return max_pid;
+    }
+
+    const char *cursor = page_html->data;
+    while (regexec(&regex, cursor, 2, pmatch, 0) == 0) {
+        int len = pmatch[1].rm_eo - pmatch[1].rm_so;
+        char *pid_str = malloc(len + 1);
+        if (pid_str == NULL) {
+            regfree(&regex);
+            return max_pid;
+        }
+        strncpy(pid_str, cursor + pmatch[1].rm_so, len);
+        pid_str[len] = '\0';
+
+        int current_pid = atoi(pid_str);
+        if (current_pid > max_pid) max_pid = current_pid;
+
+        free(pid_str);
+        cursor += pmatch[0].rm_eo;
+    }
+    regfree(&regex);
+    return max_pid;
+}
+
+vector* regex_parse_tags(gelbooru_raw_data* raw_data) {
+    if (raw_data == NULL || raw_data->data == NULL) return NULL;
+
+    const char *pattern = "\"value\":\"([^\"]+)\",\"post_count\":\"([0-9]+)\"";
+    regex_t regex;
+    regmatch_t matches[3];
+    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) {
+        printf("Failed to compile regex\n");
+        return NULL;
+    }
+
+    vector *tags = vector_create();
+    if (tags == NULL) {
+        regfree(&regex);
+        return NULL;
+    }
+
+    char *cursor = raw_data->data;
+    while (regexec(&regex, cursor, 3, matches, 0) == 0) {
+        int len1 = matches[1].rm_eo - matches[1].rm_so;
+        int len2 = matches[2].rm_eo - matches[2].rm_so;
+
+        char *tag = (char*) malloc(len1 + 1);
+        char *post_count = (char*) malloc(len2 + 1);
+        if (tag == NULL || post_count == NULL) {
+            free(tag);
+            free(post_count);
+            break;
+        }
+        strncpy(tag, cursor + matches[1].rm_so, len1);
+        strncpy(post_count, cursor + matches[2].rm_so, len2);
+        tag[len1] = '\0';
+        post_count[len2] = '\0';
+
+        gelbooru_tag *current_tag = (gelbooru_tag*) malloc(sizeof(gelbooru_tag));
+        if (current_tag == NULL) {
+            free(tag);
+            free(post_count);
+            break;
+        }
+        current_tag->tag = tag;
+        current_tag->post_count = atoi(post_count);
+        free(post_count);
+
+        if (vector_push_back(tags, current_tag) != 0) {
+            free(tag);
+            free(current_tag);
+            break;
+        }
+        cursor += matches[0].rm_eo;
+    }
+
+    regfree(&regex);
+    return tags;
+}
+
+
+/*
+    Inputs
+*/
+
+/* Append formatted text to raw data, returns 0 if OK */
+int bench_append(gelbooru_raw_data *data, const char *format, ...) {
+    char chunk[1024];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(chunk, sizeof(chunk), format, args);
+    va_end(args);
+    if (length < 0 || (size_t) length >= sizeof(chunk)) return -1;
+    return gelbooru_rawdata_write_curl_callback(chunk, 1, length, data) == (size_t) length ? 0 : -1;
+}
+
+/* Listing page shaped like gelbooru page=post&s=list: 42 posts, paginator, ~150 KB of markup */
+int bench_synthetic_page(gelbooru_raw_data *page) {
+    int failed = 0;
+    for (int i = 0; i < 1500 && !failed; i++) {
+        failed = bench_append(page, "<link rel=\"stylesheet\" href=\"/layout/gelbooru.css?v=%d\"><div class=\"x%d\"></div>\n", i, i);
+    }
+    for (int i = 0; i < 42 && !failed; i++) {
+        unsigned char md5[16];
+        char hash[33];
+        for (int j = 0; j < 16; j++) md5[j] = (unsigned char) (i * 31 + j * 7);
+        for (int j = 0; j < 16; j++) sprintf(hash + j * 2, "%02x", md5[j]);
+        failed = bench_append(page,
+            "<article class=\"thumbnail-preview\"><a id=\"p%d\" href=\"https://gelbooru.com/index.php?page=post&amp;s=view&amp;id=%d&amp;tags=all\">"
+            "<img src=\"https://img3.gelbooru.com/thumbnails/%.2s/%.2s/thumbnail_%s.jpg\" title=\"1girl solo long_hair smile score:%d rating:general\" "
+            "class=\"thumbnail-preview\" alt=\"Rule 34 | 1girl, solo\"/></a></article>\n", 9000000 - i, 9000000 - i, hash, hash + 2, hash, i);
+    }
+    for (int i = 1; i <= 20 && !failed; i++) {
+        failed = bench_append(page, "<a href=\"?page=post&amp;s=list&amp;tags=all&amp;pid=%d\">%d</a>", i * 42, i + 1);
+    }
+    for (int i = 0; i < 600 && !failed; i++) {
+        failed = bench_append(page, "<script>var tag_%d = {\"name\": \"tag\", \"count\": %d};</script>\n", i, i);
+    }
+    return failed ? -1 : 0;
+}
+
+/* Autocomplete JSON with 10 suggestions */
+int bench_synthetic_tags(gelbooru_raw_data *json) {
+    int failed = bench_append(json, "[");
+    for (int i = 0; i < 10 && !failed; i++) {
+        failed = bench_append(json, "%s{\"type\":\"tag\",\"label\":\"cat_ears_%d\",\"value\":\"cat_ears_%d\",\"post_count\":\"%d\",\"category\":\"tag\"}",
+            i > 0 ? "," : "", i, i, 100000 - i);
+    }
+    return failed || bench_append(json, "]") != 0 ? -1 : 0;
+}
+
+/* Read whole file, returns 0 if OK */
+int bench_read_file(const char *path, gelbooru_raw_data *data) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return -1;
+    char buffer[64 * 1024];
+    size_t count;
+    int failed = 0;
+    while (!failed && (count = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        failed = gelbooru_rawdata_write_curl_callback(buffer, 1, count, data) != count;
+    }
+    fclose(fp);
+    return failed || data->data == NULL ? -1 : 0;
+}
+
+
+/*
+    Timing
+*/
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_free_hashes(vector *hashes) {
+    for (int i = 0; i < vector_size(hashes); i++) free(vector_index(hashes, i));
+    vector_destroy(hashes);
+}
+
+/* Regex path over page, returns number of hashes */
+int bench_regex_page(gelbooru_raw_data *page, int *max_pid) {
+    vector *hashes = regex_parse_image_hashes(page);
+    *max_pid = regex_parse_max_pid(page);
+    int count = vector_size(hashes);
+    bench_free_hashes(hashes);
+    return count;
+}
+
+/* Scanner path over page, returns number of hashes */
+int bench_scan_page(gelbooru_raw_data *page, int *max_pid) {
+    vector *hashes = vector_create();
+    gelbooru_parse_posts_html(page, hashes, max_pid);
+    int count = vector_size(hashes);
+    bench_free_hashes(hashes);
+    return count;
+}
+
+int bench_regex_tags(gelbooru_raw_data *json) {
+    vector *tags = regex_parse_tags(json);
+    int count = vector_size(tags);
+    gelbooru_tag_list_free(tags);
+    return count;
+}
+
+int bench_scan_tags(gelbooru_raw_data *json) {
+    vector *tags = gelbooru_parse_tags(json);
+    int count = vector_size(tags);
+    gelbooru_tag_list_free(tags);
+    return count;
+}
+
+/* Print time per call and throughput of regex and scanner path */
+void bench_report(const char *name, size_t size, double regex_seconds, long regex_calls, double scan_seconds, long scan_calls) {
+    double regex_us = regex_seconds / regex_calls * 1e6;
+    double scan_us = scan_seconds / scan_calls * 1e6;
+    printf("%-28s %8zu B  regex %9.1f us %8.1f MB/s  scan %8.1f us %8.1f MB/s  x%.1f\n", name, size,
+        regex_us, size / regex_us, scan_us, size / scan_us, regex_us / scan_us);
+}
+
+/* Benchmark one listing page, returns 0 if both paths agree */
+int bench_page(const char *name, gelbooru_raw_data *page) {
+    int regex_pid, scan_pid;
+    int regex_count = bench_regex_page(page, &regex_pid);
+    int scan_count = bench_scan_page(page, &scan_pid);
+    if (regex_count != scan_count || regex_pid != scan_pid) {
+        printf("%s: paths disagree, regex %d hashes pid %d, scan %d hashes pid %d\n", name, regex_count, regex_pid, scan_count, scan_pid);
+        return -1;
+    }
+
+    long regex_calls = 0, scan_calls = 0;
+    double started = bench_now();
+    while (bench_now() - started < BENCH_MIN_SECONDS) {
+        bench_regex_page(page, &regex_pid);
+        regex_calls++;
+    }
+    double regex_seconds = bench_now() - started;
+    started = bench_now();
+    while (bench_now() - started < BENCH_MIN_SECONDS) {
+        bench_scan_page(page, &scan_pid);
+        scan_calls++;
+    }
+    bench_report(name, page->size, regex_seconds, regex_calls, bench_now() - started, scan_calls);
+    return 0;
+}
+
+/* Benchmark autocomplete JSON, returns 0 if both paths agree */
+int bench_tags(const char *name, gelbooru_raw_data *json) {
+    if (bench_regex_tags(json) != bench_scan_tags(json)) {
+        printf("%s: paths disagree\n", name);
+        return -1;
+    }
+
+    long regex_calls = 0, scan_calls = 0;
+    double started = bench_now();
+    while (bench_now() - started < BENCH_MIN_SECONDS) {
+        bench_regex_tags(json);
+        regex_calls++;
+    }
+    double regex_seconds = bench_now() - started;
+    started = bench_now();
+    while (bench_now() - started < BENCH_MIN_SECONDS) {
+        bench_scan_tags(json);
+        scan_calls++;
+    }
+    bench_report(name, json->size, regex_seconds, regex_calls, bench_now() - started, scan_calls);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int failed = 0;
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            gelbooru_raw_data page = {0};
+            if (bench_read_file(argv[i], &page) != 0) {
+                printf("Failed to read %s\n", argv[i]);
+                failed = 1;
+                continue;
+            }
+            failed |= bench_page(argv[i], &page) != 0;
+            free(page.data);
+        }
+        return failed;
+    }
+
+    gelbooru_raw_data page = {0}, json = {0};
+    if (bench_synthetic_page(&page) != 0 || bench_synthetic_tags(&json) != 0) {
+        printf("Failed to build synthetic inputs\n");
+        return 1;
+    }
+    failed |= bench_page("synthetic listing page", &page) != 0;
+    failed |= bench_tags("synthetic autocomplete", &json) != 0;
+    free(page.data);
+    free(json.data);
+    return failed;
+}
@@ -1,18 +1,56 @@
 #ifndef GELBOORU_DOWNLOADER_H
 #define GELBOORU_DOWNLOADER_H
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memmem
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <regex.h>
+#include <stdarg.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <curl/curl.h>
 
-#define GELBOORU_HOST "https://gelbooru.com"
+#define GELBOORU_HOST "https://gelbooru.com"   // default, see gelbooru_set_host
 #define GELBOORU_DEFAULT_USER_AGENT "Mozilla/5.0 (X11; Linux x86_64; rv:146.0) Gecko/20100101 Firefox/146.0"
 #define GELBOORU_DEFAULT_DOWNLOAD_DIR_PATH "gelbooru_downloads"
 
+#define GELBOORU_LISTING_HTML   0
+#define GELBOORU_LISTING_API    1
+
+#define GELBOORU_STORAGE_FILES      0   // file per image
+#define GELBOORU_STORAGE_PACK       1   // segment files, see PACK
+
+#define GELBOORU_LAYOUT_FLAT        0   // dir/hash.ext
+#define GELBOORU_LAYOUT_SHARDED     1   // dir/ab/cd/hash.ext like image urls
+#define GELBOORU_SHARDED_FILE_NAME  ".gelbooru_sharded" // dir uses sharded layout
+#define GELBOORU_SHARD_DIRS         65536
+
+#define GELBOORU_INDEX_FILE_NAME    ".gelbooru_index"
+#define GELBOORU_INDEX_MAGIC        "GBIDX001"
+#define GELBOORU_INDEX_HEADER_SIZE  16
+
+#define GELBOORU_SYNC_FILE_NAME     ".gelbooru_sync"   // newest post id per query, lines "<id> <query>"
+
+#define GELBOORU_HTML_POSTS_PER_PAGE    42
+#define GELBOORU_API_POSTS_PER_PAGE     100
+
+#define GELBOORU_CONNECT_TIMEOUT_S  15
+#define GELBOORU_LOW_SPEED_LIMIT    512     // bytes per second, slower transfers are aborted
+#define GELBOORU_LOW_SPEED_TIME_S   30
+
+#define GELBOORU_PROGRESS_MIN_INTERVAL_MS   100
+#define GELBOORU_PROGRESS_MAX_INTERVAL_MS   800
+
 
 /*
     VECTOR
@@ -34,49 +72,399 @@ void*   vector_index(vector* v, int index);
 /*
     THREAD SAFE QUEUE
 */
-typedef struct TSQ_Node {
-    void *data;
-    struct TSQ_Node *next;
-} TSQ_Node;
+#define TSQ_DEFAULT_CAPACITY 4096
 
 typedef struct ThreadSafeQueue {
-    TSQ_Node *head;
-    TSQ_Node *tail;
+    void **items;
+    int capacity;
+    int head;
     int size;
     int closed;
     pthread_mutex_t mutex;
-    pthread_cond_t cond;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
 } ThreadSafeQueue;
 
 ThreadSafeQueue*    tsq_create();
+ThreadSafeQueue*    tsq_create_bounded(int capacity);
 void                tsq_destroy(ThreadSafeQueue *queue);
 int                 tsq_size(ThreadSafeQueue *queue);
 int                 tsq_closed(ThreadSafeQueue *queue);
 void                tsq_close(ThreadSafeQueue *queue);
 int                 tsq_push(ThreadSafeQueue *queue, void *data);
+int                 tsq_push_batch(ThreadSafeQueue *queue, void **items, int count);
+int                 tsq_take_locked(ThreadSafeQueue *queue, void **items, int max_count);
 void*               tsq_pop(ThreadSafeQueue *queue);
+int                 tsq_pop_batch(ThreadSafeQueue *queue, void **items, int max_count);
+int                 tsq_try_pop(ThreadSafeQueue *queue, void **data);
+int                 tsq_try_pop_batch(ThreadSafeQueue *queue, void **items, int max_count);
+
+
+
+/*
+    MD5
+    Incremental MD5 of downloaded bytes, image names are MD5 of content
+*/
+typedef struct gelbooru_md5_ctx {
+    uint32_t state[4];
+    uint64_t length;    // bytes
+    unsigned char buffer[64];
+} gelbooru_md5_ctx;
+
+void    gelbooru_md5_init(gelbooru_md5_ctx *ctx);
+void    gelbooru_md5_update(gelbooru_md5_ctx *ctx, const void *data, size_t size);
+void    gelbooru_md5_final(gelbooru_md5_ctx *ctx, unsigned char *md5);
+int     gelbooru_md5_update_file(gelbooru_md5_ctx *ctx, const char *path, long long size);
+
+
+
+/*
+    HASH SET
+*/
+typedef struct gelbooru_hash_set {
+    uint64_t *keys;     // 2 words per slot, all-zero slot is empty
+    size_t capacity;    // power of two
+    size_t size;
+    int has_zero;
+    long long duplicates;
+    pthread_mutex_t mutex;
+} gelbooru_hash_set;
+
+int                 gelbooru_md5_from_hex(const char *hex, unsigned char *md5);
+gelbooru_hash_set*  gelbooru_hash_set_create(size_t capacity);
+void                gelbooru_hash_set_destroy(gelbooru_hash_set *set);
+size_t              gelbooru_hash_set_find_locked(uint64_t *keys, size_t capacity, uint64_t lo, uint64_t hi);
+int                 gelbooru_hash_set_grow_locked(gelbooru_hash_set *set);
+int                 gelbooru_hash_set_insert(gelbooru_hash_set *set, const unsigned char *md5);
+int                 gelbooru_hash_set_contains(gelbooru_hash_set *set, const unsigned char *md5);
+int                 gelbooru_hash_set_insert_hex(gelbooru_hash_set *set, const char *hash);
+size_t              gelbooru_hash_set_size(gelbooru_hash_set *set);
+long long           gelbooru_hash_set_duplicates(gelbooru_hash_set *set);
+
+
+
+/*
+    INDEX
+    File: 16 bytes header, then 32 bytes records appended on each completed download
+*/
+typedef struct gelbooru_index_record {
+    unsigned char md5[16];
+    uint64_t size;
+    char format[8];     // NUL padded
+} gelbooru_index_record;
+
+typedef struct gelbooru_index {
+    char *path;
+    int fd;
+    gelbooru_hash_set *hashes;
+    pthread_mutex_t mutex;
+} gelbooru_index;
+
+gelbooru_index* gelbooru_index_open(const char *dir_path);
+void            gelbooru_index_close(gelbooru_index *index);
+int             gelbooru_index_contains(gelbooru_index *index, const char *hash);
+int             gelbooru_index_record_init(gelbooru_index_record *record, const char *hash, const char *format, uint64_t size);
+int             gelbooru_index_add(gelbooru_index *index, const char *hash, const char *format, uint64_t size);
+int             gelbooru_split_image_name(const char *name, char *hash, char *format, size_t format_size);
+int             gelbooru_index_rebuild(const char *dir_path);
+gelbooru_index_record*  gelbooru_index_read_records(const char *dir_path, size_t *count);
+int                     gelbooru_index_record_compare(const void *a, const void *b);
+
+
+
+/*
+    RATE LIMITER
+    Token bucket shared by threads, rate adapts to throttled responses (AIMD)
+*/
+#define GELBOORU_RATE_MIN_DIVISOR       16
+#define GELBOORU_RATE_INCREASE_STEPS    32
+
+typedef struct gelbooru_rate_limiter {
+    double rate;        // current requests per second
+    double max_rate;    // configured rate, 0 is unlimited
+    double min_rate;
+    double tokens;
+    long long last_ms;
+    long long backoff_ms;   // no rate decrease until then
+    long long throttled;
+    pthread_mutex_t mutex;
+} gelbooru_rate_limiter;
+
+gelbooru_rate_limiter*  gelbooru_rate_limiter_create(double rate);
+void                    gelbooru_rate_limiter_destroy(gelbooru_rate_limiter *limiter);
+void                    gelbooru_rate_limiter_refill_locked(gelbooru_rate_limiter *limiter, long long now);
+long long               gelbooru_rate_limiter_try_take(gelbooru_rate_limiter *limiter);
+void                    gelbooru_rate_limiter_wait(gelbooru_rate_limiter *limiter);
+int                     gelbooru_rate_limiter_feedback(gelbooru_rate_limiter *limiter, long http_code);
+double                  gelbooru_rate_limiter_rate(gelbooru_rate_limiter *limiter);
+
+
+
+/*
+    RETRY
+    Error classes of failed requests, backoff policy and delayed retries heap
+*/
+#define GELBOORU_ERROR_NONE         0
+#define GELBOORU_ERROR_DNS          1
+#define GELBOORU_ERROR_NETWORK      2   // connect, timeout, interrupted transfer
+#define GELBOORU_ERROR_SERVER       3   // 5xx, 429
+#define GELBOORU_ERROR_NOT_FOUND    4   // 404, 410
+#define GELBOORU_ERROR_OTHER        5
+#define GELBOORU_ERROR_CORRUPT      6   // body does not match MD5 of post
+
+#define GELBOORU_RETRY_BASE_MS      1000
+#define GELBOORU_RETRY_MAX_MS       60000
+
+#define GELBOORU_MISSING_FILE_NAME  ".gelbooru_missing"
+#define GELBOORU_FAILED_FILE_NAME   ".gelbooru_failed"
+
+typedef struct gelbooru_retry_item {
+    long long ready_at_ms;
+    void *item;
+} gelbooru_retry_item;
+
+// min-heap by ready_at_ms
+typedef struct gelbooru_retry_heap {
+    gelbooru_retry_item *items;
+    int size;
+    int capacity;
+} gelbooru_retry_heap;
+
+int                     gelbooru_error_class(CURLcode res, long http_code);
+const char*             gelbooru_error_class_name(int error_class);
+int                     gelbooru_retry_max_attempts(int error_class);
+long long               gelbooru_retry_delay_ms(int error_class, int attempt, unsigned int *seed);
+
+gelbooru_retry_heap*    gelbooru_retry_heap_create(void);
+void                    gelbooru_retry_heap_destroy(gelbooru_retry_heap *heap);
+int                     gelbooru_retry_heap_push(gelbooru_retry_heap *heap, void *item, long long ready_at_ms);
+long long               gelbooru_retry_heap_next_ms(gelbooru_retry_heap *heap);
+void*                   gelbooru_retry_heap_pop_ready(gelbooru_retry_heap *heap, long long now);
+
+
+
+/*
+    HASH FILE
+    Append-only text file of MD5 hashes, one per line with optional note
+*/
+typedef struct gelbooru_hash_file {
+    char *path;
+    FILE *fp;
+    gelbooru_hash_set *hashes;
+    long long added;
+    pthread_mutex_t mutex;
+} gelbooru_hash_file;
+
+gelbooru_hash_file* gelbooru_hash_file_open(const char *dir_path, const char *name);
+void                gelbooru_hash_file_close(gelbooru_hash_file *file);
+int                 gelbooru_hash_file_contains(gelbooru_hash_file *file, const char *hash);
+int                 gelbooru_hash_file_add(gelbooru_hash_file *file, const char *hash, const char *note);
+long long           gelbooru_hash_file_added(gelbooru_hash_file *file);
+long long           gelbooru_hash_file_size(gelbooru_hash_file *file);
+
+
+
+/*
+    VERIFY
+    Checks downloaded images against MD5 in their names with a thread pool
+    Bad images can be removed and requeued, next download run fetches them first
+*/
+#define GELBOORU_REQUEUE_FILE_NAME  ".gelbooru_requeue"
+#define GELBOORU_VERIFY_CHUNK_SIZE  (4 * 1024 * 1024)
+
+#define GELBOORU_VERIFY_OK          0
+#define GELBOORU_VERIFY_CORRUPT     1
+#define GELBOORU_VERIFY_TRUNCATED   2   // shorter than size in index
+#define GELBOORU_VERIFY_ORPHAN_PART 3   // .part file of interrupted download
+#define GELBOORU_VERIFY_UNREADABLE  4
+#define GELBOORU_VERIFY_RESULTS     5
+
+typedef struct gelbooru_verify_report {
+    long long checked;
+    long long bytes;
+    long long counts[GELBOORU_VERIFY_RESULTS];
+} gelbooru_verify_report;
+
+typedef struct gelbooru_verify {
+    const char *dir_path;
+    vector *names;                  // image and part file names of dir
+    atomic_int next;                // next name to check
+    gelbooru_index_record *records; // sorted by MD5, NULL if no index
+    size_t record_count;
+    gelbooru_hash_file *requeue;    // NULL if bad images are only reported
+    gelbooru_verify_report report;
+    pthread_mutex_t mutex;
+} gelbooru_verify;
+
+int         gelbooru_verify_file(const char *path, const unsigned char *md5, long long expected_size, long long *size);
+const char* gelbooru_verify_result_name(int result);
+void*       gelbooru_verify_thread_func(void *arg);
+int         gelbooru_verify_dir(const char *dir_path, int thread_count, int requeue, gelbooru_verify_report *report);
+
+
+
+/*
+    PACK
+    Images appended to large segment files instead of one file per image
+    Segment: entries of 32 bytes header (same as index record) and image bytes
+    Pack index: 16 bytes header, then 48 bytes records written after their bytes are written
+*/
+#define GELBOORU_PACK_INDEX_FILE_NAME   ".gelbooru_pack_index"
+#define GELBOORU_PACK_MAGIC             "GBPACK01"
+#define GELBOORU_PACK_SEGMENT_FORMAT    "%s/pack-%06u.gbpack"
+#define GELBOORU_PACK_SEGMENT_SIZE      (1ULL << 30)
+#define GELBOORU_PACK_BUFFER_SIZE       (4 * 1024 * 1024)
+
+typedef struct gelbooru_pack_record {
+    unsigned char md5[16];
+    uint32_t segment;
+    uint32_t reserved;
+    uint64_t offset;    // of image bytes in segment
+    uint64_t length;
+    char format[8];     // NUL padded
+} gelbooru_pack_record;
+
+typedef struct gelbooru_pack {
+    char *dir_path;
+    int index_fd;
+    int segment_fd;
+    uint32_t segment;
+    uint64_t segment_size;  // with buffered bytes
+    char *buffer;           // segment bytes not written yet
+    size_t buffered;
+    gelbooru_pack_record *pending;  // records of buffered bytes
+    int pending_count;
+    int pending_capacity;
+    gelbooru_hash_set *hashes;
+    pthread_mutex_t mutex;
+} gelbooru_pack;
+
+gelbooru_pack*          gelbooru_pack_open(const char *dir_path);
+void                    gelbooru_pack_close(gelbooru_pack *pack);
+int                     gelbooru_pack_contains(gelbooru_pack *pack, const char *hash);
+int                     gelbooru_pack_flush(gelbooru_pack *pack);
+int                     gelbooru_pack_sync(gelbooru_pack *pack);
+int                     gelbooru_pack_append(gelbooru_pack *pack, const char *hash, const char *format, const void *data, size_t size);
+int                     gelbooru_pack_append_file(gelbooru_pack *pack, const char *hash, const char *format, const char *path);
+gelbooru_pack_record*   gelbooru_pack_read_records(const char *dir_path, size_t *count);
+int                     gelbooru_pack_export(const char *dir_path, const char *out_dir, vector *hashes);
+
+
+
+
+/*
+    EVENT LOG
+    NDJSON events buffered in memory and written to fd in batches
+*/
+#define GELBOORU_EVENT_BUFFER_SIZE  (64 * 1024)
+#define GELBOORU_EVENT_LINE_SIZE    512
+
+typedef struct gelbooru_event_log {
+    int fd;
+    char *buffer;
+    size_t size;
+    pthread_mutex_t mutex;
+} gelbooru_event_log;
+
+gelbooru_event_log* gelbooru_event_log_create(int fd);
+void                gelbooru_event_log_destroy(gelbooru_event_log *log);
+void                gelbooru_event_log_flush(gelbooru_event_log *log);
+void                gelbooru_event(gelbooru_event_log *log, const char *type, const char *fields_format, ...);
+
+
+
+
+/*
+    METRICS
+    Log-linear (HDR-style) histograms of request phases, recorded lock free
+    Bucket width is 1/16 of its power of two, about 6% relative error
+*/
+#define GELBOORU_HISTOGRAM_SUB_BITS     4
+#define GELBOORU_HISTOGRAM_SUB_COUNT    (1 << GELBOORU_HISTOGRAM_SUB_BITS)
+#define GELBOORU_HISTOGRAM_MAX_EXPONENT 40  // values up to 2^41 us
+#define GELBOORU_HISTOGRAM_BUCKETS      ((GELBOORU_HISTOGRAM_MAX_EXPONENT - GELBOORU_HISTOGRAM_SUB_BITS + 2) * GELBOORU_HISTOGRAM_SUB_COUNT)
+
+typedef struct gelbooru_histogram {
+    atomic_llong counts[GELBOORU_HISTOGRAM_BUCKETS];
+    atomic_llong count;
+    atomic_llong sum;
+    atomic_llong max;
+} gelbooru_histogram;
+
+#define GELBOORU_REQUEST_PAGE   0   // listing pages, API and tag search
+#define GELBOORU_REQUEST_IMAGE  1
+#define GELBOORU_REQUEST_KINDS  2
+
+// dns, connect and tls are recorded only for new connections
+#define GELBOORU_STAGE_DNS      0
+#define GELBOORU_STAGE_CONNECT  1
+#define GELBOORU_STAGE_TLS      2
+#define GELBOORU_STAGE_TTFB     3   // request sent to first byte
+#define GELBOORU_STAGE_TRANSFER 4   // first to last byte
+#define GELBOORU_STAGE_TOTAL    5
+#define GELBOORU_STAGES         6
+
+#define GELBOORU_METRICS_DUMP_INTERVAL_MS   5000
+
+typedef struct gelbooru_request_metrics {
+    gelbooru_histogram stages[GELBOORU_STAGES];
+    atomic_llong requests;
+    atomic_llong errors;    // curl error or status other than 200/206
+    atomic_llong bytes;
+} gelbooru_request_metrics;
+
+typedef struct gelbooru_metrics {
+    gelbooru_request_metrics kinds[GELBOORU_REQUEST_KINDS];
+} gelbooru_metrics;
+
+int         gelbooru_histogram_bucket(long long value);
+long long   gelbooru_histogram_bucket_upper(int bucket);
+void        gelbooru_histogram_record(gelbooru_histogram *histogram, long long value);
+long long   gelbooru_histogram_percentile(gelbooru_histogram *histogram, double percentile);
+
+gelbooru_metrics*   gelbooru_metrics_create(void);
+void                gelbooru_metrics_destroy(gelbooru_metrics *metrics);
+void                gelbooru_metrics_record_request(gelbooru_metrics *metrics, int kind, CURL *curl, CURLcode res);
+const char*         gelbooru_metrics_kind_name(int kind);
+const char*         gelbooru_metrics_stage_name(int stage);
+void                gelbooru_metrics_print(gelbooru_metrics *metrics, FILE *fp);
+int                 gelbooru_metrics_write_json(gelbooru_metrics *metrics, FILE *fp);
+int                 gelbooru_metrics_write_prometheus(gelbooru_metrics *metrics, FILE *fp);
+int                 gelbooru_metrics_dump(gelbooru_metrics *metrics, const char *path);
+
 
 
 
 /*
     PROGRESS BAR
 */
+#define PROGRESS_BAR_TEXT_SIZE  64
+#define PROGRESS_BAR_MAX_WIDTH  100
+#define PROGRESS_BAR_LINE_SIZE  (PROGRESS_BAR_TEXT_SIZE * 2 + PROGRESS_BAR_MAX_WIDTH + 32)
+
+#define PROGRESS_BAR_UNIT_NONE  0
+#define PROGRESS_BAR_UNIT_BYTES 1
+
+// progress is updated lock free, texts are copied to fixed buffers under mutex
 typedef struct ProgressBar {
-    int progress;
-    int max_progress;
+    atomic_llong progress;
+    atomic_llong max_progress;
     int bar_width;
-    char *prefix_text;
-    char *postfix_text;
+    int unit;
+    char prefix_text[PROGRESS_BAR_TEXT_SIZE];
+    char postfix_text[PROGRESS_BAR_TEXT_SIZE];
     pthread_mutex_t mutex;
 } ProgressBar;
 
 
 ProgressBar*    ProgressBar_create(int bar_width);
 void            ProgressBar_destroy(ProgressBar *bar);
-void            ProgressBar_set_progress(ProgressBar* bar, int progress);
-void            ProgressBar_set_max_progress(ProgressBar* bar, int max_progress);
+void            ProgressBar_set_progress(ProgressBar* bar, long long progress);
+void            ProgressBar_set_max_progress(ProgressBar* bar, long long max_progress);
+void            ProgressBar_set_unit(ProgressBar* bar, int unit);
 void            ProgressBar_set_prefix_text(ProgressBar* bar, const char *text);
 void            ProgressBar_set_postfix_text(ProgressBar* bar, const char *text);
+int             ProgressBar_render(ProgressBar* bar, char *buffer, size_t size);
 void            ProgressBar_print(ProgressBar* bar);
 
 
@@ -89,6 +477,7 @@ void            ProgressBar_print(ProgressBar* bar);
 typedef struct gelbooru_raw_data {
     char *data;
     size_t size;
+    size_t capacity;
 } gelbooru_raw_data;
 
 
@@ -98,6 +487,39 @@ typedef struct gelbooru_tag {
 } gelbooru_tag;
 
 
+/*
+    Post from listing, download queue item
+    format and file_url are known only in API listing mode
+*/
+typedef struct gelbooru_post {
+    char *hash;
+    char *format;
+    char *file_url;
+    long long id;
+    struct gelbooru_job *job;   // job of run that queued post
+} gelbooru_post;
+
+/* Receives parsed posts, returns number of first posts it takes ownership of */
+typedef int (*gelbooru_posts_callback)(gelbooru_post **posts, int count, void *userp);
+
+
+/*
+    HTML posts page parsed while loading
+*/
+typedef struct gelbooru_page_stream {
+    CURL *curl;
+    int status_checked;         // status is known on first chunk of body
+    gelbooru_raw_data buffer;   // unscanned tail of page
+    vector *hashes;
+    int max_pid;
+    long long max_id;   // newest post id, -1 if none
+    int post_count;
+    vector *posts;
+    gelbooru_posts_callback on_posts;
+    void *userp;
+} gelbooru_page_stream;
+
+
 typedef struct gelbooru_thread_arg {
    int thread_id;
    struct gelbooru* gbooru;
@@ -105,31 +527,216 @@ typedef struct gelbooru_thread_arg {
 } gelbooru_thread_arg;
 
 
-typedef struct gelbooru_downloader_data {
+/*
+    One image download, tries added formats one by one
+*/
+#define GELBOORU_TRANSFER_READY         0
+#define GELBOORU_TRANSFER_DONE          1   // downloaded, stored by gelbooru_transfer_write
+#define GELBOORU_TRANSFER_EXISTS        2
+#define GELBOORU_TRANSFER_NEXT_FORMAT   3
+#define GELBOORU_TRANSFER_FAILED        4
+#define GELBOORU_TRANSFER_RETRY         5
+
+#define GELBOORU_PART_FILE_SUFFIX       ".part"
+#define GELBOORU_TRANSFER_MAX_RESUMES   3
+#define GELBOORU_TRANSFER_MEMORY_LIMIT  (16 * 1024 * 1024)  // bigger images are streamed to part file
+#define GELBOORU_MEMORY_BUDGET          (256 * 1024 * 1024) // images of all transfers in memory, rest is streamed to part file
+
+// writer stage, stores downloaded images so network threads never wait for disk
+#define GELBOORU_WRITE_QUEUE_CAPACITY   64
+#define GELBOORU_WRITE_BATCH            16
+
+#define GELBOORU_FSYNC_NONE     0
+#define GELBOORU_FSYNC_IMAGE    1   // each image before rename
+#define GELBOORU_FSYNC_BATCH    2   // batch of images written first, then synced
+
+/*
+    Per-run image format hits, formats are tried from most frequent
+*/
+typedef struct gelbooru_format_stats {
+    int count;
+    int *hits;
+    pthread_mutex_t mutex;
+} gelbooru_format_stats;
+
+
+/*
+    Query of a run with own output dir and formats
+    Jobs of a run share parser and downloader threads, connection cache and queued hashes
+*/
+typedef struct gelbooru_job {
+    int id;     // position in run
     vector *tags;
+    char *dir_path;
+    vector *formats;    // empty takes formats of gelbooru when opened
+    int format_group;   // first job of run with same formats, posts are downloaded once per group
+    int layout;
+    atomic_uint shard_dirs[GELBOORU_SHARD_DIRS / 32];   // bit per created ab/cd dir of this run
+
+    // open during run
+    gelbooru_pack *pack;    // open with pack storage
+    gelbooru_index *index;
+    gelbooru_hash_file *missing;    // 404 in all formats, skipped in later runs
+    gelbooru_hash_file *failed;     // retries exhausted
+    gelbooru_format_stats *format_stats;
+    gelbooru_hash_set *listed;      // posts listed for job in run, listed again they are dropped
+
+    // sync
+    char *query;            // tags as stored in sync file
+    long long sync_id;      // newest post id of last complete run, -1 if none
+    vector *query_tags;     // tags with id:>sync_id filter, NULL lists tags
+
+    // pages, guarded by parser mutex of run
+    int next_page;
+    int max_page;   // -1 until first page is parsed
+    int parser_failed;  // first page failed or job is not open
+    int pages_failed;
+    long long max_id;   // newest post id listed in run
+    int total;          // posts of listing reported by pages, -1 until known
+    int listed_posts;   // unique posts of listing pages
+    int listing_changed;    // pages reported different listings, posts may have shifted between pages
+} gelbooru_job;
+
+/* Posts callback arg of job */
+typedef struct gelbooru_job_arg {
+    struct gelbooru_downloader_data *data;
+    gelbooru_job *job;
+    int listing;    // posts of listing page, counted for sync
+} gelbooru_job_arg;
+
+
+typedef struct gelbooru_transfer {
+    struct gelbooru *gbooru;
+    gelbooru_job *job;
+    gelbooru_post *post;
+    gelbooru_format_stats *stats;
+    gelbooru_index *index;
+    int *format_order;
+    int format_count;
+    int format_pos;
+    int format_index;
+    char *url;
+    char *output_path;
+    char *part_path;        // image is written here and renamed to output_path when done
+    FILE *fp;
+    char *body;             // new image is kept in memory up to GELBOORU_TRANSFER_MEMORY_LIMIT
+    size_t body_size;
+    size_t body_capacity;
+    int in_memory;
+    int write_fd;           // part file written by writer stage, -1 if closed
+    CURL *curl;
+    ProgressBar *bar;
+    curl_off_t dlnow;
+    curl_off_t dltotal;
+    curl_off_t written;
+    curl_off_t resume_from; // bytes of part file requested to skip with Range
+    int restart;            // next call retries same format from part file
+    int resumes;
+    int attempts;       // delayed retries of transient errors
+    int error_class;    // of last failed request
+    int not_found;      // formats answered 404
+    long long started_ms;
+    int verify;             // post hash is MD5, body is hashed while written
+    unsigned char md5[16];  // expected
+    gelbooru_md5_ctx md5_ctx;
+} gelbooru_transfer;
+
+
+/*
+    Downloader slot, one in-flight transfer of curl multi
+*/
+typedef struct gelbooru_download_slot {
+    CURL *curl;
+    gelbooru_transfer *transfer;
+    int waiting;    // handle is ready, waits for image request token
+} gelbooru_download_slot;
+
+
+typedef struct gelbooru_downloader_data {
+    vector *jobs;
+    int next_job;   // jobs before it have no pages left
     ThreadSafeQueue *download_queue;
+    gelbooru_hash_set **group_hashes;   // posts queued per format group, NULL for group of one job
+    vector *shared_posts;   // posts queued by other job of group, stored for their job after downloads
 
-    pthread_t *parser_thread;
-    gelbooru_thread_arg *parser_arg;
+    int parser_thread_count;
+    pthread_t *parser_threads;
+    gelbooru_thread_arg *parser_args;
     ProgressBar *parser_bar;
 
+    // pages of jobs shared by parser threads
+    pthread_mutex_t parser_mutex;
+    pthread_cond_t parser_cond;
+    int pages_done;
+    int pages_total;    // of jobs with parsed first page
+    int parser_failed;  // stops all parser threads
+    int pages_failed;   // pages other than first failed after retries
+
+    // request budgets shared by all threads
+    gelbooru_rate_limiter *page_limiter;
+    gelbooru_rate_limiter *image_limiter;
+
     int download_thread_count;
+    long long missing_skipped;
+    gelbooru_event_log *events;
+
+    // run summary
+    long long started_ms;
+    atomic_llong images_downloaded;
+    atomic_llong bytes_downloaded;
+    atomic_llong posts_queued;
+    atomic_llong posts_finished;   // equals posts_queued when no post is lost
+
     pthread_t *downloader_threads;
     gelbooru_thread_arg *downloader_args;
+
+    ThreadSafeQueue *write_queue;   // downloaded transfers, NULL if written by downloaders
+    int writer_thread_count;
+    pthread_t *writer_threads;
+    gelbooru_thread_arg *writer_args;
     ProgressBar **downloader_bars; 
 
     pthread_t *progress_thread;
     gelbooru_thread_arg *progress_arg;
+    atomic_int downloaders_finished;
 } gelbooru_downloader_data;
 
 
 typedef struct gelbooru {
+    char *host;     // NULL is GELBOORU_HOST
     char *user_agent;
     char *downloads_dir_path;
+    int parser_thread_count;
     int download_thread_count;
-    int parser_sleep_ms;
-    int downloader_sleep_ms;
+    int download_transfers_per_thread;
+    int download_queue_capacity;
+    double page_rate;   // requests per second, 0 is unlimited
+    double image_rate;
     vector *img_formats;
+    int writer_thread_count;
+    int fsync_policy;
+    int storage;
+    int layout;
+    long long memory_budget;    // bytes of in-memory images of all transfers
+    atomic_llong memory_used;
+
+    int listing_mode;
+    char *api_user_id;
+    char *api_key;
+
+    int headless;   // no terminal progress rendering
+    int verify_md5; // check downloaded bytes against post hash
+    int sync;       // list only posts newer than last run of query
+    int event_fd;   // NDJSON events, -1 if disabled
+
+    gelbooru_metrics *metrics;  // all requests of gelbooru object
+    char *metrics_path;         // periodic dump, NULL if disabled
+
+    CURLSH *share;
+    pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+    gelbooru_job *image_job;    // open job of gelbooru_download_image, reopened when settings change
+    pthread_mutex_t image_job_mutex;
 } gelbooru;
 
 
@@ -141,30 +748,104 @@ void                        gelbooru_downloader_data_destroy(gelbooru_downloader
 
 int     gelbooru_directory_exists(const char *dir_path);
 int     gelbooru_file_exists(const char *path);
+int     gelbooru_list_images(const char *dir_path, vector *names);
+char*   gelbooru_construct_listed_image_path(const char *dir_path, const char *name, char *hash, char *format, size_t format_size);
+int     gelbooru_make_shard_dirs(atomic_uint *shard_dirs, const char *outdir, const char *hash);
+int     gelbooru_dir_is_sharded(const char *dir_path);
+int     gelbooru_mark_dir_sharded(const char *dir_path);
+int     gelbooru_migrate_to_sharded(const char *dir_path, int thread_count);
 int     gelbooru_mkdir(const char *dir_path);
+int     gelbooru_copy_file(const char *from, const char *to);
+
+long long   gelbooru_time_ms(void);
+
+void    gelbooru_share_lock_curl_callback(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp);
+void    gelbooru_share_unlock_curl_callback(CURL *handle, curl_lock_data data, void *userp);
+CURL*   gelbooru_curl_easy_create(gelbooru* gbooru);
 
 size_t              gelbooru_rawdata_write_curl_callback(void *contents, size_t size, size_t nmemb, void *userp);
 gelbooru_raw_data*  gelbooru_get_request(gelbooru* gbooru, const char* url);
+gelbooru_raw_data*  gelbooru_get_request_with_handle(gelbooru* gbooru, CURL *curl, const char* url);
 void                gelbooru_raw_data_free(gelbooru_raw_data* data);
 
+void gelbooru_set_host(gelbooru* gbooru, const char *host);
 void gelbooru_set_user_agent(gelbooru* gbooru, const char *user_agent);
+void gelbooru_set_parser_thread_count(gelbooru* gbooru, int count);
 void gelbooru_set_download_thread_count(gelbooru* gbooru, int count);
+void gelbooru_set_download_transfers_per_thread(gelbooru* gbooru, int count);
+void gelbooru_set_download_queue_capacity(gelbooru* gbooru, int capacity);
 void gelbooru_set_downloads_dirpath(gelbooru* gbooru, const char* path);
+void gelbooru_set_page_rate(gelbooru* gbooru, double rate);
+void gelbooru_set_image_rate(gelbooru* gbooru, double rate);
 void gelbooru_set_parser_sleep_ms(gelbooru* gbooru, int ms);
 void gelbooru_set_downloader_sleep_ms(gelbooru* gbooru, int ms);
+void gelbooru_set_listing_mode(gelbooru* gbooru, int mode);
+void gelbooru_set_api_credentials(gelbooru* gbooru, const char *user_id, const char *api_key);
+void gelbooru_set_layout(gelbooru* gbooru, int layout);
+void gelbooru_set_storage(gelbooru* gbooru, int storage);
+void gelbooru_set_writer_thread_count(gelbooru* gbooru, int count);
+void gelbooru_set_fsync_policy(gelbooru* gbooru, int policy);
+void gelbooru_set_memory_budget(gelbooru* gbooru, long long bytes);
+void gelbooru_set_headless(gelbooru* gbooru, int headless);
+void gelbooru_set_verify_md5(gelbooru* gbooru, int verify);
+void gelbooru_set_sync(gelbooru* gbooru, int sync);
+void gelbooru_set_event_fd(gelbooru* gbooru, int fd);
+void gelbooru_set_metrics_path(gelbooru* gbooru, const char *path);
 
 int     gelbooru_add_image_format(gelbooru* gbooru, const char *format);
 vector* gelbooru_get_image_formats(gelbooru* gbooru);
 
-char*   gelbooru_construct_tag_search_url(const char* query);
+gelbooru_format_stats*  gelbooru_format_stats_create(int count);
+void                    gelbooru_format_stats_destroy(gelbooru_format_stats *stats);
+void                    gelbooru_format_stats_hit(gelbooru_format_stats *stats, int format_index);
+void                    gelbooru_format_stats_order(gelbooru_format_stats *stats, int *order);
+
+const char* gelbooru_get_host(gelbooru* gbooru);
+char*   gelbooru_construct_tag_search_url(const char *host, const char* query);
 char*   gelbooru_construct_tags_query(vector* tags);
-char*   gelbooru_construct_posts_page_url(vector* tags, int pid);
-char*   gelbooru_construct_image_url(const char *hash, const char *format);
+char*   gelbooru_construct_posts_page_url(const char *host, vector* tags, int pid);
+char*   gelbooru_construct_api_posts_url(const char *host, vector* tags, int pid, const char *user_id, const char *api_key);
+char*   gelbooru_construct_image_url(const char *host, const char *hash, const char *format);
 char*   gelbooru_construct_image_output_path(const char *outdir, const char *hash, const char *format);
+char*   gelbooru_construct_sharded_image_output_path(const char *outdir, const char *hash, const char *format);
+char*   gelbooru_construct_download_path(gelbooru_job *job, const char *hash, const char *format);
+
+gelbooru_job*   gelbooru_job_create(const char *dir_path);
+void            gelbooru_job_destroy(gelbooru_job *job);
+int             gelbooru_job_add_tag(gelbooru_job *job, const char *tag);
+int             gelbooru_job_add_format(gelbooru_job *job, const char *format);
+int             gelbooru_job_open(gelbooru* gbooru, gelbooru_job *job);
+void            gelbooru_job_close(gelbooru_job *job);
+int             gelbooru_job_has_image(gelbooru_job *job, const char *hash);
+int             gelbooru_job_save_sync(gelbooru_job *job);
+int             gelbooru_job_listing_stable(gelbooru_job *job);
+long long       gelbooru_sync_read(const char *dir_path, const char *query);
+int             gelbooru_sync_write(const char *dir_path, const char *query, long long id);
+vector*         gelbooru_read_jobs(const char *path);
+void            gelbooru_job_list_free(vector *jobs);
 
 vector* gelbooru_parse_tags(gelbooru_raw_data* raw_data);
+size_t  gelbooru_scan_posts_html(const char *data, size_t size, int final, vector *hashes, int *max_pid, long long *max_id);
+int     gelbooru_parse_posts_html(gelbooru_raw_data* page_html, vector *hashes, int *max_pid);
 vector* gelbooru_parse_image_hashes(gelbooru_raw_data* page_html);
 int     gelbooru_parse_max_pid(gelbooru_raw_data* page_html);
+vector* gelbooru_parse_api_posts(gelbooru_raw_data* raw_data, int *total_count);
+
+const char* gelbooru_json_object_end(const char *cursor, const char *end);
+const char* gelbooru_json_find_value(const char *object, const char *end, const char *key);
+char*       gelbooru_json_string_value(const char *object, const char *end, const char *key);
+long long   gelbooru_json_int_value(const char *object, const char *end, const char *key);
+
+gelbooru_post*  gelbooru_post_create(char *hash);
+void            gelbooru_post_free(gelbooru_post *post);
+void            gelbooru_post_list_free(vector *posts);
+int             gelbooru_post_list_push_callback(gelbooru_post **posts, int count, void *userp);
+int             gelbooru_deliver_posts(vector *posts, gelbooru_posts_callback on_posts, void *userp);
+
+void    gelbooru_page_stream_flush(gelbooru_page_stream *stream);
+size_t  gelbooru_page_stream_write_curl_callback(void *contents, size_t size, size_t nmemb, void *userp);
+int     gelbooru_stream_posts_page(gelbooru* gbooru, CURL *curl, vector* tags, int page, int *max_page, int *total, long long *max_id, gelbooru_posts_callback on_posts, void *userp);
+vector* gelbooru_fetch_posts_page(gelbooru* gbooru, CURL *curl, vector* tags, int page, int *max_page);
 
 vector* gelbooru_tag_search(gelbooru* gbooru, const char* query);
 void    gelbooru_tag_list_free(vector* tags);
@@ -172,12 +853,50 @@ void    gelbooru_tag_list_free(vector* tags);
 size_t  gelbooru_image_write_curl_callback(void *contents, size_t size, size_t nmemb, void *userp);
 int     gelbooru_image_write_progress_curl_callback(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
 int     gelbooru_download_image(gelbooru* gbooru, const char * hash, ProgressBar *bar);
-
+int     gelbooru_download_job_image(gelbooru* gbooru, gelbooru_job *job, const char *hash, ProgressBar *bar);
+gelbooru_job*   gelbooru_image_job(gelbooru* gbooru);
+void            gelbooru_close_image_job(gelbooru* gbooru);
+
+gelbooru_transfer*  gelbooru_transfer_create(gelbooru* gbooru, gelbooru_job *job, gelbooru_post *post, ProgressBar *bar);
+void                gelbooru_transfer_destroy(gelbooru_transfer *transfer);
+int                 gelbooru_transfer_find_existing(gelbooru_transfer *transfer);
+FILE*               gelbooru_transfer_open_part(gelbooru_transfer *transfer, const char *mode);
+void                gelbooru_transfer_make_dirs(gelbooru_transfer *transfer);
+void                gelbooru_transfer_preallocate(int fd, long long size);
+int                 gelbooru_transfer_write_part(gelbooru_transfer *transfer, int fsync_policy);
+int                 gelbooru_transfer_sync_part(gelbooru_transfer *transfer);
+int                 gelbooru_transfer_commit(gelbooru_transfer *transfer);
+int                 gelbooru_transfer_write(gelbooru_transfer *transfer);
+int                 gelbooru_transfer_spill(gelbooru_transfer *transfer);
+int                 gelbooru_transfer_reserve_body(gelbooru_transfer *transfer, size_t size);
+void                gelbooru_transfer_free_body(gelbooru_transfer *transfer);
+int                 gelbooru_transfer_next(gelbooru_transfer *transfer, CURL *curl);
+int                 gelbooru_transfer_complete(gelbooru_transfer *transfer, CURL *curl, CURLcode res);
+
+gelbooru_job*   gelbooru_parser_take_page(gelbooru_downloader_data* data, int *page);
+void            gelbooru_parser_finish_page(gelbooru_downloader_data* data, gelbooru_job *job, int page, int max_page, int total, long long max_id, int failed);
+int     gelbooru_parser_push_posts_callback(gelbooru_post **posts, int count, void *userp);
 void*   gelbooru_parser_thread_func(void *arg);
+void    gelbooru_downloader_slot_finish(gelbooru_download_slot *slot, int *done_count);
+int     gelbooru_downloader_slot_add(CURLM *multi, gelbooru_download_slot *slot, gelbooru_downloader_data* data, long long *wait_ms);
+void    gelbooru_downloader_write_batch(gelbooru_downloader_data* data, gelbooru_transfer **transfers, int count);
+void    gelbooru_downloader_write(gelbooru_downloader_data* data, gelbooru_transfer *transfer);
+void*   gelbooru_writer_thread_func(void *arg);
+int     gelbooru_downloader_queue_requeued(gelbooru_downloader_data* data, gelbooru_job *job);
+int     gelbooru_downloader_store_shared(gelbooru_downloader_data* data);
+long long   gelbooru_downloader_duplicates(gelbooru_downloader_data* data);
+void    gelbooru_downloader_record_failure(gelbooru_downloader_data* data, gelbooru_transfer *transfer);
+int     gelbooru_downloader_slot_start(CURLM *multi, gelbooru_download_slot *slot, gelbooru_downloader_data* data, long long *wait_ms, int *done_count);
 void*   gelbooru_downloader_thread_func(void *arg);
+void    gelbooru_print_run_summary(gelbooru_downloader_data* data, FILE *fp);
+int     gelbooru_progress_render(gelbooru_downloader_data* data, char *buffer, size_t size, int rewind);
+int     gelbooru_write_all(int fd, const char *buffer, size_t size);
 void*   gelbooru_progress_thread_func(void *arg);
 
 void    gelbooru_download(gelbooru* gbooru, vector* tags);
+void    gelbooru_download_jobs_cleanup(gelbooru_downloader_data* data);
+void    gelbooru_download_jobs_abort(gelbooru_downloader_data* data);
+void    gelbooru_download_jobs(gelbooru* gbooru, vector* jobs);
 
 
 
@@ -204,25 +923,72 @@ gelbooru* gelbooru_create(void) {
         return NULL;
     }
 
+    gbooru->host = NULL;
     gbooru->user_agent = NULL;
     gbooru->downloads_dir_path = NULL;
+    gbooru->parser_thread_count = 1;
     gbooru->download_thread_count = 1;
-    gbooru->parser_sleep_ms = 500;
-    gbooru->downloader_sleep_ms = 500;
+    gbooru->download_transfers_per_thread = 8;
+    gbooru->download_queue_capacity = TSQ_DEFAULT_CAPACITY;
+    gbooru->page_rate = 2;
+    gbooru->image_rate = 16;
+    gbooru->listing_mode = GELBOORU_LISTING_HTML;
+    gbooru->writer_thread_count = 2;
+    gbooru->fsync_policy = GELBOORU_FSYNC_NONE;
+    gbooru->storage = GELBOORU_STORAGE_FILES;
+    gbooru->layout = GELBOORU_LAYOUT_FLAT;
+    gbooru->memory_budget = GELBOORU_MEMORY_BUDGET;
+    atomic_init(&gbooru->memory_used, 0);
+    gbooru->api_user_id = NULL;
+    gbooru->api_key = NULL;
+    gbooru->headless = 0;
+    gbooru->verify_md5 = 1;
+    gbooru->sync = 0;
+    gbooru->event_fd = -1;
+    gbooru->metrics_path = NULL;
+    gbooru->image_job = NULL;
+    pthread_mutex_init(&gbooru->image_job_mutex, NULL);
+    gbooru->metrics = gelbooru_metrics_create();
     gbooru->img_formats = vector_create();
-    if (gbooru->img_formats == NULL) {
-        printf("Failed to create image formats vector\n");
+    if (gbooru->img_formats == NULL || gbooru->metrics == NULL) {
+        printf("Failed to create image formats vector or metrics\n");
+        vector_destroy(gbooru->img_formats);
+        gelbooru_metrics_destroy(gbooru->metrics);
         free(gbooru);
         return NULL;
     }
+
+    // DNS and TLS session caches shared by all parser and downloader handles
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&gbooru->share_locks[i], NULL);
+    }
+    gbooru->share = curl_share_init();
+    if (gbooru->share == NULL) {
+        printf("Failed to create curl share\n");
+        gelbooru_destroy(gbooru);
+        return NULL;
+    }
+    curl_share_setopt(gbooru->share, CURLSHOPT_LOCKFUNC, gelbooru_share_lock_curl_callback);
+    curl_share_setopt(gbooru->share, CURLSHOPT_UNLOCKFUNC, gelbooru_share_unlock_curl_callback);
+    curl_share_setopt(gbooru->share, CURLSHOPT_USERDATA, gbooru);
+    curl_share_setopt(gbooru->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(gbooru->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
     return gbooru;
 }
 
 /* Destroy gelbooru struct */
 void gelbooru_destroy(gelbooru* gbooru) {
     if (gbooru == NULL) return;
+    gelbooru_close_image_job(gbooru);
+    pthread_mutex_destroy(&gbooru->image_job_mutex);
+    free(gbooru->host);
     free(gbooru->user_agent);
     free(gbooru->downloads_dir_path);
+    free(gbooru->api_user_id);
+    free(gbooru->api_key);
+    free(gbooru->metrics_path);
+    gelbooru_metrics_destroy(gbooru->metrics);
 
     // free formats
     for (int i = 0; i < vector_size(gbooru->img_formats); i++) {
@@ -230,6 +996,12 @@ void gelbooru_destroy(gelbooru* gbooru) {
         free(format);
     }
     vector_destroy(gbooru->img_formats);
+
+    if (gbooru->share != NULL) curl_share_cleanup(gbooru->share);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&gbooru->share_locks[i]);
+    }
+    curl_global_cleanup();
     free(gbooru);
 }
 
@@ -245,26 +1017,44 @@ gelbooru_downloader_data* gelbooru_downloader_data_create(gelbooru* gbooru) {
         return NULL;
     }
     memset(data, 0, sizeof(gelbooru_downloader_data));
+    pthread_mutex_init(&data->parser_mutex, NULL);
+    pthread_cond_init(&data->parser_cond, NULL);
 
     // download queue
-    data->download_queue = tsq_create();
+    data->download_queue = tsq_create_bounded(gbooru->download_queue_capacity);
     if (data->download_queue == NULL) {
         printf("Failed to create download queue\n");
         gelbooru_downloader_data_destroy(data);
         return NULL;
     }
 
+    data->shared_posts = vector_create();
+    if (data->shared_posts == NULL) {
+        printf("Failed to create shared posts vector\n");
+        gelbooru_downloader_data_destroy(data);
+        return NULL;
+    }
+
     // parser
-    data->parser_thread = (pthread_t*) malloc(sizeof(pthread_t));
-    if (data->parser_thread == NULL) {
-        printf("Failed to allocate mem for parser pthread\n");
+    data->parser_thread_count = gbooru->parser_thread_count;
+    data->parser_threads = (pthread_t*) malloc(sizeof(pthread_t) * data->parser_thread_count);
+    if (data->parser_threads == NULL) {
+        printf("Failed to allocate mem for parser pthreads\n");
+        gelbooru_downloader_data_destroy(data);
+        return NULL;
+    }
+
+    data->parser_args = (gelbooru_thread_arg*) malloc(sizeof(gelbooru_thread_arg) * data->parser_thread_count);
+    if (data->parser_args == NULL) {
+        printf("Failed to allocate mem for parser args\n");
         gelbooru_downloader_data_destroy(data);
         return NULL;
     }
 
-    data->parser_arg = (gelbooru_thread_arg*) malloc(sizeof(gelbooru_thread_arg));
-    if (data->parser_arg == NULL) {
-        printf("Failed to allocate mem for parser arg\n");
+    data->page_limiter = gelbooru_rate_limiter_create(gbooru->page_rate);
+    data->image_limiter = gelbooru_rate_limiter_create(gbooru->image_rate);
+    if (data->page_limiter == NULL || data->image_limiter == NULL) {
+        printf("Failed to create rate limiters\n");
         gelbooru_downloader_data_destroy(data);
         return NULL;
     }
@@ -292,6 +1082,19 @@ gelbooru_downloader_data* gelbooru_downloader_data_create(gelbooru* gbooru) {
         return NULL;
     }
 
+    // writer
+    data->writer_thread_count = gbooru->writer_thread_count;
+    if (data->writer_thread_count > 0) {
+        data->write_queue = tsq_create_bounded(GELBOORU_WRITE_QUEUE_CAPACITY);
+        data->writer_threads = (pthread_t*) malloc(sizeof(pthread_t) * data->writer_thread_count);
+        data->writer_args = (gelbooru_thread_arg*) malloc(sizeof(gelbooru_thread_arg) * data->writer_thread_count);
+        if (data->write_queue == NULL || data->writer_threads == NULL || data->writer_args == NULL) {
+            printf("Failed to create writer queue\n");
+            gelbooru_downloader_data_destroy(data);
+            return NULL;
+        }
+    }
+
     data->downloader_bars = (ProgressBar**) malloc(sizeof(ProgressBar*) * data->download_thread_count);
     if (data->downloader_bars == NULL) {
         printf("Failed to allocate mem for downloader bars\n");
@@ -330,6 +1133,11 @@ gelbooru_downloader_data* gelbooru_downloader_data_create(gelbooru* gbooru) {
 void gelbooru_downloader_data_destroy(gelbooru_downloader_data* data) {
     if (data != NULL) {
         tsq_destroy(data->download_queue);
+        if (data->group_hashes != NULL) {
+            for (int i = 0; i < vector_size(data->jobs); i++) gelbooru_hash_set_destroy(data->group_hashes[i]);
+            free(data->group_hashes);
+        }
+        gelbooru_post_list_free(data->shared_posts);
         ProgressBar_destroy(data->parser_bar);
         if (data->downloader_bars != NULL) {
             for (int i = 0; i < data->download_thread_count; i++) {
@@ -338,11 +1146,19 @@ void gelbooru_downloader_data_destroy(gelbooru_downloader_data* data) {
             free(data->downloader_bars);
         }
         
-        free(data->parser_thread);
-        free(data->parser_arg);
+        free(data->parser_threads);
+        free(data->parser_args);
+        pthread_mutex_destroy(&data->parser_mutex);
+        pthread_cond_destroy(&data->parser_cond);
+        gelbooru_rate_limiter_destroy(data->page_limiter);
+        gelbooru_rate_limiter_destroy(data->image_limiter);
 
         free(data->downloader_threads);
         free(data->downloader_args);
+        tsq_destroy(data->write_queue);
+        free(data->writer_threads);
+        free(data->writer_args);
+        gelbooru_event_log_destroy(data->events);
 
         free(data->progress_thread);
         free(data->progress_arg);
@@ -369,16 +1185,261 @@ int gelbooru_file_exists(const char *path) {
     return access(path, F_OK) == 0 ? 1 : 0;
 }
 
+/* Copy file, returns 0 if OK */
+int gelbooru_copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    if (in < 0) return -1;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    char buffer[64 * 1024];
+    ssize_t size;
+    int result = 0;
+    while ((size = read(in, buffer, sizeof(buffer))) > 0) {
+        if (gelbooru_write_all(out, buffer, size) != 0) break;
+    }
+    if (size != 0) result = -1;
+    close(in);
+    if (close(out) != 0) result = -1;
+    if (result != 0) remove(to);
+    return result;
+}
+
+/* Returns value of 2 hex chars or -1 */
+int gelbooru_hex_byte(const char *hex) {
+    int value = 0;
+    for (int i = 0; i < 2; i++) {
+        char c = hex[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+/* Returns 1 if name is 2 hex chars shard dir */
+int gelbooru_is_shard_name(const char *name) {
+    return strlen(name) == 2 && gelbooru_hex_byte(name) >= 0;
+}
+
+/*
+    Push names of files in dir and in its ab/cd shard dirs to names
+    Names are relative to dir, hidden files and shard paths too long for the path buffer are skipped
+    Returns number of pushed names or -1
+*/
+int gelbooru_list_images(const char *dir_path, vector *names) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) return -1;
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        if (!gelbooru_is_shard_name(entry->d_name)) {
+            char *name = strdup(entry->d_name);
+            if (name == NULL || vector_push_back(names, name) != 0) free(name);
+            else count++;
+            continue;
+        }
+
+        // dir/ab/cd
+        char shard_path[4096];
+        int length = snprintf(shard_path, sizeof(shard_path), "%s/%s", dir_path, entry->d_name);
+        if (length < 0 || (size_t) length >= sizeof(shard_path)) continue;
+        DIR *shard = opendir(shard_path);
+        if (shard == NULL) continue;
+        struct dirent *sub;
+        while ((sub = readdir(shard)) != NULL) {
+            if (!gelbooru_is_shard_name(sub->d_name)) continue;
+
+            char sub_path[4096];
+            length = snprintf(sub_path, sizeof(sub_path), "%s/%s", shard_path, sub->d_name);
+            if (length < 0 || (size_t) length >= sizeof(sub_path)) continue;
+            DIR *leaf = opendir(sub_path);
+            if (leaf == NULL) continue;
+            struct dirent *file;
+            while ((file = readdir(leaf)) != NULL) {
+                if (file->d_name[0] == '.') continue;
+                char *name = (char*) malloc(strlen(file->d_name) + 7);
+                if (name == NULL) continue;
+                sprintf(name, "%s/%s/%s", entry->d_name, sub->d_name, file->d_name);
+                if (vector_push_back(names, name) != 0) free(name);
+                else count++;
+            }
+            closedir(leaf);
+        }
+        closedir(shard);
+    }
+    closedir(dir);
+    return count;
+}
+
+/*
+    Split listed name (hash.ext or ab/cd/hash.ext) to hash and format
+    Returns path of image in dir, NULL if name is not image name
+*/
+char* gelbooru_construct_listed_image_path(const char *dir_path, const char *name, char *hash, char *format, size_t format_size) {
+    const char *slash = strrchr(name, '/');
+    if (gelbooru_split_image_name(slash != NULL ? slash + 1 : name, hash, format, format_size) != 0) return NULL;
+
+    if (slash != NULL) return gelbooru_construct_sharded_image_output_path(dir_path, hash, format);
+    return gelbooru_construct_image_output_path(dir_path, hash, format);
+}
+
+/*
+    Create outdir/ab and outdir/ab/cd dirs of hash
+    Created dirs are cached, each shard is created once per run
+    Returns 0 if dirs exist
+*/
+int gelbooru_make_shard_dirs(atomic_uint *shard_dirs, const char *outdir, const char *hash) {
+    int hi = gelbooru_hex_byte(hash), lo = hi >= 0 ? gelbooru_hex_byte(hash + 2) : -1;
+    if (lo < 0) return -1;
+
+    int shard = (hi << 8) | lo;
+    unsigned int bit = 1u << (shard % 32);
+    if (atomic_load_explicit(&shard_dirs[shard / 32], memory_order_relaxed) & bit) return 0;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%.2s", outdir, hash);
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) return -1;
+    snprintf(path, sizeof(path), "%s/%.2s/%.2s", outdir, hash, hash + 2);
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) return -1;
+
+    atomic_fetch_or(&shard_dirs[shard / 32], bit);
+    return 0;
+}
+
+/* Returns 1 if dir is marked as sharded */
+int gelbooru_dir_is_sharded(const char *dir_path) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, GELBOORU_SHARDED_FILE_NAME);
+    return gelbooru_file_exists(path);
+}
+
+/* Mark dir as sharded, returns 0 if OK */
+int gelbooru_mark_dir_sharded(const char *dir_path) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, GELBOORU_SHARDED_FILE_NAME);
+    int fd = open(path, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0) return -1;
+    close(fd);
+    return 0;
+}
+
+typedef struct gelbooru_migrate {
+    atomic_uint shard_dirs[GELBOORU_SHARD_DIRS / 32];
+    const char *dir_path;
+    vector *names;
+    atomic_int next;
+    atomic_int moved;
+    atomic_int failed;
+} gelbooru_migrate;
+
+/* Migrate thread func, moves flat images and part files to shard dirs */
+void* gelbooru_migrate_thread_func(void *arg) {
+    gelbooru_migrate *migrate = (gelbooru_migrate*) arg;
+
+    while (1) {
+        int i = atomic_fetch_add(&migrate->next, 1);
+        if (i >= vector_size(migrate->names)) break;
+        const char *name = (const char*) vector_index(migrate->names, i);
+
+        // hash.ext or hash.ext.part
+        char hash[33];
+        unsigned char md5[16];
+        if (strchr(name, '/') != NULL || strlen(name) < 34 || name[32] != '.') continue;
+        memcpy(hash, name, 32);
+        hash[32] = '\0';
+        if (gelbooru_md5_from_hex(hash, md5) != 0) continue;
+
+        char from[4096], to[4096];
+        snprintf(from, sizeof(from), "%s/%s", migrate->dir_path, name);
+        snprintf(to, sizeof(to), "%s/%.2s/%.2s/%s", migrate->dir_path, hash, hash + 2, name);
+        if (gelbooru_make_shard_dirs(migrate->shard_dirs, migrate->dir_path, hash) == 0 && rename(from, to) == 0) {
+            atomic_fetch_add(&migrate->moved, 1);
+        } else {
+            printf("Failed to move %s\n", from);
+            atomic_fetch_add(&migrate->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/*
+    Move flat images of dir to ab/cd shard dirs with thread_count threads (0 is one per core)
+    Index needs no changes, it has no paths
+    Returns number of moved files or -1
+*/
+int gelbooru_migrate_to_sharded(const char *dir_path, int thread_count) {
+    if (dir_path == NULL) return -1;
+
+    gelbooru_migrate migrate;
+    for (int i = 0; i < GELBOORU_SHARD_DIRS / 32; i++) atomic_init(&migrate.shard_dirs[i], 0);
+    migrate.dir_path = dir_path;
+    migrate.names = vector_create();
+    atomic_init(&migrate.next, 0);
+    atomic_init(&migrate.moved, 0);
+    atomic_init(&migrate.failed, 0);
+    if (migrate.names == NULL || gelbooru_list_images(dir_path, migrate.names) < 0) {
+        printf("Failed to list %s\n", dir_path);
+        vector_destroy(migrate.names);
+        return -1;
+    }
+
+    // new downloads go to shards while old ones are moved
+    if (gelbooru_mark_dir_sharded(dir_path) != 0) {
+        printf("Failed to mark %s as sharded\n", dir_path);
+    }
+
+    if (thread_count <= 0) thread_count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count <= 0) thread_count = 1;
+    pthread_t *threads = (pthread_t*) malloc(sizeof(pthread_t) * thread_count);
+    int started = 0;
+    if (threads != NULL) {
+        for (; started < thread_count; started++) {
+            if (pthread_create(&threads[started], NULL, gelbooru_migrate_thread_func, &migrate) != 0) break;
+        }
+    }
+    if (started == 0) gelbooru_migrate_thread_func(&migrate);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (int i = 0; i < vector_size(migrate.names); i++) free(vector_index(migrate.names, i));
+    vector_destroy(migrate.names);
+    return atomic_load(&migrate.failed) > 0 ? -1 : atomic_load(&migrate.moved);
+}
+
+
+/* Monotonic time in ms */
+long long gelbooru_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 
-/* Write callback for GET request */
+
+/* Write callback for GET request, buffer grows geometrically */
 size_t gelbooru_rawdata_write_curl_callback(void *contents, size_t size, size_t nmemb, void *userp) {
     gelbooru_raw_data *raw_data = (gelbooru_raw_data*) userp;
     size_t realsize = size * nmemb;
-    raw_data->data = (char*) realloc(raw_data->data, raw_data->size + realsize + 1);
-    if (raw_data->data == NULL) {
-        printf("Failed to realloc raw_data\n");
-        return 0;
+    if (raw_data->size + realsize + 1 > raw_data->capacity) {
+        size_t new_capacity = raw_data->capacity > 0 ? raw_data->capacity * 2 : 16384;
+        while (new_capacity < raw_data->size + realsize + 1) new_capacity *= 2;
+
+        char *new_data = (char*) realloc(raw_data->data, new_capacity);
+        if (new_data == NULL) {
+            printf("Failed to realloc raw_data\n");
+            return 0;
+        }
+        raw_data->data = new_data;
+        raw_data->capacity = new_capacity;
     }
 
     memcpy(raw_data->data + raw_data->size, contents, realsize);
@@ -387,42 +1448,83 @@ size_t gelbooru_rawdata_write_curl_callback(void *contents, size_t size, size_t
     return realsize;
 }
 
-/* GET request */
-gelbooru_raw_data* gelbooru_get_request(gelbooru* gbooru, const char* url) {
-    if (gbooru == NULL || url == NULL) return NULL;
+/*
+    CURL share lock callbacks, one mutex per shared data type
+*/
+void gelbooru_share_lock_curl_callback(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp) {
+    gelbooru *gbooru = (gelbooru*) userp;
+    pthread_mutex_lock(&gbooru->share_locks[data]);
+}
 
-    CURL *curl;
-    CURLcode res;
-    curl = curl_easy_init();
+void gelbooru_share_unlock_curl_callback(CURL *handle, curl_lock_data data, void *userp) {
+    gelbooru *gbooru = (gelbooru*) userp;
+    pthread_mutex_unlock(&gbooru->share_locks[data]);
+}
+
+/*
+    Create curl handle with common options and shared caches
+    Handle is meant to live for the whole run, so connection stays alive between requests
+*/
+CURL* gelbooru_curl_easy_create(gelbooru* gbooru) {
+    if (gbooru == NULL) return NULL;
+
+    CURL *curl = curl_easy_init();
     if (curl == NULL) {
         printf("Failed to init curl\n");
         return NULL;
     }
 
+    curl_easy_setopt(curl, CURLOPT_SHARE, gbooru->share);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, (gbooru->user_agent != NULL ? gbooru->user_agent : GELBOORU_DEFAULT_USER_AGENT));
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+
+    // stalled and trickling responses fail as timeout and go to retry
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long) GELBOORU_CONNECT_TIMEOUT_S);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long) GELBOORU_LOW_SPEED_LIMIT);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long) GELBOORU_LOW_SPEED_TIME_S);
+    return curl;
+}
+
+/* GET request with new handle */
+gelbooru_raw_data* gelbooru_get_request(gelbooru* gbooru, const char* url) {
+    if (gbooru == NULL || url == NULL) return NULL;
+
+    CURL *curl = gelbooru_curl_easy_create(gbooru);
+    if (curl == NULL) return NULL;
+
+    gelbooru_raw_data *raw_data = gelbooru_get_request_with_handle(gbooru, curl, url);
+    curl_easy_cleanup(curl);
+    return raw_data;
+}
+
+/* GET request, reuses curl handle and its connection */
+gelbooru_raw_data* gelbooru_get_request_with_handle(gelbooru* gbooru, CURL *curl, const char* url) {
+    if (gbooru == NULL || curl == NULL || url == NULL) return NULL;
+
+    CURLcode res;
     gelbooru_raw_data* raw_data = (gelbooru_raw_data*) malloc(sizeof(gelbooru_raw_data));
     if (raw_data == NULL) {
         printf("Failed to create raw data\n");
-        curl_easy_cleanup(curl);
         return NULL;
     }
     raw_data->data = NULL;
     raw_data->size = 0;
+    raw_data->capacity = 0;
 
     curl_easy_setopt(curl, CURLOPT_URL, url);   
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, gelbooru_rawdata_write_curl_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, raw_data);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, (gbooru->user_agent != NULL ? gbooru->user_agent : GELBOORU_DEFAULT_USER_AGENT));
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
 
     //printf("GET %s\n", url);
     res = curl_easy_perform(curl);
+    gelbooru_metrics_record_request(gbooru->metrics, GELBOORU_REQUEST_PAGE, curl, res);
     if (res != CURLE_OK) {
         gelbooru_raw_data_free(raw_data);
-        curl_easy_cleanup(curl);
         return NULL;
     }
 
-
-    curl_easy_cleanup(curl);
     return raw_data;
 }
 
@@ -452,33 +1554,170 @@ void gelbooru_set_user_agent(gelbooru* gbooru, const char *user_agent) {
     free(gbooru->user_agent);
     gbooru->user_agent = new_user_agent;
 }
+/* Set parser thread count, pages after first are fetched in parallel */
+void gelbooru_set_parser_thread_count(gelbooru* gbooru, int count) {
+    if (gbooru == NULL) return;
+
+    gbooru->parser_thread_count = count > 1 ? count : 1;
+}
 /* Set download thread count */
 void gelbooru_set_download_thread_count(gelbooru* gbooru, int count) {
     if (gbooru == NULL) return;
 
     gbooru->download_thread_count = count > 1 ? count : 1;
 }
-/* Set output dir */
-void gelbooru_set_downloads_dirpath(gelbooru* gbooru, const char* path) {
+/* Set max in-flight transfers of one downloader thread */
+void gelbooru_set_download_transfers_per_thread(gelbooru* gbooru, int count) {
     if (gbooru == NULL) return;
 
-    char *new_path = strdup(path);
-    if (new_path == NULL) {
-        printf("Failed to allocate mem for new download path\n");
+    gbooru->download_transfers_per_thread = count > 1 ? count : 1;
+}
+/* Set max posts waiting in download queue, parsers wait when queue is full */
+void gelbooru_set_download_queue_capacity(gelbooru* gbooru, int capacity) {
+    if (gbooru == NULL) return;
+
+    gbooru->download_queue_capacity = capacity > 1 ? capacity : 1;
+}
+/* Set output dir */
+void gelbooru_set_downloads_dirpath(gelbooru* gbooru, const char* path) {
+    if (gbooru == NULL) return;
+
+    char *new_path = strdup(path);
+    if (new_path == NULL) {
+        printf("Failed to allocate mem for new download path\n");
         return;
     }
     free(gbooru->downloads_dir_path);
     gbooru->downloads_dir_path = new_path;
+    gelbooru_close_image_job(gbooru);
+}
+/* Set page requests per second of all parser threads, 0 is unlimited */
+void gelbooru_set_page_rate(gelbooru* gbooru, double rate) {
+    if (gbooru == NULL) return;
+    gbooru->page_rate = rate > 0 ? rate : 0;
+}
+/* Set image requests per second of all downloader threads, 0 is unlimited */
+void gelbooru_set_image_rate(gelbooru* gbooru, double rate) {
+    if (gbooru == NULL) return;
+    gbooru->image_rate = rate > 0 ? rate : 0;
 }
-/* Set parser sleeps */
+/* Set parser sleeps, one page request per ms, 0 is unlimited */
 void gelbooru_set_parser_sleep_ms(gelbooru* gbooru, int ms) {
-    if (gbooru != NULL) return;
-    gbooru->parser_sleep_ms = ms > 100 ? ms : 100;
+    if (gbooru == NULL) return;
+    gelbooru_set_page_rate(gbooru, ms > 0 ? 1000.0 / (ms > 100 ? ms : 100) : 0);
 }
-/* Set downloader sleeps */
+/* Set downloader sleeps, one image request per ms, 0 is unlimited */
 void gelbooru_set_downloader_sleep_ms(gelbooru* gbooru, int ms) {
-    if (gbooru != NULL) return;
-    gbooru->downloader_sleep_ms = ms > 100 ? ms : 100;
+    if (gbooru == NULL) return;
+    gelbooru_set_image_rate(gbooru, ms > 0 ? 1000.0 / (ms > 100 ? ms : 100) : 0);
+}
+
+
+
+/* Set layout of images in output dir, dir marked as sharded stays sharded */
+void gelbooru_set_layout(gelbooru* gbooru, int layout) {
+    if (gbooru == NULL) return;
+    gelbooru_close_image_job(gbooru);
+    gbooru->layout = layout == GELBOORU_LAYOUT_SHARDED ? GELBOORU_LAYOUT_SHARDED : GELBOORU_LAYOUT_FLAT;
+}
+/* Set image storage, GELBOORU_STORAGE_FILES or GELBOORU_STORAGE_PACK */
+void gelbooru_set_storage(gelbooru* gbooru, int storage) {
+    if (gbooru == NULL) return;
+    gelbooru_close_image_job(gbooru);
+    gbooru->storage = storage == GELBOORU_STORAGE_PACK ? GELBOORU_STORAGE_PACK : GELBOORU_STORAGE_FILES;
+}
+/* Set writer threads storing downloaded images, 0 writes in downloader threads */
+void gelbooru_set_writer_thread_count(gelbooru* gbooru, int count) {
+    if (gbooru == NULL) return;
+    gbooru->writer_thread_count = count > 0 ? count : 0;
+}
+/* Set fsync of stored images, GELBOORU_FSYNC_* */
+void gelbooru_set_fsync_policy(gelbooru* gbooru, int policy) {
+    if (gbooru == NULL) return;
+    gbooru->fsync_policy = policy == GELBOORU_FSYNC_IMAGE || policy == GELBOORU_FSYNC_BATCH ? policy : GELBOORU_FSYNC_NONE;
+}
+/* Set bytes of downloaded images kept in memory by all transfers, images over budget go to part files */
+void gelbooru_set_memory_budget(gelbooru* gbooru, long long bytes) {
+    if (gbooru == NULL) return;
+    gbooru->memory_budget = bytes > 0 ? bytes : 0;
+}
+/* Disable terminal progress rendering */
+void gelbooru_set_headless(gelbooru* gbooru, int headless) {
+    if (gbooru == NULL) return;
+    gbooru->headless = headless != 0;
+}
+/* Check MD5 of downloaded images, mismatched images are downloaded again */
+void gelbooru_set_verify_md5(gelbooru* gbooru, int verify) {
+    if (gbooru == NULL) return;
+    gbooru->verify_md5 = verify != 0;
+}
+/* List only posts newer than newest post of last complete run of query (see GELBOORU_SYNC_FILE_NAME) */
+void gelbooru_set_sync(gelbooru* gbooru, int sync) {
+    if (gbooru == NULL) return;
+    gbooru->sync = sync != 0;
+}
+/* Write NDJSON events to fd (not closed by gelbooru), -1 disables events */
+void gelbooru_set_event_fd(gelbooru* gbooru, int fd) {
+    if (gbooru == NULL) return;
+    gbooru->event_fd = fd >= 0 ? fd : -1;
+}
+
+/* Dump request metrics to path during download, .prom for Prometheus text, else JSON */
+void gelbooru_set_metrics_path(gelbooru* gbooru, const char *path) {
+    if (gbooru == NULL) return;
+
+    char *new_path = path != NULL ? strdup(path) : NULL;
+    if (path != NULL && new_path == NULL) {
+        printf("Failed to allocate mem for metrics path\n");
+        return;
+    }
+    free(gbooru->metrics_path);
+    gbooru->metrics_path = new_path;
+}
+
+/* Set site host, example "https://gelbooru.com" (trailing slash is dropped), NULL is GELBOORU_HOST */
+void gelbooru_set_host(gelbooru* gbooru, const char *host) {
+    if (gbooru == NULL) return;
+
+    char *new_host = NULL;
+    if (host != NULL) {
+        new_host = strdup(host);
+        if (new_host == NULL) {
+            printf("Failed to allocate mem for host\n");
+            return;
+        }
+        size_t length = strlen(new_host);
+        while (length > 0 && new_host[length - 1] == '/') new_host[--length] = '\0';
+    }
+    free(gbooru->host);
+    gbooru->host = new_host;
+}
+/* Site host of gbooru */
+const char* gelbooru_get_host(gelbooru* gbooru) {
+    return gbooru != NULL && gbooru->host != NULL ? gbooru->host : GELBOORU_HOST;
+}
+
+/* Set posts listing mode, GELBOORU_LISTING_HTML or GELBOORU_LISTING_API */
+void gelbooru_set_listing_mode(gelbooru* gbooru, int mode) {
+    if (gbooru == NULL) return;
+    gbooru->listing_mode = mode == GELBOORU_LISTING_API ? GELBOORU_LISTING_API : GELBOORU_LISTING_HTML;
+}
+/* Set API credentials (optional, from account options page) */
+void gelbooru_set_api_credentials(gelbooru* gbooru, const char *user_id, const char *api_key) {
+    if (gbooru == NULL || user_id == NULL || api_key == NULL) return;
+
+    char *new_user_id = strdup(user_id);
+    char *new_api_key = strdup(api_key);
+    if (new_user_id == NULL || new_api_key == NULL) {
+        printf("Failed to allocate mem for api credentials\n");
+        free(new_user_id);
+        free(new_api_key);
+        return;
+    }
+    free(gbooru->api_user_id);
+    free(gbooru->api_key);
+    gbooru->api_user_id = new_user_id;
+    gbooru->api_key = new_api_key;
 }
 
 
@@ -500,6 +1739,7 @@ int gelbooru_add_image_format(gelbooru* gbooru, const char *format) {
         free(copy);
         return -1;
     }
+    gelbooru_close_image_job(gbooru);
     return 0;
 }
 
@@ -510,6 +1750,63 @@ vector* gelbooru_get_image_formats(gelbooru* gbooru) {
 }
 
 
+/*
+    Image format stats
+*/
+
+/* Create stats for count formats */
+gelbooru_format_stats* gelbooru_format_stats_create(int count) {
+    gelbooru_format_stats *stats = (gelbooru_format_stats*) malloc(sizeof(gelbooru_format_stats));
+    if (stats == NULL) return NULL;
+
+    stats->count = count > 0 ? count : 0;
+    stats->hits = (int*) calloc(stats->count > 0 ? stats->count : 1, sizeof(int));
+    if (stats->hits == NULL) {
+        free(stats);
+        return NULL;
+    }
+    pthread_mutex_init(&stats->mutex, NULL);
+    return stats;
+}
+
+/* Destroy stats */
+void gelbooru_format_stats_destroy(gelbooru_format_stats *stats) {
+    if (stats != NULL) {
+        free(stats->hits);
+        pthread_mutex_destroy(&stats->mutex);
+        free(stats);
+    }
+}
+
+/* Count found image of format */
+void gelbooru_format_stats_hit(gelbooru_format_stats *stats, int format_index) {
+    if (stats == NULL || format_index < 0 || format_index >= stats->count) return;
+
+    pthread_mutex_lock(&stats->mutex);
+    stats->hits[format_index]++;
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+/*
+    Fill order with format indexes, most frequent first
+    Formats with equal hits keep added order
+*/
+void gelbooru_format_stats_order(gelbooru_format_stats *stats, int *order) {
+    if (stats == NULL || order == NULL) return;
+
+    pthread_mutex_lock(&stats->mutex);
+    for (int i = 0; i < stats->count; i++) {
+        int j = i;
+        while (j > 0 && stats->hits[order[j - 1]] < stats->hits[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+
 
 
 
@@ -522,15 +1819,16 @@ vector* gelbooru_get_image_formats(gelbooru* gbooru) {
     Construct tag search url
     Example "https://gelbooru.com/index.php?page=autocomplete2&type=tag_query&term=query"
 */
-char* gelbooru_construct_tag_search_url(const char* query) {
+char* gelbooru_construct_tag_search_url(const char *host, const char* query) {
+    if (host == NULL) return NULL;
     if (query == NULL || strlen(query) == 0) {
         printf("Empty query\n");
         return NULL;
     }
 
     char* encoded_query = curl_easy_escape(NULL, query, 0);
-    char format_url[] = GELBOORU_HOST "/index.php?page=autocomplete2&type=tag_query&term=%s";
-    int url_size = strlen(format_url) + strlen(encoded_query);
+    char format_url[] = "%s/index.php?page=autocomplete2&type=tag_query&term=%s";
+    int url_size = strlen(format_url) + strlen(host) + strlen(encoded_query);
     char *url = (char*) malloc(url_size);
     if (url == NULL) {
         printf("Failed to allocate memory for tag search url\n");
@@ -538,7 +1836,7 @@ char* gelbooru_construct_tag_search_url(const char* query) {
         return NULL;
     }
 
-    sprintf(url, format_url, encoded_query);
+    sprintf(url, format_url, host, encoded_query);
     curl_free(encoded_query);
     return url;
 }
@@ -570,16 +1868,16 @@ char* gelbooru_construct_tags_query(vector* tags) {
 /*
     Construct posts page url, example https://gelbooru.com/index.php?page=post&s=list&tags=tags&pid=pid
 */
-char* gelbooru_construct_posts_page_url(vector* tags, int pid) {
-    if (pid < 0) return NULL;
+char* gelbooru_construct_posts_page_url(const char *host, vector* tags, int pid) {
+    if (host == NULL || pid < 0) return NULL;
     char *tags_query = gelbooru_construct_tags_query(tags);
     if (tags_query == NULL) return NULL;
 
     char* encoded_query = curl_easy_escape(NULL, tags_query, 0);
     free(tags_query);
 
-    char format_url[] = GELBOORU_HOST "/index.php?page=post&s=list&tags=%s&pid=%d";
-    int url_size = strlen(format_url) + strlen(encoded_query) + 16;
+    char format_url[] = "%s/index.php?page=post&s=list&tags=%s&pid=%d";
+    int url_size = strlen(format_url) + strlen(host) + strlen(encoded_query) + 16;
     char *url = (char*) malloc(url_size);
     if (url == NULL) {
         printf("Failed to allocate memory for post page url\n");
@@ -587,7 +1885,40 @@ char* gelbooru_construct_posts_page_url(vector* tags, int pid) {
         return NULL;
     }
 
-    sprintf(url, format_url, encoded_query, pid);
+    sprintf(url, format_url, host, encoded_query, pid);
+    curl_free(encoded_query);
+    return url;
+}
+
+/*
+    Construct JSON API posts url, pid is page number
+    Example https://gelbooru.com/index.php?page=dapi&s=post&q=index&json=1&limit=100&tags=tags&pid=pid
+*/
+char* gelbooru_construct_api_posts_url(const char *host, vector* tags, int pid, const char *user_id, const char *api_key) {
+    if (host == NULL || pid < 0) return NULL;
+    char *tags_query = gelbooru_construct_tags_query(tags);
+    if (tags_query == NULL) return NULL;
+
+    char* encoded_query = curl_easy_escape(NULL, tags_query, 0);
+    free(tags_query);
+
+    char format_url[] = "%s/index.php?page=dapi&s=post&q=index&json=1&limit=%d&tags=%s&pid=%d";
+    char format_credentials[] = "&user_id=%s&api_key=%s";
+    int url_size = strlen(format_url) + strlen(host) + strlen(encoded_query) + 32;
+    if (user_id != NULL && api_key != NULL) {
+        url_size += strlen(format_credentials) + strlen(user_id) + strlen(api_key);
+    }
+    char *url = (char*) malloc(url_size);
+    if (url == NULL) {
+        printf("Failed to allocate memory for api posts url\n");
+        curl_free(encoded_query);
+        return NULL;
+    }
+
+    int len = sprintf(url, format_url, host, GELBOORU_API_POSTS_PER_PAGE, encoded_query, pid);
+    if (user_id != NULL && api_key != NULL) {
+        sprintf(url + len, format_credentials, user_id, api_key);
+    }
     curl_free(encoded_query);
     return url;
 }
@@ -595,11 +1926,11 @@ char* gelbooru_construct_posts_page_url(vector* tags, int pid) {
 /*
     Construct image url with hash and format
 */
-char* gelbooru_construct_image_url(const char *hash, const char *format) {
-    if (hash == NULL || format == NULL) return NULL;
+char* gelbooru_construct_image_url(const char *host, const char *hash, const char *format) {
+    if (host == NULL || hash == NULL || format == NULL) return NULL;
 
-    char base_url[] = GELBOORU_HOST "/images/%s/%s/%s.%s";
-    int url_size = strlen(base_url) + 4 + strlen(hash) + strlen(format);
+    char base_url[] = "%s/images/%s/%s/%s.%s";
+    int url_size = strlen(base_url) + strlen(host) + 4 + strlen(hash) + strlen(format);
     char *url = malloc(url_size);
     if (url == NULL) return NULL;
 
@@ -609,7 +1940,7 @@ char* gelbooru_construct_image_url(const char *hash, const char *format) {
     dir1[2] = '\0';
     dir2[2] = '\0';
 
-    sprintf(url, base_url, dir1, dir2, hash, format);
+    sprintf(url, base_url, host, dir1, dir2, hash, format);
     return url;
 }
 
@@ -628,200 +1959,374 @@ char* gelbooru_construct_image_output_path(const char *outdir, const char *hash,
     return path;
 }
 
+/*
+    Construct sharded image output path outdir/ab/cd/hash.ext, same dirs as image url
+*/
+char* gelbooru_construct_sharded_image_output_path(const char *outdir, const char *hash, const char *format) {
+    if (outdir == NULL || hash == NULL || format == NULL || strlen(hash) < 4) return NULL;
 
+    int path_size = strlen(outdir) + strlen(hash) + strlen(format) + 10;
+    char *path = (char*) malloc(path_size);
+    if (path == NULL) {
+        return NULL;
+    }
+    sprintf(path, "%s/%.2s/%.2s/%s.%s", outdir, hash, hash + 2, hash, format);
+    return path;
+}
 
+/*
+    Construct image path in output dir of job with its layout
+*/
+char* gelbooru_construct_download_path(gelbooru_job *job, const char *hash, const char *format) {
+    if (job->layout == GELBOORU_LAYOUT_SHARDED) {
+        return gelbooru_construct_sharded_image_output_path(job->dir_path, hash, format);
+    }
+    return gelbooru_construct_image_output_path(job->dir_path, hash, format);
+}
 
 
 
 /*
-    Parse tags from raw JSON data
-    Returns vector gelbooru_tag
+    Jobs
 */
-vector* gelbooru_parse_tags(gelbooru_raw_data* raw_data) {
-    if (raw_data == NULL || raw_data->data == NULL) return NULL;
-    
-    const char *pattern = "\"value\":\"([^\"]+)\",\"post_count\":\"([0-9]+)\"";
-    regex_t regex;
-    regmatch_t matches[3];
-    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) {
-        printf("Failed to compile regex\n");
+
+/* Create job with output dir, tags and formats are added after */
+gelbooru_job* gelbooru_job_create(const char *dir_path) {
+    if (dir_path == NULL) return NULL;
+
+    gelbooru_job *job = (gelbooru_job*) malloc(sizeof(gelbooru_job));
+    if (job == NULL) {
+        printf("Failed to allocate mem for job\n");
         return NULL;
     }
-
-    // tags vector
-    vector *tags = vector_create();
-    if (tags == NULL) {
-        printf("Failed to create tags vector\n");
-        regfree(&regex);
+    memset(job, 0, sizeof(gelbooru_job));
+    for (int i = 0; i < GELBOORU_SHARD_DIRS / 32; i++) atomic_init(&job->shard_dirs[i], 0);
+    job->max_page = -1;
+
+    job->dir_path = strdup(dir_path);
+    job->tags = vector_create();
+    job->formats = vector_create();
+    if (job->dir_path == NULL || job->tags == NULL || job->formats == NULL) {
+        printf("Failed to allocate mem for job\n");
+        gelbooru_job_destroy(job);
         return NULL;
     }
+    return job;
+}
 
-    char *cursor = raw_data->data;
-    while (regexec(&regex, cursor, 3, matches, 0) == 0) {
-        int len1 = matches[1].rm_eo - matches[1].rm_so;
-        int len2 = matches[2].rm_eo - matches[2].rm_so;
-        
-        char *tag = (char*) malloc(len1 + 1);
-        char *post_count = (char*) malloc(len2 + 1);
-        if (tag == NULL || post_count == NULL) {
-            free(tag);
-            free(post_count);
-            break;
-        }
-        strncpy(tag, cursor + matches[1].rm_so, len1);
-        strncpy(post_count, cursor + matches[2].rm_so, len2);
-        tag[len1] = '\0';
-        post_count[len2] = '\0';
-
-        gelbooru_tag *current_tag = (gelbooru_tag*) malloc(sizeof(gelbooru_tag));
-        if (current_tag == NULL) {
-            free(tag);
-            free(post_count);
-            break;
-        }
-        
-        current_tag->tag = tag;
-        current_tag->post_count = atoi(post_count);
-        free(post_count);
+/* Destroy job, closes it if open */
+void gelbooru_job_destroy(gelbooru_job *job) {
+    if (job != NULL) {
+        gelbooru_job_close(job);
+        for (int i = 0; i < vector_size(job->tags); i++) free(vector_index(job->tags, i));
+        for (int i = 0; i < vector_size(job->formats); i++) free(vector_index(job->formats, i));
+        vector_destroy(job->tags);
+        vector_destroy(job->formats);
+        free(job->dir_path);
+        free(job);
+    }
+}
 
-        if (vector_push_back(tags, current_tag) != 0) {
-            free(tag);
-            free(current_tag);
-            break;
-        }
-        
-        cursor += matches[0].rm_eo;
+/* Add copy of tag to job, returns 0 if OK */
+int gelbooru_job_add_tag(gelbooru_job *job, const char *tag) {
+    char *copy = strdup(tag);
+    if (copy == NULL) return -1;
+    if (vector_push_back(job->tags, copy) != 0) {
+        free(copy);
+        return -1;
     }
+    return 0;
+}
 
-    regfree(&regex);
-    return tags;
+/* Add copy of image format to job, returns 0 if OK */
+int gelbooru_job_add_format(gelbooru_job *job, const char *format) {
+    char *copy = strdup(format);
+    if (copy == NULL) return -1;
+    if (vector_push_back(job->formats, copy) != 0) {
+        free(copy);
+        return -1;
+    }
+    return 0;
 }
 
 /*
-    Parse image hashes from HTML raw data
-    Returns char* vector
+    Prepare job for run: output dir, layout, formats, pack, index, negative cache and dead-letter list
+    Job without formats takes formats of gelbooru
+    Returns 0 if OK, failed job has no pages
 */
-vector* gelbooru_parse_image_hashes(gelbooru_raw_data* page_html) {
-    if (page_html == NULL || page_html->data == NULL) return NULL;
-    const char *pattern = "thumbnail_([a-f0-9]+)\\.jpg";
-    regex_t regex;
-    regmatch_t matches[2];
+int gelbooru_job_open(gelbooru* gbooru, gelbooru_job *job) {
+    job->next_page = 0;
+    job->max_page = -1;
+    job->parser_failed = 1;
+    for (int i = 0; i < GELBOORU_SHARD_DIRS / 32; i++) atomic_store(&job->shard_dirs[i], 0);
+
+    // check dir
+    if (!gelbooru_directory_exists(job->dir_path)) {
+        printf("Output dir %s not exists, creating ...\n", job->dir_path);
+        if (!gelbooru_mkdir(job->dir_path)) {
+            printf("Failed to create output dir %s\n", job->dir_path);
+            return -1;
+        }
+    }
 
-    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) {
-        printf("Failed to compile regex\n");
-        return NULL;
+    // layout, sharded dir stays sharded
+    job->layout = gbooru->layout;
+    if (gelbooru_dir_is_sharded(job->dir_path)) {
+        job->layout = GELBOORU_LAYOUT_SHARDED;
+    } else if (job->layout == GELBOORU_LAYOUT_SHARDED && gelbooru_mark_dir_sharded(job->dir_path) != 0) {
+        printf("Failed to mark output dir %s as sharded\n", job->dir_path);
     }
 
-    vector* image_hash_list = vector_create();
-    if (image_hash_list == NULL) {
-        regfree(&regex);
-        return NULL;
+    if (vector_size(job->formats) == 0) {
+        for (int i = 0; i < vector_size(gbooru->img_formats); i++) {
+            if (gelbooru_job_add_format(job, vector_index(gbooru->img_formats, i)) != 0) return -1;
+        }
+    }
+    job->format_stats = gelbooru_format_stats_create(vector_size(job->formats));
+    job->listed = gelbooru_hash_set_create(0);
+    if (job->format_stats == NULL || job->listed == NULL) {
+        printf("Failed to create format stats\n");
+        gelbooru_job_close(job);
+        return -1;
     }
-    char *cursor = page_html->data;
-    while (regexec(&regex, cursor, 2, matches, 0) == 0) {
-        int len = matches[1].rm_eo - matches[1].rm_so;
-        char *hash = malloc(len + 1);
-        if (hash == NULL) break;
 
-        strncpy(hash, cursor + matches[1].rm_so, len);
-        hash[len] = '\0';
-        if (vector_push_back(image_hash_list, hash) != 0) {
-            free(hash);
-            break;
+    // segment files of images
+    if (gbooru->storage == GELBOORU_STORAGE_PACK) {
+        job->pack = gelbooru_pack_open(job->dir_path);
+        if (job->pack == NULL) {
+            printf("Failed to open pack of %s\n", job->dir_path);
+            gelbooru_job_close(job);
+            return -1;
         }
-        cursor += matches[0].rm_eo;
     }
-    regfree(&regex);
-    return image_hash_list;
-}
 
-/*
-    Parse max page id from HTML raw data
-*/
-int gelbooru_parse_max_pid(gelbooru_raw_data* page_html) {
-    if (page_html == NULL || page_html->data == NULL) return -1;
-    int max_pid = -1;
-    const char *pattern = "pid=([0-9]+)";
-    regex_t regex;
-    regmatch_t pmatch[2];
+    // index of completed downloads
+    job->index = gelbooru_index_open(job->dir_path);
+    if (job->index == NULL) {
+        printf("Failed to open index of %s, existing images are checked on disk\n", job->dir_path);
+    }
+
+    // negative cache and dead-letter list
+    job->missing = gelbooru_hash_file_open(job->dir_path, GELBOORU_MISSING_FILE_NAME);
+    job->failed = gelbooru_hash_file_open(job->dir_path, GELBOORU_FAILED_FILE_NAME);
+
+    // newest post of last complete run, only newer posts are listed
+    job->sync_id = -1;
+    job->max_id = -1;
+    job->pages_failed = 0;
+    job->total = -1;
+    job->listed_posts = 0;
+    job->listing_changed = 0;
+    job->query = gbooru->sync ? gelbooru_construct_tags_query(job->tags) : NULL;
+    if (job->query != NULL) {
+        size_t length = strlen(job->query);
+        if (length > 0 && job->query[length - 1] == ' ') job->query[length - 1] = '\0';
+        job->sync_id = gelbooru_sync_read(job->dir_path, job->query);
+    }
+    if (job->sync_id >= 0) {
+        char filter[32];
+        snprintf(filter, sizeof(filter), "id:>%lld", job->sync_id);
+        job->query_tags = vector_create();
+        char *copy = strdup(filter);
+        int failed = job->query_tags == NULL || copy == NULL;
+        for (int i = 0; !failed && i < vector_size(job->tags); i++) {
+            failed = vector_push_back(job->query_tags, vector_index(job->tags, i)) != 0;
+        }
+        if (failed || vector_push_back(job->query_tags, copy) != 0) {
+            printf("Failed to add sync filter of %s\n", job->query);
+            free(copy);
+            vector_destroy(job->query_tags);
+            job->query_tags = NULL;
+            job->sync_id = -1;
+        } else {
+            printf("Sync %s: posts newer than %lld\n", job->query, job->sync_id);
+        }
+    }
 
+    job->parser_failed = 0;
+    return 0;
+}
 
-    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) {
-        printf("Failed to compile regex\n");
-        return max_pid;
+/* Close files of job opened for run */
+void gelbooru_job_close(gelbooru_job *job) {
+    gelbooru_pack_close(job->pack);
+    gelbooru_index_close(job->index);
+    gelbooru_hash_file_close(job->missing);
+    gelbooru_hash_file_close(job->failed);
+    gelbooru_format_stats_destroy(job->format_stats);
+    gelbooru_hash_set_destroy(job->listed);
+    job->pack = NULL;
+    job->index = NULL;
+    job->missing = NULL;
+    job->failed = NULL;
+    job->format_stats = NULL;
+    job->listed = NULL;
+
+    // filter is last, other tags are owned by tags
+    if (job->query_tags != NULL) {
+        free(vector_index(job->query_tags, vector_size(job->query_tags) - 1));
+        vector_destroy(job->query_tags);
+        job->query_tags = NULL;
     }
+    free(job->query);
+    job->query = NULL;
+}
 
-    const char *cursor = page_html->data;
-    while (regexec(&regex, cursor, 2, pmatch, 0) == 0) {
-        int len = pmatch[1].rm_eo - pmatch[1].rm_so;
-        char *pid_str = malloc(len + 1);
-        if (pid_str == NULL) {;
-            regfree(&regex);
-            return max_pid;
-        }
-        strncpy(pid_str, cursor + pmatch[1].rm_so, len);
-        pid_str[len] = '\0';
+/* Returns 1 if open job has image in index, pack or on disk with any of its formats */
+int gelbooru_job_has_image(gelbooru_job *job, const char *hash) {
+    if (gelbooru_index_contains(job->index, hash) || gelbooru_pack_contains(job->pack, hash)) return 1;
+    for (int i = 0; i < vector_size(job->formats); i++) {
+        char *path = gelbooru_construct_download_path(job, hash, vector_index(job->formats, i));
+        if (path == NULL) continue;
 
-        int current_pid = atoi(pid_str);
-        if (current_pid > max_pid) max_pid = current_pid;
-        
-        free(pid_str);
-        cursor += pmatch[0].rm_eo;
+        int exists = gelbooru_file_exists(path);
+        free(path);
+        if (exists) return 1;
     }
-    regfree(&regex);
-    return max_pid;
+    return 0;
 }
 
+/*
+    Store newest listed post id of open job as sync point of its query
+    Only complete runs move it: first page and all other pages listed, no image failed,
+    and listing did not change while pages were fetched in parallel
+    Returns 1 if moved, 0 if not, -1 on error
+*/
+int gelbooru_job_save_sync(gelbooru_job *job) {
+    if (job->query == NULL || job->parser_failed || job->pages_failed > 0 || job->max_id <= job->sync_id) return 0;
+    if (gelbooru_hash_file_added(job->failed) > 0 || !gelbooru_job_listing_stable(job)) return 0;
+    return gelbooru_sync_write(job->dir_path, job->query, job->max_id) == 0 ? 1 : -1;
+}
+
+/*
+    Returns 1 if no post can have been missed by listing of job
+    Posts added or removed while pages are fetched shift others across page boundaries,
+    then pages report different totals, or a post is listed twice and unique posts fall short of total
+*/
+int gelbooru_job_listing_stable(gelbooru_job *job) {
+    return !job->listing_changed && job->total >= 0 && job->listed_posts == job->total;
+}
 
+/* Returns newest post id of query from sync file of dir or -1 */
+long long gelbooru_sync_read(const char *dir_path, const char *query) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, GELBOORU_SYNC_FILE_NAME);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+
+    long long id = -1;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, fp)) > 0) {
+        if (line[length - 1] == '\n') line[length - 1] = '\0';
+        char *space = strchr(line, ' ');
+        if (space != NULL && strcmp(space + 1, query) == 0) id = atoll(line);
+    }
+    free(line);
+    fclose(fp);
+    return id;
+}
 
+/*
+    Set newest post id of query in sync file of dir, lines of other queries are kept
+    File is replaced at once, so interrupted write keeps old sync points
+    Returns 0 if OK
+*/
+int gelbooru_sync_write(const char *dir_path, const char *query, long long id) {
+    char path[4096], tmp_path[4096 + 8];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, GELBOORU_SYNC_FILE_NAME);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) return -1;
+
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t length;
+        while ((length = getline(&line, &capacity, in)) > 0) {
+            if (line[length - 1] == '\n') line[length - 1] = '\0';
+            char *space = strchr(line, ' ');
+            if (space == NULL || strcmp(space + 1, query) != 0) fprintf(out, "%s\n", line);
+        }
+        free(line);
+        fclose(in);
+    }
+    fprintf(out, "%lld %s\n", id, query);
 
+    int failed = fflush(out) != 0 || fsync(fileno(out)) != 0;
+    if (fclose(out) != 0) failed = 1;
+    if (failed || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
 
 /*
-    Search tags
-    Returns vector gelbooru_tag
+    Read jobs from file, one job per line:
+    <out_dir> <formats> <tag1> [<tag2> ...]
+    formats is comma separated list or - for formats of gelbooru,
+    empty lines and lines starting with # are skipped
+    Returns vector gelbooru_job or NULL
 */
-vector* gelbooru_tag_search(gelbooru* gbooru, const char* query) {
-    if (gbooru == NULL) return NULL;
-    if (query == NULL || strlen(query) == 0) {
-        printf("Query string is empty\n");
+vector* gelbooru_read_jobs(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("Failed to open job file %s\n", path);
         return NULL;
     }
-    if (strlen(query) < 3) {
-        printf("Query string is too short < 3\n");
+    vector *jobs = vector_create();
+    if (jobs == NULL) {
+        fclose(fp);
         return NULL;
     }
 
-    char* url = gelbooru_construct_tag_search_url(query);
-    if (url == NULL) {
-        printf("Failed to construct tag search url\n");
-        return NULL;
-    }
+    char *line = NULL;
+    size_t capacity = 0;
+    int line_number = 0;
+    while (getline(&line, &capacity, fp) > 0) {
+        line_number++;
+        char *save = NULL;
+        char *dir = strtok_r(line, " \t\r\n", &save);
+        if (dir == NULL || dir[0] == '#') continue;
+        char *formats = strtok_r(NULL, " \t\r\n", &save);
+        char *tag = strtok_r(NULL, " \t\r\n", &save);
+        if (formats == NULL || tag == NULL) {
+            printf("Job file %s:%d: expected <out_dir> <formats> <tag1> [<tag2> ...]\n", path, line_number);
+            continue;
+        }
 
-    gelbooru_raw_data *raw_data = gelbooru_get_request(gbooru, url);
-    if (raw_data == NULL) {
-        printf("Failed to GET %s\n", url);
-        free(url);
-        return NULL;
+        gelbooru_job *job = gelbooru_job_create(dir);
+        if (job == NULL) break;
+        int failed = 0;
+        for (; tag != NULL; tag = strtok_r(NULL, " \t\r\n", &save)) {
+            failed |= gelbooru_job_add_tag(job, tag);
+        }
+        if (strcmp(formats, "-") != 0) {
+            char *format_save = NULL;
+            for (char *format = strtok_r(formats, ",", &format_save); format != NULL; format = strtok_r(NULL, ",", &format_save)) {
+                failed |= gelbooru_job_add_format(job, format);
+            }
+        }
+        if (failed || vector_push_back(jobs, job) != 0) {
+            printf("Failed to add job of line %d\n", line_number);
+            gelbooru_job_destroy(job);
+        }
     }
-    
-    vector *tags = gelbooru_parse_tags(raw_data);
-    
-    free(url);
-    gelbooru_raw_data_free(raw_data);
-    return tags;
+    free(line);
+    fclose(fp);
+    return jobs;
 }
 
-/*
-    Destructor for vector gelbooru tag
-*/
-void gelbooru_tag_list_free(vector* tags) {
-    if (tags != NULL) {
-        for (int i = 0; i < vector_size(tags); i++) {
-            gelbooru_tag* tag = vector_index(tags, i);
-            free(tag->tag);
-            free(tag);
+/* Destroy vector gelbooru_job */
+void gelbooru_job_list_free(vector *jobs) {
+    if (jobs != NULL) {
+        for (int i = 0; i < vector_size(jobs); i++) {
+            gelbooru_job_destroy(vector_index(jobs, i));
         }
-        free(tags);
+        vector_destroy(jobs);
     }
 }
 
@@ -831,451 +2336,4200 @@ void gelbooru_tag_list_free(vector* tags) {
 
 
 /*
-    CURL image write callback 
+    Parse tags from raw JSON data
+    Single pass over "value":"tag","post_count":"count" entries
+    Returns vector gelbooru_tag
 */
-size_t gelbooru_image_write_curl_callback(void *contents, size_t size, size_t nmemb, void *userp) {
-    FILE* fp = (FILE*) userp;
-    size_t written = fwrite(contents, size, nmemb, fp);
-    return written;
-}
+vector* gelbooru_parse_tags(gelbooru_raw_data* raw_data) {
+    if (raw_data == NULL || raw_data->data == NULL) return NULL;
 
+    const char value_key[] = "\"value\":\"";
+    const char count_key[] = "\",\"post_count\":\"";
+    int value_key_len = sizeof(value_key) - 1;
+    int count_key_len = sizeof(count_key) - 1;
 
-/*
+    // tags vector
+    vector *tags = vector_create();
+    if (tags == NULL) {
+        printf("Failed to create tags vector\n");
+        return NULL;
+    }
+
+    const char *cursor = raw_data->data;
+    const char *end = raw_data->data + raw_data->size;
+    while ((cursor = memmem(cursor, end - cursor, value_key, value_key_len)) != NULL) {
+        const char *tag_start = cursor + value_key_len;
+        const char *tag_end = memchr(tag_start, '"', end - tag_start);
+        if (tag_end == NULL) break;
+        cursor = tag_end;
+        if (tag_end == tag_start) continue;
+
+        // "post_count" must follow value
+        if (end - tag_end < count_key_len || memcmp(tag_end, count_key, count_key_len) != 0) continue;
+        const char *count_start = tag_end + count_key_len;
+        const char *count_end = count_start;
+        int post_count = 0;
+        while (count_end < end && *count_end >= '0' && *count_end <= '9') {
+            post_count = post_count * 10 + (*count_end - '0');
+            count_end++;
+        }
+        if (count_end == count_start || count_end >= end || *count_end != '"') continue;
+        cursor = count_end;
+
+        char *tag = (char*) malloc(tag_end - tag_start + 1);
+        if (tag == NULL) break;
+        memcpy(tag, tag_start, tag_end - tag_start);
+        tag[tag_end - tag_start] = '\0';
+
+        gelbooru_tag *current_tag = (gelbooru_tag*) malloc(sizeof(gelbooru_tag));
+        if (current_tag == NULL) {
+            free(tag);
+            break;
+        }
+        
+        current_tag->tag = tag;
+        current_tag->post_count = post_count;
+
+        if (vector_push_back(tags, current_tag) != 0) {
+            free(tag);
+            free(current_tag);
+            break;
+        }
+    }
+
+    return tags;
+}
+
+/*
+    Scan posts page HTML in one pass
+    Collects thumbnail_<hash>.jpg hashes (32 hex chars) to hashes (if not NULL),
+    max pid=<number> to max_pid and max post anchor id="p<number>" to max_id
+    (if not NULL, caller sets -1 before first scan)
+    If not final, data is a prefix of page and tokens that may continue
+    in next data are left unscanned
+    Returns number of scanned bytes, rest must be scanned again with next data
+*/
+size_t gelbooru_scan_posts_html(const char *data, size_t size, int final, vector *hashes, int *max_pid, long long *max_id) {
+    const char thumb_key[] = "thumbnail_";
+    const char pid_key[] = "pid=";
+    const char id_key[] = "id=\"p";
+    size_t thumb_key_len = sizeof(thumb_key) - 1;
+    size_t pid_key_len = sizeof(pid_key) - 1;
+    size_t id_key_len = sizeof(id_key) - 1;
+
+    // anchors starting after limit can be cut by end of data
+    const char *end = data + size;
+    const char *limit = end;
+    if (!final) limit = size > thumb_key_len ? end - (thumb_key_len - 1) : data;
+
+    const char *next_thumb = hashes != NULL ? memmem(data, size, thumb_key, thumb_key_len) : NULL;
+    const char *next_pid = max_pid != NULL ? memmem(data, size, pid_key, pid_key_len) : NULL;
+    const char *next_id = max_id != NULL ? memmem(data, size, id_key, id_key_len) : NULL;
+
+    // anchors are taken in document order, all cursors move forward only
+    while (1) {
+        if (next_thumb != NULL && next_thumb >= limit) next_thumb = NULL;
+        if (next_pid != NULL && next_pid >= limit) next_pid = NULL;
+        if (next_id != NULL && next_id >= limit) next_id = NULL;
+        if (next_thumb == NULL && next_pid == NULL && next_id == NULL) break;
+
+        if (next_id != NULL && (next_thumb == NULL || next_id < next_thumb) && (next_pid == NULL || next_id < next_pid)) {
+            const char *digit = next_id + id_key_len;
+            long long id = 0;
+            int digits = 0;
+            while (digit < end && *digit >= '0' && *digit <= '9') {
+                id = id * 10 + (*digit - '0');
+                digit++;
+                digits++;
+            }
+            if (!final && digit == end) return next_id - data; // wait for rest of number
+
+            if (digits > 0 && id > *max_id) *max_id = id;
+            next_id = memmem(digit, end - digit, id_key, id_key_len);
+        } else if (next_thumb != NULL && (next_pid == NULL || next_thumb < next_pid)) {
+            const char *hash_start = next_thumb + thumb_key_len;
+            const char *hash_end = hash_start;
+            while (hash_end < end && ((*hash_end >= '0' && *hash_end <= '9') || (*hash_end >= 'a' && *hash_end <= 'f'))) {
+                hash_end++;
+            }
+            if (!final && end - hash_end < 4) return next_thumb - data; // wait for rest of token
+
+            if (hash_end - hash_start == 32 && end - hash_end >= 4 && memcmp(hash_end, ".jpg", 4) == 0) {
+                char *hash = (char*) malloc(hash_end - hash_start + 1);
+                if (hash == NULL) return size;
+                memcpy(hash, hash_start, hash_end - hash_start);
+                hash[hash_end - hash_start] = '\0';
+                if (vector_push_back(hashes, hash) != 0) {
+                    free(hash);
+                    return size;
+                }
+            }
+            next_thumb = memmem(hash_end, end - hash_end, thumb_key, thumb_key_len);
+        } else {
+            const char *digit = next_pid + pid_key_len;
+            int pid = 0, digits = 0;
+            while (digit < end && *digit >= '0' && *digit <= '9') {
+                pid = pid * 10 + (*digit - '0');
+                digit++;
+                digits++;
+            }
+            if (!final && digit == end) return next_pid - data; // wait for rest of number
+
+            if (digits > 0 && pid > *max_pid) *max_pid = pid;
+            next_pid = memmem(digit, end - digit, pid_key, pid_key_len);
+        }
+    }
+    return limit - data;
+}
+
+/*
+    Parse posts page HTML in one pass
+    Collects thumbnail_<hash>.jpg hashes to hashes (if not NULL)
+    and max pid=<number> to max_pid (if not NULL, -1 if not found)
+    Returns 0 if OK
+*/
+int gelbooru_parse_posts_html(gelbooru_raw_data* page_html, vector *hashes, int *max_pid) {
+    if (page_html == NULL || page_html->data == NULL) return -1;
+
+    if (max_pid != NULL) *max_pid = -1;
+    gelbooru_scan_posts_html(page_html->data, page_html->size, 1, hashes, max_pid, NULL);
+    return 0;
+}
+
+/*
+    Parse image hashes from HTML raw data
+    Returns char* vector
+*/
+vector* gelbooru_parse_image_hashes(gelbooru_raw_data* page_html) {
+    if (page_html == NULL || page_html->data == NULL) return NULL;
+
+    vector* image_hash_list = vector_create();
+    if (image_hash_list == NULL) return NULL;
+
+    gelbooru_parse_posts_html(page_html, image_hash_list, NULL);
+    return image_hash_list;
+}
+
+/*
+    Parse max page id from HTML raw data
+*/
+int gelbooru_parse_max_pid(gelbooru_raw_data* page_html) {
+    int max_pid = -1;
+    gelbooru_parse_posts_html(page_html, NULL, &max_pid);
+    return max_pid;
+}
+
+
+
+
+/*
+    Find end of JSON object or array starting at cursor
+    Returns pointer after closing bracket or NULL
+*/
+const char* gelbooru_json_object_end(const char *cursor, const char *end) {
+    int depth = 0, in_string = 0;
+    for (; cursor < end; cursor++) {
+        char c = *cursor;
+        if (in_string) {
+            if (c == '\\') cursor++;
+            else if (c == '"') in_string = 0;
+            continue;
+        }
+        if (c == '"') in_string = 1;
+        else if (c == '{' || c == '[') depth++;
+        else if (c == '}' || c == ']') {
+            depth--;
+            if (depth == 0) return cursor + 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Find value of "key" inside [object, end), whitespace around colon is skipped
+    Returns first char of value or NULL if not found
+*/
+const char* gelbooru_json_find_value(const char *object, const char *end, const char *key) {
+    char pattern[64];
+    int pattern_len = snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    if (pattern_len <= 0 || pattern_len >= (int) sizeof(pattern)) return NULL;
+
+    const char *cursor = object;
+    while (cursor < end) {
+        const char *found = memmem(cursor, end - cursor, pattern, pattern_len);
+        if (found == NULL) return NULL;
+
+        // same text as string value is not a key
+        const char *value = found + pattern_len;
+        while (value < end && (*value == ' ' || *value == '\t' || *value == '\r' || *value == '\n')) value++;
+        if (value < end && *value == ':') {
+            value++;
+            while (value < end && (*value == ' ' || *value == '\t' || *value == '\r' || *value == '\n')) value++;
+            return value < end ? value : NULL;
+        }
+        cursor = found + pattern_len;
+    }
+    return NULL;
+}
+
+/*
+    Find "key":"value" inside [object, end) and return unescaped value copy
+    Returns NULL if not found
+*/
+char* gelbooru_json_string_value(const char *object, const char *end, const char *key) {
+    const char *value = gelbooru_json_find_value(object, end, key);
+    if (value == NULL || *value != '"') return NULL;
+
+    value++;
+    const char *value_end = value;
+    while (value_end < end && *value_end != '"') {
+        if (*value_end == '\\') value_end++;
+        value_end++;
+    }
+    if (value_end >= end) return NULL;
+
+    char *result = (char*) malloc(value_end - value + 1);
+    if (result == NULL) return NULL;
+
+    int len = 0;
+    for (const char *c = value; c < value_end; c++) {
+        if (*c == '\\' && c + 1 < value_end) c++; // \/ and \" escapes
+        result[len++] = *c;
+    }
+    result[len] = '\0';
+    return result;
+}
+
+/*
+    Find "key":number inside [object, end)
+    Returns -1 if not found
+*/
+long long gelbooru_json_int_value(const char *object, const char *end, const char *key) {
+    const char *cursor = gelbooru_json_find_value(object, end, key);
+    if (cursor == NULL) return -1;
+
+    if (cursor < end && *cursor == '"') cursor++;
+    if (cursor >= end || *cursor < '0' || *cursor > '9') return -1;
+
+    long long value = 0;
+    while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+        value = value * 10 + (*cursor - '0');
+        cursor++;
+    }
+    return value;
+}
+
+/*
+    Parse posts from JSON API raw data
+    Returns vector gelbooru_post, total_count is set to posts count of query
+*/
+vector* gelbooru_parse_api_posts(gelbooru_raw_data* raw_data, int *total_count) {
+    if (raw_data == NULL || raw_data->data == NULL) return NULL;
+
+    const char *data = raw_data->data;
+    const char *end = raw_data->data + raw_data->size;
+
+    // "@attributes":{"limit":100,"offset":0,"count":1234}
+    const char *attributes = gelbooru_json_find_value(data, end, "@attributes");
+    if (attributes == NULL || *attributes != '{') {
+        printf("Failed to find API response attributes\n");
+        return NULL;
+    }
+    if (total_count != NULL) {
+        const char *attributes_end = memchr(attributes, '}', end - attributes);
+        long long count = gelbooru_json_int_value(attributes, attributes_end != NULL ? attributes_end : end, "count");
+        *total_count = count > 0 ? (int) count : 0;
+    }
+
+    vector *posts = vector_create();
+    if (posts == NULL) return NULL;
+
+    // no "post" key when query has no posts
+    const char *array = gelbooru_json_find_value(data, end, "post");
+    if (array == NULL || *array != '[') return posts;
+
+    const char *cursor = array + 1;
+    while (cursor < end) {
+        const char *object = memchr(cursor, '{', end - cursor);
+        if (object == NULL) break;
+        const char *object_end = gelbooru_json_object_end(object, end);
+        if (object_end == NULL) break;
+
+        // hash is part of output path, only MD5 hex is taken
+        unsigned char md5[16];
+        char *hash = gelbooru_json_string_value(object, object_end, "md5");
+        if (gelbooru_md5_from_hex(hash, md5) != 0) {
+            free(hash);
+            cursor = object_end;
+            continue;
+        }
+        gelbooru_post *post = gelbooru_post_create(hash);
+        if (post == NULL) {
+            free(hash);
+            cursor = object_end;
+            continue;
+        }
+        post->id = gelbooru_json_int_value(object, object_end, "id");
+        post->file_url = gelbooru_json_string_value(object, object_end, "file_url");
+
+        // image is "hash.ext"
+        char *image = gelbooru_json_string_value(object, object_end, "image");
+        if (image != NULL) {
+            char *dot = strrchr(image, '.');
+            if (dot != NULL) post->format = strdup(dot + 1);
+            free(image);
+        }
+
+        if (vector_push_back(posts, post) != 0) {
+            gelbooru_post_free(post);
+            break;
+        }
+        cursor = object_end;
+    }
+    return posts;
+}
+
+
+
+
+/*
+    Posts
+*/
+
+/* Create post, takes ownership of hash */
+gelbooru_post* gelbooru_post_create(char *hash) {
+    if (hash == NULL) return NULL;
+
+    gelbooru_post *post = (gelbooru_post*) malloc(sizeof(gelbooru_post));
+    if (post == NULL) return NULL;
+
+    post->hash = hash;
+    post->format = NULL;
+    post->file_url = NULL;
+    post->id = -1;
+    post->job = NULL;
+    return post;
+}
+
+/* Free post */
+void gelbooru_post_free(gelbooru_post *post) {
+    if (post != NULL) {
+        free(post->hash);
+        free(post->format);
+        free(post->file_url);
+        free(post);
+    }
+}
+
+/* Free vector gelbooru_post */
+void gelbooru_post_list_free(vector *posts) {
+    if (posts != NULL) {
+        for (int i = 0; i < vector_size(posts); i++) {
+            gelbooru_post_free(vector_index(posts, i));
+        }
+        vector_destroy(posts);
+    }
+}
+
+/*
+    Pass posts to callback as one batch, posts not taken by callback are freed
+    Vector is emptied
+    Returns number of taken posts
+*/
+int gelbooru_deliver_posts(vector *posts, gelbooru_posts_callback on_posts, void *userp) {
+    int count = vector_size(posts);
+    if (count <= 0) return 0;
+
+    int taken = on_posts((gelbooru_post**) posts->data, count, userp);
+    if (taken < 0) taken = 0;
+    for (int i = taken; i < count; i++) {
+        gelbooru_post_free(vector_index(posts, i));
+    }
+    posts->size = 0;
+    return taken;
+}
+
+/*
+    Deliver scanned hashes of stream as posts
+*/
+void gelbooru_page_stream_flush(gelbooru_page_stream *stream) {
+    for (int i = 0; i < vector_size(stream->hashes); i++) {
+        char *hash = vector_index(stream->hashes, i);
+        gelbooru_post *post = gelbooru_post_create(hash);
+        if (post == NULL || vector_push_back(stream->posts, post) != 0) {
+            if (post != NULL) gelbooru_post_free(post);
+            else free(hash);
+        }
+    }
+    stream->hashes->size = 0;
+    stream->post_count += gelbooru_deliver_posts(stream->posts, stream->on_posts, stream->userp);
+}
+
+/*
+    Write callback for streamed HTML posts page
+    Scans chunks as they arrive, posts are delivered before page is fully loaded
+    Only unscanned tail of page is kept in buffer
+    Transfer is aborted on first chunk if status is not 200, error pages are not scanned
+*/
+size_t gelbooru_page_stream_write_curl_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    gelbooru_page_stream *stream = (gelbooru_page_stream*) userp;
+    size_t realsize = size * nmemb;
+
+    if (!stream->status_checked) {
+        long http_code = 0;
+        curl_easy_getinfo(stream->curl, CURLINFO_RESPONSE_CODE, &http_code);
+        if (http_code != 200) return 0;
+        stream->status_checked = 1;
+    }
+
+    if (gelbooru_rawdata_write_curl_callback(contents, size, nmemb, &stream->buffer) != realsize) {
+        return 0;
+    }
+
+    gelbooru_raw_data *buffer = &stream->buffer;
+    size_t scanned = gelbooru_scan_posts_html(buffer->data, buffer->size, 0, stream->hashes, &stream->max_pid, &stream->max_id);
+    memmove(buffer->data, buffer->data + scanned, buffer->size - scanned);
+    buffer->size -= scanned;
+    buffer->data[buffer->size] = '\0';
+
+    gelbooru_page_stream_flush(stream);
+    return realsize;
+}
+
+/* Collects posts to vector */
+int gelbooru_post_list_push_callback(gelbooru_post **posts, int count, void *userp) {
+    for (int i = 0; i < count; i++) {
+        if (vector_push_back((vector*) userp, posts[i]) != 0) return i;
+    }
+    return count;
+}
+
+/*
+    Fetch and parse one listing page with gbooru listing mode
+    Posts are passed to on_posts in batches as soon as they are parsed
+    HTML pages are parsed and delivered while loading, API pages at once after load
+    Page is 0-based, max_page (if not NULL) is set to last page number,
+    total (if not NULL) to number of posts of listing, HTML pages only know it on last page, else -1,
+    max_id (if not NULL) to newest post id of page or -1
+    Returns number of posts or -1
+*/
+int gelbooru_stream_posts_page(gelbooru* gbooru, CURL *curl, vector* tags, int page, int *max_page, int *total, long long *max_id, gelbooru_posts_callback on_posts, void *userp) {
+    if (gbooru == NULL || curl == NULL || page < 0 || on_posts == NULL) return -1;
+
+    int api = gbooru->listing_mode == GELBOORU_LISTING_API;
+    char *url = api
+        ? gelbooru_construct_api_posts_url(gelbooru_get_host(gbooru), tags, page, gbooru->api_user_id, gbooru->api_key)
+        : gelbooru_construct_posts_page_url(gelbooru_get_host(gbooru), tags, page * GELBOORU_HTML_POSTS_PER_PAGE);
+    if (url == NULL) {
+        printf("Failed to construct posts page url\n");
+        return -1;
+    }
+
+    // API
+    if (api) {
+        gelbooru_raw_data *raw_data = gelbooru_get_request_with_handle(gbooru, curl, url);
+        free(url);
+        if (raw_data == NULL) return -1;
+
+        long http_code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        if (http_code != 200) {
+            gelbooru_raw_data_free(raw_data);
+            return -1;
+        }
+
+        int total_count = 0;
+        vector *posts = gelbooru_parse_api_posts(raw_data, &total_count);
+        gelbooru_raw_data_free(raw_data);
+        if (posts == NULL) return -1;
+
+        if (max_page != NULL) {
+            *max_page = total_count > 0 ? (total_count - 1) / GELBOORU_API_POSTS_PER_PAGE : 0;
+        }
+        if (total != NULL) *total = total_count;
+        if (max_id != NULL) {
+            *max_id = -1;
+            for (int i = 0; i < vector_size(posts); i++) {
+                gelbooru_post *post = vector_index(posts, i);
+                if (post->id > *max_id) *max_id = post->id;
+            }
+        }
+
+        int post_count = gelbooru_deliver_posts(posts, on_posts, userp);
+        vector_destroy(posts);
+        return post_count;
+    }
+
+    // HTML
+    gelbooru_page_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.curl = curl;
+    stream.max_pid = -1;
+    stream.max_id = -1;
+    stream.on_posts = on_posts;
+    stream.userp = userp;
+    stream.hashes = vector_create();
+    stream.posts = vector_create();
+    if (stream.hashes == NULL || stream.posts == NULL) {
+        vector_destroy(stream.hashes);
+        vector_destroy(stream.posts);
+        free(url);
+        return -1;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, gelbooru_page_stream_write_curl_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &stream);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+    CURLcode res = curl_easy_perform(curl);
+    free(url);
+    gelbooru_metrics_record_request(gbooru->metrics, GELBOORU_REQUEST_PAGE, curl, res);
+
+    long http_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (res == CURLE_OK && http_code != 200) res = CURLE_HTTP_RETURNED_ERROR;
+
+    // rest of page
+    if (res == CURLE_OK && stream.buffer.data != NULL) {
+        gelbooru_scan_posts_html(stream.buffer.data, stream.buffer.size, 1, stream.hashes, &stream.max_pid, &stream.max_id);
+        gelbooru_page_stream_flush(&stream);
+    }
+    free(stream.buffer.data);
+    vector_destroy(stream.hashes);
+    vector_destroy(stream.posts);
+
+    if (res != CURLE_OK) return -1;
+    // no paginator, all posts are on one page (or there are none)
+    int last_page = stream.max_pid >= 0 ? stream.max_pid / GELBOORU_HTML_POSTS_PER_PAGE : 0;
+    if (max_page != NULL) *max_page = last_page;
+    if (total != NULL) *total = page == last_page ? page * GELBOORU_HTML_POSTS_PER_PAGE + stream.post_count : -1;
+    if (max_id != NULL) *max_id = stream.max_id;
+    return stream.post_count;
+}
+
+/*
+    Fetch and parse one listing page with gbooru listing mode
+    Page is 0-based, max_page (if not NULL) is set to last page number
+    Returns vector gelbooru_post or NULL
+*/
+vector* gelbooru_fetch_posts_page(gelbooru* gbooru, CURL *curl, vector* tags, int page, int *max_page) {
+    vector *posts = vector_create();
+    if (posts == NULL) return NULL;
+
+    if (gelbooru_stream_posts_page(gbooru, curl, tags, page, max_page, NULL, NULL, gelbooru_post_list_push_callback, posts) < 0) {
+        gelbooru_post_list_free(posts);
+        return NULL;
+    }
+    return posts;
+}
+
+
+
+
+
+/*
+    Search tags
+    Returns vector gelbooru_tag
+*/
+vector* gelbooru_tag_search(gelbooru* gbooru, const char* query) {
+    if (gbooru == NULL) return NULL;
+    if (query == NULL || strlen(query) == 0) {
+        printf("Query string is empty\n");
+        return NULL;
+    }
+    if (strlen(query) < 3) {
+        printf("Query string is too short < 3\n");
+        return NULL;
+    }
+
+    char* url = gelbooru_construct_tag_search_url(gelbooru_get_host(gbooru), query);
+    if (url == NULL) {
+        printf("Failed to construct tag search url\n");
+        return NULL;
+    }
+
+    gelbooru_raw_data *raw_data = gelbooru_get_request(gbooru, url);
+    if (raw_data == NULL) {
+        printf("Failed to GET %s\n", url);
+        free(url);
+        return NULL;
+    }
+    
+    vector *tags = gelbooru_parse_tags(raw_data);
+    
+    free(url);
+    gelbooru_raw_data_free(raw_data);
+    return tags;
+}
+
+/*
+    Destructor for vector gelbooru tag
+*/
+void gelbooru_tag_list_free(vector* tags) {
+    if (tags != NULL) {
+        for (int i = 0; i < vector_size(tags); i++) {
+            gelbooru_tag* tag = vector_index(tags, i);
+            free(tag->tag);
+            free(tag);
+        }
+        free(tags);
+    }
+}
+
+
+
+
+
+
+/*
+    CURL image write callback 
+    Body of 200 response is kept in memory, part file is only opened to append 206 response of resume,
+    bodies of failed formats are dropped
+    Written bytes are hashed, on resume part file is hashed first
+    New images are kept in memory for writer stage and spilled to part file if they grow too big
+*/
+size_t gelbooru_image_write_curl_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    gelbooru_transfer *transfer = (gelbooru_transfer*) userp;
+    size_t realsize = size * nmemb;
+
+    if (transfer->fp == NULL && !transfer->in_memory) {
+        long http_code = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &http_code);
+        int resumed = http_code == 206 && transfer->resume_from > 0;
+        if (http_code != 200 && !resumed) return realsize;
+
+        // server ignored range, start from scratch
+        if (!resumed) transfer->resume_from = 0;
+
+        if (transfer->verify) {
+            gelbooru_md5_init(&transfer->md5_ctx);
+            if (resumed && gelbooru_md5_update_file(&transfer->md5_ctx, transfer->part_path, transfer->resume_from) != 0) {
+                // part file changed, same format again from scratch
+                transfer->restart = remove(transfer->part_path) == 0 || transfer->resumes++ < GELBOORU_TRANSFER_MAX_RESUMES;
+                return 0;
+            }
+        }
+
+        if (resumed) {
+            transfer->fp = gelbooru_transfer_open_part(transfer, "ab");
+            if (transfer->fp == NULL) return 0;
+        } else {
+            transfer->in_memory = 1;
+            transfer->body_size = 0;
+        }
+    }
+
+    if (transfer->in_memory) {
+        size_t size = transfer->body_size + realsize;
+        if (size <= GELBOORU_TRANSFER_MEMORY_LIMIT && gelbooru_transfer_reserve_body(transfer, size) == 0) {
+            memcpy(transfer->body + transfer->body_size, contents, realsize);
+            transfer->body_size += realsize;
+            if (transfer->verify) gelbooru_md5_update(&transfer->md5_ctx, contents, realsize);
+            transfer->written += realsize;
+            return realsize;
+        }
+        if (gelbooru_transfer_spill(transfer) != 0) return 0;
+    }
+
+    size_t written = fwrite(contents, size, nmemb, transfer->fp);
+    if (transfer->verify) gelbooru_md5_update(&transfer->md5_ctx, contents, written * size);
+    transfer->written += written * size;
+    return written * size;
+}
+
+
+/*
+    Open part file of transfer, shard dirs are created if needed
+    Returns NULL if failed
+*/
+FILE* gelbooru_transfer_open_part(gelbooru_transfer *transfer, const char *mode) {
+    gelbooru_transfer_make_dirs(transfer);
+
+    FILE *fp = fopen(transfer->part_path, mode);
+    if (fp == NULL && transfer->bar != NULL) {
+        char postfix[32];
+        sprintf(postfix, "%-20s", "Failed to open");
+        ProgressBar_set_postfix_text(transfer->bar, postfix);
+    }
+
+    // streamed image, reserve its blocks at once
+    curl_off_t length = -1;
+    if (fp != NULL && curl_easy_getinfo(transfer->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK && length > 0) {
+        gelbooru_transfer_preallocate(fileno(fp), transfer->resume_from + length);
+    }
+    return fp;
+}
+
+/* Create shard dirs of transfer output path */
+void gelbooru_transfer_make_dirs(gelbooru_transfer *transfer) {
+    gelbooru_job *job = transfer->job;
+    if (job->layout == GELBOORU_LAYOUT_SHARDED) {
+        gelbooru_make_shard_dirs(job->shard_dirs, job->dir_path, transfer->post->hash);
+    }
+}
+
+/* Reserve size bytes of file without changing its size, so appends stay in place, errors are ignored */
+void gelbooru_transfer_preallocate(int fd, long long size) {
+    // fails where file system does not support it, writes still work then
+    if (size > 0) fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+}
+
+/*
+    Move image kept in memory to part file, transfer continues writing to file
+    Returns 0 if OK
+*/
+int gelbooru_transfer_spill(gelbooru_transfer *transfer) {
+    transfer->in_memory = 0;
+    transfer->fp = gelbooru_transfer_open_part(transfer, "wb");
+    int failed = transfer->fp == NULL
+        || (transfer->body_size > 0 && fwrite(transfer->body, 1, transfer->body_size, transfer->fp) != transfer->body_size);
+    gelbooru_transfer_free_body(transfer);
+    return failed ? -1 : 0;
+}
+
+/*
+    Grow in-memory image to hold size bytes, capacity is taken from memory budget of gelbooru
+    Returns 0 if OK, -1 if budget is used up or allocation failed (image goes to part file)
+*/
+int gelbooru_transfer_reserve_body(gelbooru_transfer *transfer, size_t size) {
+    if (size <= transfer->body_capacity) return 0;
+
+    size_t capacity = transfer->body_capacity > 0 ? transfer->body_capacity : 64 * 1024;
+    while (capacity < size) capacity *= 2;
+    long long grow = capacity - transfer->body_capacity;
+
+    gelbooru *gbooru = transfer->gbooru;
+    if (atomic_fetch_add(&gbooru->memory_used, grow) + grow > gbooru->memory_budget) {
+        atomic_fetch_sub(&gbooru->memory_used, grow);
+        return -1;
+    }
+    char *body = (char*) realloc(transfer->body, capacity);
+    if (body == NULL) {
+        atomic_fetch_sub(&gbooru->memory_used, grow);
+        return -1;
+    }
+    transfer->body = body;
+    transfer->body_capacity = capacity;
+    return 0;
+}
+
+/* Free in-memory image and return its capacity to memory budget */
+void gelbooru_transfer_free_body(gelbooru_transfer *transfer) {
+    if (transfer->body_capacity > 0) atomic_fetch_sub(&transfer->gbooru->memory_used, (long long) transfer->body_capacity);
+    free(transfer->body);
+    transfer->body = NULL;
+    transfer->body_size = 0;
+    transfer->body_capacity = 0;
+}
+
+/*
     CURL image write progress callback
+    Stores transfer progress, updates bar if transfer has own bar
+    Runs many times per second per transfer, so no locks and no formatting
+*/
+int gelbooru_image_write_progress_curl_callback(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    gelbooru_transfer *transfer = (gelbooru_transfer*) p;
+    transfer->dltotal = dltotal > 0 ? transfer->resume_from + dltotal : 0;
+    transfer->dlnow = transfer->resume_from + dlnow;
+    dltotal = transfer->dltotal;
+    dlnow = transfer->dlnow;
+
+    ProgressBar *bar = transfer->bar;
+    if (bar != NULL && dltotal > 0) {
+        ProgressBar_set_max_progress(bar, dltotal);
+        ProgressBar_set_progress(bar, dlnow);
+    }
+
+    return 0;
+}
+
+
+
+/*
+    Create transfer for post of open job
+    Takes ownership of post
+    If post format is known only it is tried (skipped if not in job formats),
+    else formats are tried in order of job stats (most frequent first)
+    Completed downloads are added to job index (if not NULL)
+*/
+gelbooru_transfer* gelbooru_transfer_create(gelbooru* gbooru, gelbooru_job *job, gelbooru_post *post, ProgressBar *bar) {
+    if (gbooru == NULL || job == NULL || post == NULL) return NULL;
+    gelbooru_format_stats *stats = job->format_stats;
+
+    // hash is part of output path and checked against downloaded bytes
+    unsigned char md5[16];
+    if (gelbooru_md5_from_hex(post->hash, md5) != 0) {
+        printf("Invalid post hash %.64s\n", post->hash);
+        return NULL;
+    }
+
+    gelbooru_transfer *transfer = (gelbooru_transfer*) malloc(sizeof(gelbooru_transfer));
+    if (transfer == NULL) {
+        printf("Failed to allocate mem for transfer\n");
+        return NULL;
+    }
+    memset(transfer, 0, sizeof(gelbooru_transfer));
+    memcpy(transfer->md5, md5, 16);
+
+    transfer->format_count = vector_size(job->formats);
+    transfer->format_order = (int*) malloc(sizeof(int) * (transfer->format_count > 0 ? transfer->format_count : 1));
+    if (transfer->format_order == NULL) {
+        printf("Failed to allocate mem for transfer format order\n");
+        free(transfer);
+        return NULL;
+    }
+    if (post->format != NULL) {
+        int known = -1;
+        for (int i = 0; i < transfer->format_count; i++) {
+            if (strcmp(vector_index(job->formats, i), post->format) == 0) known = i;
+        }
+        transfer->format_order[0] = known;
+        transfer->format_count = known >= 0 ? 1 : 0;
+    } else if (stats != NULL && stats->count == transfer->format_count) {
+        gelbooru_format_stats_order(stats, transfer->format_order);
+    } else {
+        for (int i = 0; i < transfer->format_count; i++) transfer->format_order[i] = i;
+    }
+
+    transfer->gbooru = gbooru;
+    transfer->job = job;
+    transfer->post = post;
+    transfer->stats = stats;
+    transfer->index = job->index;
+    transfer->format_pos = -1;
+    transfer->format_index = -1;
+    transfer->bar = bar;
+    transfer->verify = gbooru->verify_md5;
+    transfer->write_fd = -1;
+    ProgressBar_set_unit(bar, PROGRESS_BAR_UNIT_BYTES);
+    return transfer;
+}
+
+/* Destroy transfer */
+void gelbooru_transfer_destroy(gelbooru_transfer *transfer) {
+    if (transfer != NULL) {
+        if (transfer->fp != NULL) fclose(transfer->fp);
+        if (transfer->write_fd >= 0) close(transfer->write_fd);
+        gelbooru_transfer_free_body(transfer);
+        gelbooru_post_free(transfer->post);
+        free(transfer->url);
+        free(transfer->output_path);
+        free(transfer->part_path);
+        free(transfer->format_order);
+        free(transfer);
+    }
+}
+
+/*
+    Check if image exists on disk with any of added formats
+    Returns format index or -1
+*/
+int gelbooru_transfer_find_existing(gelbooru_transfer *transfer) {
+    gelbooru_job *job = transfer->job;
+
+    for (int i = 0; i < transfer->format_count; i++) {
+        int format_index = transfer->format_order[i];
+        char *path = gelbooru_construct_download_path(job, transfer->post->hash, vector_index(job->formats, format_index));
+        if (path == NULL) continue;
+
+        int exists = gelbooru_file_exists(path);
+        free(path);
+        if (exists) return format_index;
+    }
+    return -1;
+}
+
+/*
+    Prepare curl handle for next image format
+    Returns GELBOORU_TRANSFER_READY if handle is ready to perform,
+    GELBOORU_TRANSFER_EXISTS if image already downloaded,
+    GELBOORU_TRANSFER_FAILED if no formats left or error
+*/
+int gelbooru_transfer_next(gelbooru_transfer *transfer, CURL *curl) {
+    if (transfer == NULL || curl == NULL) return GELBOORU_TRANSFER_FAILED;
+    gelbooru *gbooru = transfer->gbooru;
+    gelbooru_job *job = transfer->job;
+
+    char prefix[PROGRESS_BAR_TEXT_SIZE], postfix[32];
+    free(transfer->url);
+    free(transfer->output_path);
+    free(transfer->part_path);
+    transfer->url = NULL;
+    transfer->output_path = NULL;
+    transfer->part_path = NULL;
+
+    // index, then all formats are checked on disk before first request
+    // (disk is only checked without index)
+    if (transfer->format_pos < 0) {
+        if (gelbooru_index_contains(transfer->index, transfer->post->hash) || gelbooru_pack_contains(job->pack, transfer->post->hash)) {
+            if (transfer->bar != NULL) {
+                sprintf(postfix, "%-20s", "Exists");
+                ProgressBar_set_postfix_text(transfer->bar, postfix);
+            }
+            return GELBOORU_TRANSFER_EXISTS;
+        }
+
+        int existing = -1;
+        if (transfer->index == NULL) {
+            existing = gelbooru_transfer_find_existing(transfer);
+        }
+        if (existing >= 0) {
+            transfer->format_index = existing;
+            gelbooru_format_stats_hit(transfer->stats, existing);
+            gelbooru_index_add(transfer->index, transfer->post->hash, vector_index(job->formats, existing), 0);
+            if (transfer->bar != NULL) {
+                snprintf(prefix, sizeof(prefix), "%-32s.%-5s", transfer->post->hash, (char*) vector_index(job->formats, existing));
+                ProgressBar_set_prefix_text(transfer->bar, prefix);
+                sprintf(postfix, "%-20s", "Exists");
+                ProgressBar_set_postfix_text(transfer->bar, postfix);
+            }
+            return GELBOORU_TRANSFER_EXISTS;
+        }
+    }
+
+    if (transfer->restart) transfer->restart = 0;
+    else transfer->format_pos++;
+    if (transfer->format_pos >= transfer->format_count) {
+        return GELBOORU_TRANSFER_FAILED;
+    }
+    transfer->format_index = transfer->format_order[transfer->format_pos];
+    const char *format = vector_index(job->formats, transfer->format_index);
+
+    // construct url, API posts have exact url
+    if (transfer->post->format != NULL && transfer->post->file_url != NULL) {
+        transfer->url = strdup(transfer->post->file_url);
+    } else {
+        transfer->url = gelbooru_construct_image_url(gelbooru_get_host(gbooru), transfer->post->hash, format);
+    }
+    if (transfer->url == NULL) return GELBOORU_TRANSFER_FAILED;
+
+    // construct output path
+    transfer->output_path = gelbooru_construct_download_path(job, transfer->post->hash, format);
+    if (transfer->output_path == NULL) return GELBOORU_TRANSFER_FAILED;
+
+    transfer->part_path = (char*) malloc(strlen(transfer->output_path) + strlen(GELBOORU_PART_FILE_SUFFIX) + 1);
+    if (transfer->part_path == NULL) return GELBOORU_TRANSFER_FAILED;
+    sprintf(transfer->part_path, "%s%s", transfer->output_path, GELBOORU_PART_FILE_SUFFIX);
+
+    // resume from part file left by interrupted transfer
+    struct stat st;
+    transfer->resume_from = 0;
+    if (stat(transfer->part_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        transfer->resume_from = st.st_size;
+    }
+
+    // update bar
+    if (transfer->bar != NULL) {
+        snprintf(prefix, sizeof(prefix), "%-32s.%-5s", transfer->post->hash, format);
+        ProgressBar_set_prefix_text(transfer->bar, prefix);
+        ProgressBar_set_progress(transfer->bar, 0);
+    }
+
+    // curl
+    transfer->curl = curl;
+    transfer->dlnow = 0;
+    transfer->dltotal = 0;
+    transfer->written = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, transfer->url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, gelbooru_image_write_curl_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) transfer);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, transfer->resume_from);
+
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, gelbooru_image_write_progress_curl_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, transfer);
+    return GELBOORU_TRANSFER_READY;
+}
+
+/*
+    Finish performed curl handle
+    Part file is renamed to output path if image downloaded, kept if transfer was interrupted
+    Returns GELBOORU_TRANSFER_DONE if image downloaded (not stored yet, see gelbooru_transfer_write),
+    GELBOORU_TRANSFER_RETRY if same format should be tried again later (error_class is set),
+    GELBOORU_TRANSFER_NEXT_FORMAT if next format (or same format again) should be tried
+*/
+int gelbooru_transfer_complete(gelbooru_transfer *transfer, CURL *curl, CURLcode res) {
+    if (transfer == NULL || curl == NULL) return GELBOORU_TRANSFER_FAILED;
+    gelbooru_metrics_record_request(transfer->gbooru->metrics, GELBOORU_REQUEST_IMAGE, curl, res);
+
+    long http_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+    // close, image kept in memory is saved to part file if transfer was interrupted
+    int in_memory = transfer->in_memory;
+    int opened = transfer->fp != NULL || in_memory;
+    transfer->in_memory = 0;
+    if (in_memory && res != CURLE_OK && transfer->written > 0) {
+        in_memory = 0;
+        if (gelbooru_transfer_spill(transfer) != 0) remove(transfer->part_path);
+    }
+    if (transfer->fp != NULL) {
+        fclose(transfer->fp);
+        transfer->fp = NULL;
+    }
+    curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+
+    if (res == CURLE_OK && (http_code == 200 || http_code == 206) && opened) {
+        // corrupted or truncated body, download again from scratch
+        if (transfer->verify) {
+            unsigned char md5[16];
+            gelbooru_md5_final(&transfer->md5_ctx, md5);
+            if (memcmp(md5, transfer->md5, 16) != 0) {
+                if (in_memory) gelbooru_transfer_free_body(transfer);
+                else remove(transfer->part_path);
+                transfer->error_class = GELBOORU_ERROR_CORRUPT;
+                transfer->restart = 1;
+                return GELBOORU_TRANSFER_RETRY;
+            }
+        }
+
+        // stored by gelbooru_transfer_write, body stays in memory until then
+        transfer->in_memory = in_memory;
+        gelbooru_format_stats_hit(transfer->stats, transfer->format_index);
+        return GELBOORU_TRANSFER_DONE;
+    }
+
+    // part file is bigger than image (or changed), same format again from scratch
+    // without part file next request is not ranged, so it cannot end here again
+    if (http_code == 416 && transfer->resume_from > 0) {
+        transfer->restart = remove(transfer->part_path) == 0 || transfer->resumes++ < GELBOORU_TRANSFER_MAX_RESUMES;
+        return GELBOORU_TRANSFER_NEXT_FORMAT;
+    }
+
+    // interrupted after some bytes, resume same format at once
+    if (res != CURLE_OK && opened && transfer->written > 0 && transfer->resumes < GELBOORU_TRANSFER_MAX_RESUMES) {
+        transfer->resumes++;
+        transfer->restart = 1;
+        return GELBOORU_TRANSFER_NEXT_FORMAT;
+    }
+
+    transfer->error_class = gelbooru_error_class(res, http_code);
+    if (transfer->error_class == GELBOORU_ERROR_NOT_FOUND) {
+        transfer->not_found++;
+        return GELBOORU_TRANSFER_NEXT_FORMAT;
+    }
+
+    // transient, same format later
+    if (gelbooru_retry_max_attempts(transfer->error_class) > 0) {
+        transfer->restart = 1;
+        return GELBOORU_TRANSFER_RETRY;
+    }
+    return GELBOORU_TRANSFER_NEXT_FORMAT;
+}
+
+
+/*
+    Write image kept in memory to part file, or open streamed part file if it must be synced
+    With pack storage nothing is written, image goes to pack on commit
+    Part file stays open (write_fd) until commit, so batch can be synced first
+    Returns 0 if OK
+*/
+int gelbooru_transfer_write_part(gelbooru_transfer *transfer, int fsync_policy) {
+    if (transfer->job->pack != NULL) return 0;
+
+    int fd = -1;
+    if (transfer->in_memory) {
+        gelbooru_transfer_make_dirs(transfer);
+        fd = open(transfer->part_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) return -1;
+        gelbooru_transfer_preallocate(fd, transfer->body_size);
+        if (gelbooru_write_all(fd, transfer->body, transfer->body_size) != 0) {
+            close(fd);
+            remove(transfer->part_path);
+            return -1;
+        }
+    } else if (fsync_policy != GELBOORU_FSYNC_NONE) {
+        fd = open(transfer->part_path, O_WRONLY);
+        if (fd < 0) return -1;
+    }
+
+    transfer->write_fd = fd;
+    if (fsync_policy == GELBOORU_FSYNC_IMAGE) return gelbooru_transfer_sync_part(transfer);
+    return 0;
+}
+
+/*
+    Flush open part file to disk, failed part file is closed and removed
+    Returns 0 if OK
+*/
+int gelbooru_transfer_sync_part(gelbooru_transfer *transfer) {
+    if (transfer->write_fd < 0 || fsync(transfer->write_fd) == 0) return 0;
+    close(transfer->write_fd);
+    transfer->write_fd = -1;
+    remove(transfer->part_path);
+    return -1;
+}
+
+/*
+    Move written part file to output path and add image to index, or append image to pack
+    Returns 0 if OK
+*/
+int gelbooru_transfer_commit(gelbooru_transfer *transfer) {
+    if (transfer->write_fd >= 0) {
+        close(transfer->write_fd);
+        transfer->write_fd = -1;
+    }
+
+    const char *format = vector_index(transfer->job->formats, transfer->format_index);
+    gelbooru_pack *pack = transfer->job->pack;
+    if (pack != NULL) {
+        int appended = transfer->in_memory
+            ? gelbooru_pack_append(pack, transfer->post->hash, format, transfer->body, transfer->body_size)
+            : gelbooru_pack_append_file(pack, transfer->post->hash, format, transfer->part_path);
+        if (appended != 0) {
+            printf("Failed to append %s to pack\n", transfer->post->hash);
+            return -1;
+        }
+        if (!transfer->in_memory) remove(transfer->part_path);
+        return 0;
+    }
+
+    if (rename(transfer->part_path, transfer->output_path) != 0) {
+        printf("Failed to rename %s\n", transfer->part_path);
+        return -1;
+    }
+    gelbooru_index_add(transfer->index, transfer->post->hash, format, transfer->resume_from + transfer->written);
+    return 0;
+}
+
+/*
+    Store downloaded image with fsync policy of gelbooru
+    Returns 0 if OK
+*/
+int gelbooru_transfer_write(gelbooru_transfer *transfer) {
+    int fsync_policy = transfer->gbooru->fsync_policy;
+    if (gelbooru_transfer_write_part(transfer, fsync_policy == GELBOORU_FSYNC_NONE ? GELBOORU_FSYNC_NONE : GELBOORU_FSYNC_IMAGE) != 0) return -1;
+    if (gelbooru_transfer_commit(transfer) != 0) return -1;
+    if (fsync_policy != GELBOORU_FSYNC_NONE) gelbooru_pack_sync(transfer->job->pack);
+    return 0;
+}
+
+
+/*
+    Open job of gelbooru_download_image, output dir of gelbooru is opened like for a run once
+    and kept until dir, formats, layout or storage change
+    Returns NULL if dir cannot be opened
+*/
+gelbooru_job* gelbooru_image_job(gelbooru* gbooru) {
+    pthread_mutex_lock(&gbooru->image_job_mutex);
+    if (gbooru->image_job == NULL) {
+        gelbooru_job *job = gelbooru_job_create(gbooru->downloads_dir_path != NULL ? gbooru->downloads_dir_path : GELBOORU_DEFAULT_DOWNLOAD_DIR_PATH);
+        if (job != NULL && gelbooru_job_open(gbooru, job) != 0) {
+            gelbooru_job_destroy(job);
+            job = NULL;
+        }
+        gbooru->image_job = job;
+    }
+    gelbooru_job *job = gbooru->image_job;
+    pthread_mutex_unlock(&gbooru->image_job_mutex);
+    return job;
+}
+
+/* Close job of gelbooru_download_image, settings are not changed while images download */
+void gelbooru_close_image_job(gelbooru* gbooru) {
+    pthread_mutex_lock(&gbooru->image_job_mutex);
+    gelbooru_job_destroy(gbooru->image_job);
+    gbooru->image_job = NULL;
+    pthread_mutex_unlock(&gbooru->image_job_mutex);
+}
+
+/*
+    Download image with hash to output dir of gelbooru
+    Check added formats
+    Return 0 if OK
+*/
+int gelbooru_download_image(gelbooru* gbooru, const char * hash, ProgressBar *bar) {
+    if (gbooru == NULL || hash == NULL) return -1;
+
+    gelbooru_job *job = gelbooru_image_job(gbooru);
+    if (job == NULL) return -1;
+    return gelbooru_download_job_image(gbooru, job, hash, bar);
+}
+
+/*
+    Download image with hash to output dir of open job (see gelbooru_job_open)
+    Check formats of job
+    Return 0 if OK
+*/
+int gelbooru_download_job_image(gelbooru* gbooru, gelbooru_job *job, const char *hash, ProgressBar *bar) {
+    if (gbooru == NULL || job == NULL || hash == NULL) return -1;
+
+    CURL *curl;
+    CURLcode res;
+    curl = gelbooru_curl_easy_create(gbooru);
+    if (curl == NULL) return -1;
+
+    char *hash_copy = strdup(hash);
+    gelbooru_post *post = gelbooru_post_create(hash_copy);
+    gelbooru_transfer *transfer = gelbooru_transfer_create(gbooru, job, post, bar);
+    if (transfer == NULL) {
+        if (post != NULL) gelbooru_post_free(post);
+        else free(hash_copy);
+        curl_easy_cleanup(curl);
+        return -1;
+    }
+
+    int success = -1;
+    unsigned int seed = (unsigned int) gelbooru_time_ms();
+    while (1) { // check all added formats
+        int status = gelbooru_transfer_next(transfer, curl);
+        if (status == GELBOORU_TRANSFER_EXISTS) success = 0;
+        if (status != GELBOORU_TRANSFER_READY) break;
+
+        res = curl_easy_perform(curl);
+        status = gelbooru_transfer_complete(transfer, curl, res);
+        if (status == GELBOORU_TRANSFER_DONE) {
+            success = gelbooru_transfer_write(transfer) == 0 ? 0 : -1;
+            break;
+        }
+        if (status == GELBOORU_TRANSFER_RETRY) {
+            long long delay = gelbooru_retry_delay_ms(transfer->error_class, transfer->attempts++, &seed);
+            if (delay < 0) break;
+            usleep(delay * 1000);
+        }
+    }
+
+    gelbooru_transfer_destroy(transfer);
+    curl_easy_cleanup(curl);
+    return success;
+}
+
+
+
+/*
+    Take next page to fetch, jobs are taken in order
+    Page 0 of job is fetched first, other pages of job wait until it gives max page,
+    pages of next jobs are taken meanwhile
+    Returns job of page or NULL if no pages left
+*/
+gelbooru_job* gelbooru_parser_take_page(gelbooru_downloader_data* data, int *page) {
+    gelbooru_job *taken = NULL;
+    pthread_mutex_lock(&data->parser_mutex);
+    while (!data->parser_failed) {
+        int waiting = 0;
+        for (int i = data->next_job; i < vector_size(data->jobs) && taken == NULL; i++) {
+            gelbooru_job *job = vector_index(data->jobs, i);
+            if (job->parser_failed || (job->max_page >= 0 && job->next_page > job->max_page)) {
+                if (i == data->next_job) data->next_job++;
+                continue;
+            }
+            if (job->next_page > 0 && job->max_page < 0) {
+                waiting = 1;
+                continue;
+            }
+            *page = job->next_page++;
+            taken = job;
+        }
+        if (taken != NULL || !waiting) break;
+        pthread_cond_wait(&data->parser_cond, &data->parser_mutex);
+    }
+    pthread_mutex_unlock(&data->parser_mutex);
+    return taken;
+}
+
+/*
+    Mark page of job as fetched, max_page of first page sets pages of job, max_id is newest post id of page
+    total is number of posts of listing reported by page or -1, pages reporting other listing than first page mark it changed
+    Failed first page stops job, other failed pages are counted
+*/
+void gelbooru_parser_finish_page(gelbooru_downloader_data* data, gelbooru_job *job, int page, int max_page, int total, long long max_id, int failed) {
+    pthread_mutex_lock(&data->parser_mutex);
+    if (failed && page == 0) {
+        job->parser_failed = 1;
+    } else if (failed) {
+        job->pages_failed++;
+        data->pages_failed++;
+    } else {
+        if (page == 0) {
+            job->max_page = max_page;
+            data->pages_total += max_page + 1;
+        } else if (max_page != job->max_page) {
+            job->listing_changed = 1;
+        }
+        if (total >= 0) {
+            if (job->total >= 0 && total != job->total) job->listing_changed = 1;
+            job->total = total;
+        }
+        if (max_id > job->max_id) job->max_id = max_id;
+        data->pages_done++;
+    }
+    pthread_cond_broadcast(&data->parser_cond);
+    pthread_mutex_unlock(&data->parser_mutex);
+}
+
+/*
+    Pushes parsed posts of job (gelbooru_job_arg) to download queue with one lock
+    Posts already listed for job in this run and known missing posts of job are dropped,
+    posts queued by other jobs of format group are kept to be stored for this job after downloads
+    Takes ownership of all posts
+*/
+int gelbooru_parser_push_posts_callback(gelbooru_post **posts, int count, void *userp) {
+    gelbooru_job_arg *arg = (gelbooru_job_arg*) userp;
+    gelbooru_downloader_data *data = arg->data;
+
+    int unique = 0, missing = 0, listed = 0;
+    for (int i = 0; i < count; i++) {
+        posts[i]->job = arg->job;
+
+        // hash is part of output path, posts without MD5 hash are dropped
+        unsigned char md5[16];
+        if (gelbooru_md5_from_hex(posts[i]->hash, md5) != 0) {
+            gelbooru_post_free(posts[i]);
+            continue;
+        }
+        if (gelbooru_hash_set_insert(arg->job->listed, md5) == 0) {
+            gelbooru_post_free(posts[i]);
+            continue;
+        }
+        listed++;
+
+        if (gelbooru_hash_file_contains(arg->job->missing, posts[i]->hash)) {
+            gelbooru_post_free(posts[i]);
+            missing++;
+            continue;
+        }
+
+        // job with other formats may need other file of post, so only jobs of group share it
+        gelbooru_hash_set *group = data->group_hashes[arg->job->format_group];
+        if (group != NULL && gelbooru_hash_set_insert(group, md5) == 0) {
+            pthread_mutex_lock(&data->parser_mutex);
+            int shared = vector_push_back(data->shared_posts, posts[i]) == 0;
+            pthread_mutex_unlock(&data->parser_mutex);
+            if (!shared) {
+                gelbooru_hash_file_add(arg->job->failed, posts[i]->hash, "shared");
+                gelbooru_post_free(posts[i]);
+            }
+            continue;
+        }
+        posts[unique++] = posts[i];
+    }
+    if (missing > 0 || (arg->listing && listed > 0)) {
+        pthread_mutex_lock(&data->parser_mutex);
+        data->missing_skipped += missing;
+        if (arg->listing) arg->job->listed_posts += listed;
+        pthread_mutex_unlock(&data->parser_mutex);
+    }
+
+    for (int i = 0; i < unique; i++) {
+        gelbooru_event(data->events, "queued", "\"hash\":\"%s\"", posts[i]->hash);
+    }
+
+    int pushed = tsq_push_batch(data->download_queue, (void**) posts, unique);
+    if (pushed > 0) atomic_fetch_add_explicit(&data->posts_queued, pushed, memory_order_relaxed);
+    if (pushed < unique) {
+        printf("Gelbooru parser thread: Failed push to download queue\n");
+        for (int i = pushed > 0 ? pushed : 0; i < unique; i++) {
+            gelbooru_post_free(posts[i]);
+        }
+    }
+    return count;
+}
+
+/*
+    Parser thread function.
+    Takes pages shared with other parser threads, push posts to download queue
+*/
+void* gelbooru_parser_thread_func(void *arg) {
+    gelbooru_thread_arg* args = (gelbooru_thread_arg*) arg;
+    if (args == NULL) {
+        printf("Gelbooru parser thread: empty args\n");
+        return NULL;
+    }
+    gelbooru* gbooru = args->gbooru;
+    gelbooru_downloader_data* data = args->data;
+    if (gbooru == NULL || data == NULL) {
+        return NULL;
+    }
+    int page, max_page = 0;
+    char prefix[32], postfix[32];
+    unsigned int seed = (unsigned int) gelbooru_time_ms() ^ (args->thread_id * 2654435761u);
+
+    CURL *curl = gelbooru_curl_easy_create(gbooru);
+    if (curl == NULL) {
+        printf("Gelbooru parser thread: failed to create curl handle\n");
+        pthread_mutex_lock(&data->parser_mutex);
+        data->parser_failed = 1;
+        pthread_cond_broadcast(&data->parser_cond);
+        pthread_mutex_unlock(&data->parser_mutex);
+        return NULL;
+    }
+
+    sprintf(prefix, "%-10s", "Parser");
+    ProgressBar_set_prefix_text(data->parser_bar, prefix);
+    gelbooru_job *job;
+    while ((job = gelbooru_parser_take_page(data, &page)) != NULL) {
+        gelbooru_job_arg job_arg = { data, job, 1 };
+        // fetch page, posts are pushed while page loads, max page is parsed from first page
+        // transient failures are fetched again after backoff
+        int post_count, attempt = 0, page_total = -1;
+        long long page_started_ms = 0, page_max_id = -1;
+        while (1) {
+            gelbooru_rate_limiter_wait(data->page_limiter);
+            page_started_ms = gelbooru_time_ms();
+            post_count = gelbooru_stream_posts_page(gbooru, curl, job->query_tags != NULL ? job->query_tags : job->tags, page, &max_page,
+                &page_total, &page_max_id, gelbooru_parser_push_posts_callback, &job_arg);
+
+            long http_code = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+            gelbooru_rate_limiter_feedback(data->page_limiter, http_code);
+            if (post_count >= 0) break;
+
+            // no response or 200 with failed body is lost connection (reset, truncated page)
+            int error_class = http_code == 0 || http_code == 200 ? GELBOORU_ERROR_NETWORK : gelbooru_error_class(CURLE_OK, http_code);
+            long long delay = gelbooru_retry_delay_ms(error_class, attempt++, &seed);
+            if (delay < 0) break;
+
+            gelbooru_event(data->events, "page_retry", "\"job\":%d,\"page\":%d,\"class\":\"%s\",\"status\":%ld,\"delay_ms\":%lld",
+                job->id, page, gelbooru_error_class_name(error_class), http_code, delay);
+            sprintf(postfix, "Retry page %-7d", page);
+            ProgressBar_set_postfix_text(data->parser_bar, postfix);
+            usleep(delay * 1000);
+        }
+
+        if (post_count < 0) {
+            sprintf(postfix, "Failed to GET page");
+            ProgressBar_set_postfix_text(data->parser_bar, postfix);
+
+            printf("Gelbooru parser thread: Failed to fetch posts page %d of %s\n", page, job->dir_path);
+            gelbooru_event(data->events, "page_failed", "\"job\":%d,\"page\":%d", job->id, page);
+            gelbooru_parser_finish_page(data, job, page, 0, -1, -1, 1);
+            continue;
+        }
+        gelbooru_event(data->events, "page", "\"job\":%d,\"page\":%d,\"posts\":%d,\"ms\":%lld",
+            job->id, page, post_count, gelbooru_time_ms() - page_started_ms);
+
+        gelbooru_parser_finish_page(data, job, page, max_page, page_total, page_max_id, 0);
+
+        pthread_mutex_lock(&data->parser_mutex);
+        int pages_done = data->pages_done;
+        int total_pages = data->pages_total;
+        pthread_mutex_unlock(&data->parser_mutex);
+
+        sprintf(postfix, "%-7d / %-7d", pages_done, total_pages);
+        ProgressBar_set_max_progress(data->parser_bar, total_pages);
+        ProgressBar_set_progress(data->parser_bar, pages_done);
+        ProgressBar_set_postfix_text(data->parser_bar, postfix);
+    }
+
+    curl_easy_cleanup(curl);
+    //ProgressBar_set_postfix_text(data->parser_bar, "Finished");
+    return NULL;
+}
+
+/* Destroy slot transfer, slot is free */
+void gelbooru_downloader_slot_finish(gelbooru_download_slot *slot, int *done_count) {
+    gelbooru_transfer_destroy(slot->transfer);
+    slot->transfer = NULL;
+    slot->waiting = 0;
+    (*done_count)++;
+}
+
+/*
+    Store downloaded transfers and destroy them
+    Batch is written first, synced with batch fsync policy, then committed
+*/
+void gelbooru_downloader_write_batch(gelbooru_downloader_data* data, gelbooru_transfer **transfers, int count) {
+    if (count <= 0) return;
+    gelbooru *gbooru = transfers[0]->gbooru;
+    int fsync_policy = gbooru->fsync_policy;
+
+    int failed[GELBOORU_WRITE_BATCH];
+    for (int i = 0; i < count; i++) {
+        failed[i] = gelbooru_transfer_write_part(transfers[i], fsync_policy) != 0;
+    }
+    if (fsync_policy == GELBOORU_FSYNC_BATCH) {
+        for (int i = 0; i < count; i++) {
+            if (!failed[i]) failed[i] = gelbooru_transfer_sync_part(transfers[i]) != 0;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (!failed[i]) failed[i] = gelbooru_transfer_commit(transfers[i]) != 0;
+    }
+    if (fsync_policy != GELBOORU_FSYNC_NONE) {
+        // pack of each job once
+        for (int i = 0; i < count; i++) {
+            int synced = 0;
+            for (int j = 0; j < i && !synced; j++) synced = transfers[j]->job == transfers[i]->job;
+            if (!synced) gelbooru_pack_sync(transfers[i]->job->pack);
+        }
+    }
+
+    // downloaded again next run
+    for (int i = 0; i < count; i++) {
+        gelbooru_transfer *transfer = transfers[i];
+        if (failed[i]) {
+            printf("Failed to store %s\n", transfer->post->hash);
+            gelbooru_hash_file_add(transfer->job->failed, transfer->post->hash, "write");
+            gelbooru_event(data->events, "write_failed", "\"hash\":\"%s\"", transfer->post->hash);
+        }
+        gelbooru_transfer_destroy(transfer);
+    }
+}
+
+/* Hand downloaded transfer to writer stage, stored at once if there is no writer stage */
+void gelbooru_downloader_write(gelbooru_downloader_data* data, gelbooru_transfer *transfer) {
+    if (data->write_queue != NULL && tsq_push(data->write_queue, transfer) == 0) return;
+    gelbooru_downloader_write_batch(data, &transfer, 1);
+}
+
+/*
+    Writer thread func
+    Stores downloaded images in batches until write queue is closed and empty
+*/
+void* gelbooru_writer_thread_func(void *arg) {
+    gelbooru_thread_arg* args = (gelbooru_thread_arg*) arg;
+    gelbooru_downloader_data* data = args->data;
+
+    gelbooru_transfer *transfers[GELBOORU_WRITE_BATCH];
+    int count;
+    while ((count = tsq_pop_batch(data->write_queue, (void**) transfers, GELBOORU_WRITE_BATCH)) > 0) {
+        gelbooru_downloader_write_batch(data, transfers, count);
+    }
+    return NULL;
+}
+
+/*
+    Queue images of job requeued by verify, requeue file is removed after
+    Returns number of read hashes
+*/
+int gelbooru_downloader_queue_requeued(gelbooru_downloader_data* data, gelbooru_job *job) {
+    char *path = (char*) malloc(strlen(job->dir_path) + strlen(GELBOORU_REQUEUE_FILE_NAME) + 2);
+    if (path == NULL) return 0;
+    sprintf(path, "%s/%s", job->dir_path, GELBOORU_REQUEUE_FILE_NAME);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        free(path);
+        return 0;
+    }
+
+    gelbooru_job_arg job_arg = { data, job, 0 };
+    gelbooru_post *posts[64];
+    int count = 0, total = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned char md5[16];
+        if (strlen(line) >= 32) line[32] = '\0';
+        if (gelbooru_md5_from_hex(line, md5) != 0) continue;
+
+        char *hash = strdup(line);
+        gelbooru_post *post = gelbooru_post_create(hash);
+        if (post == NULL) {
+            free(hash);
+            continue;
+        }
+        posts[count++] = post;
+        total++;
+        if (count == 64) {
+            gelbooru_parser_push_posts_callback(posts, count, &job_arg);
+            count = 0;
+        }
+    }
+    if (count > 0) gelbooru_parser_push_posts_callback(posts, count, &job_arg);
+    fclose(fp);
+
+    remove(path);
+    free(path);
+    return total;
+}
+
+/*
+    Record transfer that failed in all formats
+    Not found in all formats goes to negative cache, else to dead-letter list
+*/
+void gelbooru_downloader_record_failure(gelbooru_downloader_data* data, gelbooru_transfer *transfer) {
+    if (transfer->format_count == 0) return; // format is not wanted
+
+    if (transfer->not_found == transfer->format_count) {
+        gelbooru_hash_file_add(transfer->job->missing, transfer->post->hash, NULL);
+        gelbooru_event(data->events, "missing", "\"hash\":\"%s\"", transfer->post->hash);
+    } else {
+        const char *error_class = gelbooru_error_class_name(transfer->error_class);
+        gelbooru_hash_file_add(transfer->job->failed, transfer->post->hash, error_class);
+        gelbooru_event(data->events, "failed", "\"hash\":\"%s\",\"class\":\"%s\",\"attempts\":%d",
+            transfer->post->hash, error_class, transfer->attempts);
+    }
+}
+
+/*
+    Add prepared slot handle to multi if image request token is available
+    Returns 1 if added, 0 if slot waits for token (wait_ms is set), -1 on error
+*/
+int gelbooru_downloader_slot_add(CURLM *multi, gelbooru_download_slot *slot, gelbooru_downloader_data* data, long long *wait_ms) {
+    long long wait = gelbooru_rate_limiter_try_take(data->image_limiter);
+    slot->waiting = wait > 0;
+    if (slot->waiting) {
+        *wait_ms = wait;
+        return 0;
+    }
+
+    curl_easy_setopt(slot->curl, CURLOPT_PRIVATE, slot);
+    if (curl_multi_add_handle(multi, slot->curl) != CURLM_OK) return -1;
+
+    gelbooru_transfer *transfer = slot->transfer;
+    transfer->started_ms = gelbooru_time_ms();
+    gelbooru_event(data->events, "start", "\"hash\":\"%s\",\"format\":\"%s\",\"resume_from\":%lld",
+        transfer->post->hash, (char*) vector_index(transfer->job->formats, transfer->format_index), (long long) transfer->resume_from);
+    return 1;
+}
+
+/*
+    Start next format of slot transfer, finish slot if nothing to perform
+    Returns 1 if slot handle added to multi
+*/
+int gelbooru_downloader_slot_start(CURLM *multi, gelbooru_download_slot *slot, gelbooru_downloader_data* data, long long *wait_ms, int *done_count) {
+    int status = gelbooru_transfer_next(slot->transfer, slot->curl);
+    if (status == GELBOORU_TRANSFER_READY) {
+        int added = gelbooru_downloader_slot_add(multi, slot, data, wait_ms);
+        if (added >= 0) return added;
+
+        // handle not added to multi, image goes to dead-letter list so sync point stays before it
+        slot->transfer->error_class = GELBOORU_ERROR_OTHER;
+        status = GELBOORU_TRANSFER_FAILED;
+    }
+
+    // exists, failed or all formats checked
+    if (status == GELBOORU_TRANSFER_EXISTS) gelbooru_event(data->events, "exists", "\"hash\":\"%s\"", slot->transfer->post->hash);
+    if (status == GELBOORU_TRANSFER_FAILED) gelbooru_downloader_record_failure(data, slot->transfer);
+    gelbooru_downloader_slot_finish(slot, done_count);
+    return 0;
+}
+
+/*
+    Downloader thread func
+    Pops posts from queue and drives up to
+    download_transfers_per_thread transfers with curl multi
+*/
+void* gelbooru_downloader_thread_func(void *arg) {
+    gelbooru_thread_arg* args = (gelbooru_thread_arg*) arg;
+    if (args == NULL) {
+        printf("Gelbooru downloader thread: empty args\n");
+        return NULL;
+    }
+    int thread_id = args->thread_id;
+    gelbooru* gbooru = args->gbooru;
+    gelbooru_downloader_data* data = args->data;
+    if (gbooru == NULL || data == NULL) {
+        return NULL;
+    }
+
+    ProgressBar *bar = data->downloader_bars[thread_id];
+    char prefix[32], postfix[48];
+    sprintf(prefix, "%s %3d", "Downloader", thread_id);
+    ProgressBar_set_prefix_text(bar, prefix);
+
+    int slot_count = gbooru->download_transfers_per_thread;
+    gelbooru_download_slot *slots = (gelbooru_download_slot*) calloc(slot_count, sizeof(gelbooru_download_slot));
+    int *ready_slots = (int*) malloc(sizeof(int) * slot_count);
+    void **posts = (void**) malloc(sizeof(void*) * slot_count);
+    gelbooru_retry_heap *retries = gelbooru_retry_heap_create();
+    CURLM *multi = curl_multi_init();
+    if (slots == NULL || ready_slots == NULL || posts == NULL || retries == NULL || multi == NULL) {
+        printf("Gelbooru downloader thread: failed to init curl multi\n");
+        free(slots);
+        free(ready_slots);
+        free(posts);
+        gelbooru_retry_heap_destroy(retries);
+        if (multi != NULL) curl_multi_cleanup(multi);
+        return NULL;
+    }
+    for (int i = 0; i < slot_count; i++) {
+        slots[i].curl = gelbooru_curl_easy_create(gbooru);
+        if (slots[i].curl == NULL) {
+            slot_count = i;
+            break;
+        }
+    }
+
+    int active = 0, drained = 0, done_count = 0, running = 0;
+    unsigned int seed = (unsigned int) gelbooru_time_ms() ^ (thread_id * 2654435761u);
+    while (1) {
+        long long now = gelbooru_time_ms();
+        long long wait_ms = 0;
+
+        // slots waiting for image request token, free slots
+        int waiting = 0, ready_count = 0;
+        for (int i = 0; i < slot_count; i++) {
+            gelbooru_download_slot *slot = &slots[i];
+            if (slot->transfer == NULL) {
+                ready_slots[ready_count++] = i;
+                continue;
+            }
+            if (!slot->waiting) continue;
+
+            // limiter is empty, other slots wait too
+            if (wait_ms > 0) {
+                waiting++;
+                continue;
+            }
+            int added = gelbooru_downloader_slot_add(multi, slot, data, &wait_ms);
+            if (added > 0) active++;
+            else if (added == 0) waiting++;
+            else gelbooru_downloader_slot_finish(slot, &done_count);
+        }
+
+        // due retries go to free slots first
+        int retry_count = 0;
+        while (retry_count < ready_count) {
+            gelbooru_transfer *transfer = (gelbooru_transfer*) gelbooru_retry_heap_pop_ready(retries, now);
+            if (transfer == NULL) break;
+
+            gelbooru_download_slot *slot = &slots[ready_slots[retry_count++]];
+            slot->transfer = transfer;
+            active += gelbooru_downloader_slot_start(multi, slot, data, &wait_ms, &done_count);
+            waiting += slot->waiting;
+        }
+        ready_count -= retry_count;
+
+        // fill free slots with one queue lock
+        if (ready_count > 0 && !drained) {
+            int count;
+            if (active == 0 && waiting == 0 && retries->size == 0) {
+                count = tsq_pop_batch(data->download_queue, posts, ready_count); // nothing to drive, block
+                if (count == 0) drained = 1;
+            } else {
+                count = tsq_try_pop_batch(data->download_queue, posts, ready_count);
+                if (count < 0) drained = 1;
+            }
+
+            for (int i = 0; i < count; i++) {
+                gelbooru_download_slot *slot = &slots[ready_slots[retry_count + i]];
+                gelbooru_post *post = (gelbooru_post*) posts[i];
+                slot->transfer = gelbooru_transfer_create(gbooru, post->job, post, NULL);
+                if (slot->transfer == NULL) {
+                    gelbooru_hash_file_add(post->job->failed, post->hash, "other");
+                    gelbooru_event(data->events, "failed", "\"hash\":\"%s\",\"class\":\"other\",\"attempts\":0", post->hash);
+                    gelbooru_post_free(post);
+                    done_count++;
+                    continue;
+                }
+                active += gelbooru_downloader_slot_start(multi, slot, data, &wait_ms, &done_count);
+                waiting += slot->waiting;
+            }
+        }
+
+        if (active == 0) {
+            if (drained && waiting == 0 && retries->size == 0) break;
+
+            // sleep until token or retry, queue is checked at least every 100ms
+            long long sleep_ms = waiting > 0 ? wait_ms : 100;
+            long long next_retry = gelbooru_retry_heap_next_ms(retries);
+            if (next_retry >= 0 && next_retry - now < sleep_ms) sleep_ms = next_retry - now;
+            if (sleep_ms > 100) sleep_ms = 100;
+            if (sleep_ms > 0) usleep(sleep_ms * 1000);
+            continue;
+        }
+
+        // transfer
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int msgs_left;
+        while ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+
+            gelbooru_download_slot *slot = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &slot);
+            CURLcode res = msg->data.result;
+            curl_multi_remove_handle(multi, slot->curl);
+            active--;
+
+            long http_code = 0;
+            curl_easy_getinfo(slot->curl, CURLINFO_RESPONSE_CODE, &http_code);
+            gelbooru_rate_limiter_feedback(data->image_limiter, http_code);
+
+            int status = gelbooru_transfer_complete(slot->transfer, slot->curl, res);
+            if (status == GELBOORU_TRANSFER_DONE) {
+                gelbooru_transfer *transfer = slot->transfer;
+                gelbooru_event(data->events, "done", "\"hash\":\"%s\",\"format\":\"%s\",\"bytes\":%lld,\"ms\":%lld",
+                    transfer->post->hash, (char*) vector_index(transfer->job->formats, transfer->format_index),
+                    (long long) (transfer->resume_from + transfer->written), gelbooru_time_ms() - transfer->started_ms);
+                atomic_fetch_add_explicit(&data->images_downloaded, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&data->bytes_downloaded, transfer->written, memory_order_relaxed);
+
+                // slot is free, writer stage owns transfer
+                slot->transfer = NULL;
+                done_count++;
+                gelbooru_downloader_write(data, transfer);
+            } else if (status == GELBOORU_TRANSFER_RETRY) {
+                // slot is free until retry is due
+                gelbooru_transfer *transfer = slot->transfer;
+                long long delay = gelbooru_retry_delay_ms(transfer->error_class, transfer->attempts++, &seed);
+                if (delay >= 0 && gelbooru_retry_heap_push(retries, transfer, gelbooru_time_ms() + delay) == 0) {
+                    gelbooru_event(data->events, "retry", "\"hash\":\"%s\",\"class\":\"%s\",\"status\":%ld,\"delay_ms\":%lld",
+                        transfer->post->hash, gelbooru_error_class_name(transfer->error_class), http_code, delay);
+                    slot->transfer = NULL;
+                } else {
+                    gelbooru_downloader_record_failure(data, transfer);
+                    gelbooru_downloader_slot_finish(slot, &done_count);
+                }
+            } else {
+                active += gelbooru_downloader_slot_start(multi, slot, data, &wait_ms, &done_count);
+            }
+        }
+
+        // update bar with in-flight KB
+        curl_off_t dlnow = 0, dltotal = 0;
+        for (int i = 0; i < slot_count; i++) {
+            if (slots[i].transfer == NULL) continue;
+            dlnow += slots[i].transfer->dlnow;
+            dltotal += slots[i].transfer->dltotal;
+        }
+        ProgressBar_set_max_progress(bar, dltotal / 1024);
+        ProgressBar_set_progress(bar, dlnow / 1024);
+        sprintf(postfix, "%4d active %4d retry %7d done", active, retries->size, done_count);
+        ProgressBar_set_postfix_text(bar, postfix);
+
+        curl_multi_poll(multi, NULL, 0, wait_ms > 0 && wait_ms < 100 ? wait_ms : 100, NULL);
+    }
+
+    for (int i = 0; i < slot_count; i++) {
+        curl_easy_cleanup(slots[i].curl);
+    }
+    free(slots);
+    free(ready_slots);
+    free(posts);
+    gelbooru_retry_heap_destroy(retries);
+    curl_multi_cleanup(multi);
+    atomic_fetch_add_explicit(&data->posts_finished, done_count, memory_order_relaxed);
+
+    sprintf(postfix, "%-10s %7d done", "Finished", done_count);
+    ProgressBar_set_postfix_text(bar, postfix);
+    return NULL;
+}
+
+/* Print throughput and resource usage of run */
+void gelbooru_print_run_summary(gelbooru_downloader_data* data, FILE *fp) {
+    double seconds = (gelbooru_time_ms() - data->started_ms) / 1000.0;
+    if (seconds <= 0) seconds = 0.001;
+    long long images = atomic_load(&data->images_downloaded);
+    double megabytes = atomic_load(&data->bytes_downloaded) / (1024.0 * 1024.0);
+
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+    double user_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    double system_seconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+    fprintf(fp, "Downloaded %lld images, %.1f MB in %.1f s: %.1f images/s, %.2f MB/s\n",
+        images, megabytes, seconds, images / seconds, megabytes / seconds);
+    fprintf(fp, "CPU time: %.2f s user, %.2f s system, peak RSS: %.1f MB\n",
+        user_seconds, system_seconds, usage.ru_maxrss / 1024.0);
+
+    long long lost = atomic_load(&data->posts_queued) - atomic_load(&data->posts_finished);
+    if (lost != 0) fprintf(fp, "Warning: %lld queued posts were not finished\n", lost);
+}
+
+/*
+    Render progress frame into buffer: status line and bars
+    If rewind, cursor is moved back to first line for next frame
+    Returns length
+*/
+int gelbooru_progress_render(gelbooru_downloader_data* data, char *buffer, size_t size, int rewind) {
+    int length = snprintf(buffer, size, "Images in queue: %-7d duplicates skipped: %-7lld\n",
+        tsq_size(data->download_queue), gelbooru_downloader_duplicates(data));
+
+    length += ProgressBar_render(data->parser_bar, buffer + length, size - length);
+    buffer[length++] = '\n';
+    for (int i = 0; i < data->download_thread_count; i++) {
+        length += ProgressBar_render(data->downloader_bars[i], buffer + length, size - length);
+        buffer[length++] = '\n';
+    }
+    if (rewind) {
+        length += snprintf(buffer + length, size - length, "\033[%dA", data->download_thread_count + 2);
+    }
+    return length;
+}
+
+/* Write whole buffer to fd, returns 0 if OK */
+int gelbooru_write_all(int fd, const char *buffer, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, buffer, size);
+        if (written <= 0) return -1;
+        buffer += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/*
+    Progress thread func
+    Prints download progress, one write per frame
+    Frames are drawn every GELBOORU_PROGRESS_MIN_INTERVAL_MS while they change,
+    interval grows up to GELBOORU_PROGRESS_MAX_INTERVAL_MS while they do not (or output is not a terminal)
+    Headless mode draws nothing, only events are flushed
+*/
+void* gelbooru_progress_thread_func(void *arg) {
+    gelbooru_thread_arg* args = (gelbooru_thread_arg*) arg;
+    if (args == NULL) {
+        printf("Gelbooru parser thread: empty args\n");
+        return NULL;
+    }
+    gelbooru* gbooru = args->gbooru;
+    gelbooru_downloader_data* data = args->data;
+    if (gbooru == NULL || data == NULL) {
+        return NULL;
+    }
+
+    // status line, bars and cursor move
+    size_t frame_size = (data->download_thread_count + 2) * (PROGRESS_BAR_LINE_SIZE + 1) + 128;
+    char *frame = (char*) malloc(frame_size);
+    char *last_frame = (char*) malloc(frame_size);
+    if (frame == NULL || last_frame == NULL) {
+        printf("Failed to allocate mem for progress frame\n");
+        free(frame);
+        free(last_frame);
+        return NULL;
+    }
+    last_frame[0] = '\0';
+
+    fflush(stdout);
+    int tty = isatty(STDOUT_FILENO);
+    int interval_ms = tty ? GELBOORU_PROGRESS_MIN_INTERVAL_MS : GELBOORU_PROGRESS_MAX_INTERVAL_MS;
+    long long next_dump_ms = gelbooru_time_ms() + GELBOORU_METRICS_DUMP_INTERVAL_MS;
+    while (!atomic_load(&data->downloaders_finished)) {
+        gelbooru_event_log_flush(data->events);
+        if (gbooru->metrics_path != NULL && gelbooru_time_ms() >= next_dump_ms) {
+            gelbooru_metrics_dump(gbooru->metrics, gbooru->metrics_path);
+            next_dump_ms = gelbooru_time_ms() + GELBOORU_METRICS_DUMP_INTERVAL_MS;
+        }
+
+        if (gbooru->headless) {
+            interval_ms = GELBOORU_PROGRESS_MAX_INTERVAL_MS;
+        } else {
+            int length = gelbooru_progress_render(data, frame, frame_size, 1);
+            if (strcmp(frame, last_frame) != 0) {
+                gelbooru_write_all(STDOUT_FILENO, frame, length);
+                memcpy(last_frame, frame, length + 1);
+                if (tty) interval_ms = GELBOORU_PROGRESS_MIN_INTERVAL_MS;
+            } else if (interval_ms < GELBOORU_PROGRESS_MAX_INTERVAL_MS) {
+                interval_ms *= 2;
+            }
+        }
+
+        for (int slept = 0; slept < interval_ms && !atomic_load(&data->downloaders_finished); slept += GELBOORU_PROGRESS_MIN_INTERVAL_MS) {
+            usleep(GELBOORU_PROGRESS_MIN_INTERVAL_MS * 1000);
+        }
+    }
+
+    if (!gbooru->headless) {
+        int length = gelbooru_progress_render(data, frame, frame_size, 0);
+        gelbooru_write_all(STDOUT_FILENO, frame, length);
+    }
+    free(frame);
+    free(last_frame);
+
+    printf("Duplicates skipped: %lld\n", gelbooru_downloader_duplicates(data));
+    printf("Known missing skipped: %lld\n", data->missing_skipped);
+    if (data->pages_failed > 0) {
+        printf("Failed pages: %d\n", data->pages_failed);
+    }
+    for (int i = 0; i < vector_size(data->jobs); i++) {
+        gelbooru_job *job = vector_index(data->jobs, i);
+        if (job->parser_failed && job->max_page < 0) {
+            printf("Failed to list posts of %s\n", job->dir_path);
+        }
+        if (gelbooru_hash_file_added(job->missing) > 0) {
+            printf("Not found in any format: %lld, saved to %s\n", gelbooru_hash_file_added(job->missing), job->missing->path);
+        }
+        if (gelbooru_hash_file_added(job->failed) > 0) {
+            printf("Failed after retries: %lld, saved to %s\n", gelbooru_hash_file_added(job->failed), job->failed->path);
+        }
+    }
+
+    // request timings
+    gelbooru_metrics_print(gbooru->metrics, stdout);
+    gelbooru_print_run_summary(data, stdout);
+    if (gbooru->metrics_path != NULL && gelbooru_metrics_dump(gbooru->metrics, gbooru->metrics_path) != 0) {
+        printf("Failed to write metrics to %s\n", gbooru->metrics_path);
+    }
+    return NULL;
+}
+
+
+
+/*
+    Store posts queued by other jobs of format group for their own job after downloads
+    Image file of other job is hard linked, or copied if dirs are on different file systems
+    Post without stored file is recorded as missing of its job if other job found it missing,
+    else as failed, so sync point of job is not moved past it
+    Returns number of stored images
+*/
+int gelbooru_downloader_store_shared(gelbooru_downloader_data* data) {
+    int stored = 0;
+    for (int i = 0; i < vector_size(data->shared_posts); i++) {
+        gelbooru_post *post = vector_index(data->shared_posts, i);
+        gelbooru_job *job = post->job;
+        if (gelbooru_job_has_image(job, post->hash)) continue;
+
+        // file of other job with format of this job
+        char *from = NULL;
+        const char *format = NULL;
+        for (int j = 0; j < vector_size(data->jobs) && from == NULL; j++) {
+            gelbooru_job *other = vector_index(data->jobs, j);
+            if (other == job || other->format_group != job->format_group) continue;
+            for (int k = 0; k < vector_size(job->formats) && from == NULL; k++) {
+                format = vector_index(job->formats, k);
+                from = gelbooru_construct_download_path(other, post->hash, format);
+                if (from != NULL && !gelbooru_file_exists(from)) {
+                    free(from);
+                    from = NULL;
+                }
+            }
+        }
+        if (from == NULL) {
+            int missing = 0;
+            for (int j = 0; j < vector_size(data->jobs) && !missing; j++) {
+                gelbooru_job *other = vector_index(data->jobs, j);
+                missing = other != job && other->format_group == job->format_group && gelbooru_hash_file_contains(other->missing, post->hash);
+            }
+            if (missing) gelbooru_hash_file_add(job->missing, post->hash, NULL);
+            else gelbooru_hash_file_add(job->failed, post->hash, "shared");
+            continue;
+        }
+
+        int result = -1;
+        char *to = gelbooru_construct_download_path(job, post->hash, format);
+        if (to != NULL && job->layout == GELBOORU_LAYOUT_SHARDED) {
+            gelbooru_make_shard_dirs(job->shard_dirs, job->dir_path, post->hash);
+        }
+        struct stat st;
+        if (to != NULL && stat(from, &st) == 0 && (link(from, to) == 0 || gelbooru_copy_file(from, to) == 0)) {
+            gelbooru_index_add(job->index, post->hash, format, st.st_size);
+            result = 0;
+        }
+        free(to);
+        if (result == 0) {
+            stored++;
+            gelbooru_event(data->events, "shared", "\"job\":%d,\"hash\":\"%s\",\"format\":\"%s\"", job->id, post->hash, format);
+        } else {
+            printf("Failed to store %s for %s\n", post->hash, job->dir_path);
+            gelbooru_hash_file_add(job->failed, post->hash, "shared");
+        }
+        free(from);
+    }
+    return stored;
+}
+
+/* Posts listed again for same job in run */
+long long gelbooru_downloader_duplicates(gelbooru_downloader_data* data) {
+    long long duplicates = 0;
+    for (int i = 0; i < vector_size(data->jobs); i++) {
+        gelbooru_job *job = vector_index(data->jobs, i);
+        duplicates += gelbooru_hash_set_duplicates(job->listed);
+    }
+    return duplicates;
+}
+
+
+
+/*
+    Download all images with tags to output dir of gelbooru
+    multithreaded with progress
+*/
+void gelbooru_download(gelbooru* gbooru, vector* tags) {
+    // chech dir
+    if (gbooru->downloads_dir_path == NULL) {
+        printf("Output dir not set, set default dir\n");
+        gelbooru_set_downloads_dirpath(gbooru, GELBOORU_DEFAULT_DOWNLOAD_DIR_PATH);
+    }
+
+    vector *jobs = vector_create();
+    gelbooru_job *job = gelbooru_job_create(gbooru->downloads_dir_path);
+    if (jobs == NULL || job == NULL || vector_push_back(jobs, job) != 0) {
+        printf("Failed to create download job\n");
+        gelbooru_job_destroy(job);
+        vector_destroy(jobs);
+        return;
+    }
+    for (int i = 0; i < vector_size(tags); i++) {
+        if (gelbooru_job_add_tag(job, vector_index(tags, i)) != 0) {
+            printf("Failed to add tag %s\n", (char*) vector_index(tags, i));
+        }
+    }
+
+    gelbooru_download_jobs(gbooru, jobs);
+    gelbooru_job_list_free(jobs);
+}
+
+/* Close all jobs of run, destroy run data */
+void gelbooru_download_jobs_cleanup(gelbooru_downloader_data* data) {
+    for (int i = 0; i < vector_size(data->jobs); i++) {
+        gelbooru_job_close(vector_index(data->jobs, i));
+    }
+    gelbooru_downloader_data_destroy(data);
+}
+
+/*
+    Stop run that failed to start, parsers take no more pages, queues are closed
+    and started parser, downloader and writer threads are joined, so data can be cleaned up
+*/
+void gelbooru_download_jobs_abort(gelbooru_downloader_data* data) {
+    pthread_mutex_lock(&data->parser_mutex);
+    data->parser_failed = 1;
+    pthread_cond_broadcast(&data->parser_cond);
+    pthread_mutex_unlock(&data->parser_mutex);
+    for (int i = 0; i < data->parser_thread_count; i++) {
+        pthread_join(data->parser_threads[i], NULL);
+    }
+
+    tsq_close(data->download_queue);
+    for (int i = 0; i < data->download_thread_count; i++) {
+        pthread_join(data->downloader_threads[i], NULL);
+    }
+
+    if (data->write_queue != NULL) tsq_close(data->write_queue);
+    for (int i = 0; i < data->writer_thread_count; i++) {
+        pthread_join(data->writer_threads[i], NULL);
+    }
+}
+
+/*
+    Download all images of jobs multithreaded with progress
+    Pages of all jobs go through one parser pool and one downloader pool,
+    post queued by several jobs with same formats is downloaded once and stored for the other jobs after
+*/
+void gelbooru_download_jobs(gelbooru* gbooru, vector* jobs) {
+    gelbooru_downloader_data* data = gelbooru_downloader_data_create(gbooru);
+    if (data == NULL) {
+        printf("Failed to create downloader data\n");
+        return;
+    }
+    data->jobs = jobs;
+
+    // output dirs, failed job has no pages
+    int opened = 0;
+    for (int i = 0; i < vector_size(jobs); i++) {
+        gelbooru_job *job = vector_index(jobs, i);
+        job->id = i;
+        if (gelbooru_job_open(gbooru, job) == 0) opened++;
+
+        // packs are not shared, each job downloads own images
+        job->format_group = i;
+        for (int j = 0; j < i && job->format_group == i && gbooru->storage != GELBOORU_STORAGE_PACK; j++) {
+            gelbooru_job *other = vector_index(jobs, j);
+            int same = vector_size(other->formats) == vector_size(job->formats);
+            for (int k = 0; same && k < vector_size(job->formats); k++) {
+                same = strcmp(vector_index(other->formats, k), vector_index(job->formats, k)) == 0;
+            }
+            if (same) job->format_group = other->format_group;
+        }
+    }
+    if (opened == 0) {
+        printf("No job to download\n");
+        gelbooru_download_jobs_cleanup(data);
+        return;
+    }
+
+    // queued posts of each group with more than one job, without set jobs of group download their own
+    data->group_hashes = (gelbooru_hash_set**) calloc(vector_size(jobs), sizeof(gelbooru_hash_set*));
+    for (int i = 0; data->group_hashes != NULL && i < vector_size(jobs); i++) {
+        gelbooru_job *job = vector_index(jobs, i);
+        if (job->format_group != i && data->group_hashes[job->format_group] == NULL) {
+            data->group_hashes[job->format_group] = gelbooru_hash_set_create(0);
+        }
+    }
+    if (data->group_hashes == NULL) {
+        printf("Failed to create queued hashes sets\n");
+        gelbooru_download_jobs_cleanup(data);
+        return;
+    }
+
+    // events
+    data->events = gelbooru_event_log_create(gbooru->event_fd);
+    gelbooru_event(data->events, "run_start", "\"jobs\":%d,\"parsers\":%d,\"downloaders\":%d,\"transfers_per_downloader\":%d",
+        vector_size(jobs), data->parser_thread_count, data->download_thread_count, gbooru->download_transfers_per_thread);
+    data->started_ms = gelbooru_time_ms();
+
+
+    // parsers
+    for (int i = 0; i < data->parser_thread_count; i++) {
+        gelbooru_thread_arg* parser_arg = &data->parser_args[i];
+        parser_arg->thread_id = i;
+        parser_arg->gbooru = gbooru;
+        parser_arg->data = data;
+        if (pthread_create(&data->parser_threads[i], NULL, gelbooru_parser_thread_func, parser_arg) != 0) {
+            printf("Failed to create parser thread\n");
+            if (i == 0) {
+                gelbooru_download_jobs_cleanup(data);
+                return;
+            }
+            data->parser_thread_count = i; // continue with created parsers
+            break;
+        }
+    }
+
+    // writers, downloaders store images themselves if none started
+    for (int i = 0; i < data->writer_thread_count; i++) {
+        gelbooru_thread_arg* writer_arg = &data->writer_args[i];
+        writer_arg->thread_id = i;
+        writer_arg->gbooru = gbooru;
+        writer_arg->data = data;
+        if (pthread_create(&data->writer_threads[i], NULL, gelbooru_writer_thread_func, writer_arg) != 0) {
+            printf("Failed to create writer thread\n");
+            data->writer_thread_count = i;
+            break;
+        }
+    }
+    if (data->writer_thread_count == 0 && data->write_queue != NULL) {
+        tsq_destroy(data->write_queue);
+        data->write_queue = NULL;
+    }
+
+    // downloaders
+    for (int i = 0; i < data->download_thread_count; i++) {
+        gelbooru_thread_arg* downloader_arg = &data->downloader_args[i];
+        downloader_arg->thread_id = i;
+        downloader_arg->gbooru = gbooru;
+        downloader_arg->data = data;
+        if (pthread_create(&data->downloader_threads[i], NULL, gelbooru_downloader_thread_func, downloader_arg) != 0) {
+            printf("Failed to create downloader thread\n");
+            data->download_thread_count = i; // continue with created downloaders
+            break;
+        }
+    }
+    if (data->download_thread_count == 0) {
+        gelbooru_download_jobs_abort(data);
+        gelbooru_download_jobs_cleanup(data);
+        return;
+    }
+
+    // images removed by verify --requeue
+    for (int i = 0; i < vector_size(jobs); i++) {
+        gelbooru_job *job = vector_index(jobs, i);
+        if (job->parser_failed) continue;
+        int requeued = gelbooru_downloader_queue_requeued(data, job);
+        if (requeued > 0) printf("Requeued %d images of %s\n", requeued, job->dir_path);
+    }
+
+    // progress
+    gelbooru_thread_arg *progress_arg = data->progress_arg;
+    progress_arg->thread_id = 0;
+    progress_arg->gbooru = gbooru;
+    progress_arg->data = data;
+
+    if (pthread_create(data->progress_thread, NULL, gelbooru_progress_thread_func, progress_arg) != 0) {
+        printf("Failed to create progress thread\n");
+        gelbooru_download_jobs_abort(data);
+        gelbooru_download_jobs_cleanup(data);
+        return;
+    }
+
+
+
+    // parsers
+    for (int i = 0; i < data->parser_thread_count; i++) {
+        pthread_join(data->parser_threads[i], NULL);
+    }
+    tsq_close(data->download_queue);
+
+    // downloader
+    for (int i = 0; i < data->download_thread_count; i++) {
+        pthread_join(data->downloader_threads[i], NULL);
+    }
+
+    // writer
+    if (data->write_queue != NULL) tsq_close(data->write_queue);
+    for (int i = 0; i < data->writer_thread_count; i++) {
+        pthread_join(data->writer_threads[i], NULL);
+    }
+
+    // posts of several jobs, downloaded by one of them
+    int shared = gelbooru_downloader_store_shared(data);
+    atomic_store(&data->downloaders_finished, 1);
+
+    // progress
+    pthread_join(*(data->progress_thread), NULL);
+    if (shared > 0) printf("Stored %d images shared with other jobs\n", shared);
+
+    // sync points of complete jobs
+    for (int i = 0; i < vector_size(jobs); i++) {
+        gelbooru_job *job = vector_index(jobs, i);
+        int saved = gelbooru_job_save_sync(job);
+        if (saved > 0) {
+            printf("Sync %s in %s: newest post %lld\n", job->query, job->dir_path, job->max_id);
+            gelbooru_event(data->events, "sync", "\"job\":%d,\"from_id\":%lld,\"to_id\":%lld", job->id, job->sync_id, job->max_id);
+        } else if (saved < 0) {
+            printf("Failed to save sync point of %s\n", job->dir_path);
+        } else if (job->query != NULL && job->max_id > job->sync_id) {
+            int complete = !job->parser_failed && job->pages_failed == 0 && gelbooru_hash_file_added(job->failed) == 0;
+            printf("Sync %s in %s: %s, sync point is kept\n", job->query, job->dir_path,
+                complete ? "listing changed during run" : "incomplete run");
+        }
+    }
+
+    long long missing = 0, failed = 0;
+    for (int i = 0; i < vector_size(jobs); i++) {
+        gelbooru_job *job = vector_index(jobs, i);
+        missing += gelbooru_hash_file_added(job->missing);
+        failed += gelbooru_hash_file_added(job->failed);
+    }
+    gelbooru_event(data->events, "run_end", "\"ms\":%lld,\"duplicates\":%lld,\"shared\":%d,\"missing_skipped\":%lld,\"missing\":%lld,\"failed\":%lld,\"pages_failed\":%d",
+        gelbooru_time_ms() - data->started_ms, gelbooru_downloader_duplicates(data), shared, data->missing_skipped,
+        missing, failed, data->pages_failed);
+
+
+    gelbooru_download_jobs_cleanup(data);
+}
+
+
+
+
+/*
+    VECTOR
+*/
+vector* vector_create() {
+    vector* v = (vector*) malloc(sizeof(vector));
+    if (v == NULL) return NULL;
+
+    v->data = NULL;
+    v->size = 0;
+    v->capacity = 0;
+    return v;
+}
+
+void vector_destroy(vector* v) {
+    if (v != NULL) {
+        free(v->data);
+        free(v);
+    }
+}
+
+int vector_size(vector* v) {
+    if (v == NULL) return -1;
+    return v->size;
+}
+
+int vector_push_back(vector* v, void *item) {
+    if (v == NULL) return -1;
+
+    if (v->size == v->capacity) {
+        int new_cap = v->capacity == 0 ? 1 : v->capacity * 2;
+        void **new_data = (void**) realloc(v->data, new_cap * sizeof(void*));
+        if (new_data == NULL) return -1;
+
+        v->data = new_data;
+        v->capacity = new_cap;
+    }
+    v->data[v->size] = item;
+    v->size++;
+    return 0;
+}
+
+void* vector_pop_back(vector *v) {
+    if (v == NULL || v->size == 0) return NULL;
+    v->size--;
+    return v->data[v->size];
+}
+
+void* vector_index(vector* v, int index) {
+    if (v == NULL) return NULL;
+    return v->data[index];
+}
+
+
+
+
+
+/*
+    THREAD SAFE QUEUE
+    Bounded ring buffer, producers wait while queue is full
+*/
+
+ThreadSafeQueue* tsq_create() {
+    return tsq_create_bounded(TSQ_DEFAULT_CAPACITY);
+}
+
+ThreadSafeQueue* tsq_create_bounded(int capacity) {
+    ThreadSafeQueue *queue = (ThreadSafeQueue*) malloc(sizeof(ThreadSafeQueue));
+    if (queue == NULL) {
+        return NULL;
+    }
+    queue->capacity = capacity > 0 ? capacity : 1;
+    queue->items = (void**) malloc(sizeof(void*) * queue->capacity);
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->head = 0;
+    queue->size = 0;
+    queue->closed = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return queue;
+}
+
+void tsq_destroy(ThreadSafeQueue *queue) {
+    if (queue == NULL) return;
+
+    free(queue->items);
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue);
+}
+
+int tsq_size(ThreadSafeQueue *queue) {
+    if (queue == NULL) return 0;
+
+    int size;
+    pthread_mutex_lock(&queue->mutex);
+    size = queue->size;
+    pthread_mutex_unlock(&queue->mutex);
+    return size;
+}
+
+int tsq_closed(ThreadSafeQueue *queue) {
+    if (queue == NULL) return 1;
+
+    pthread_mutex_lock(&queue->mutex);
+    int closed = queue->closed;
+    pthread_mutex_unlock(&queue->mutex);
+
+    return closed;
+}
+
+void tsq_close(ThreadSafeQueue *queue) {
+    if (queue == NULL) return;
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+int tsq_push(ThreadSafeQueue *queue, void *data) {
+    return tsq_push_batch(queue, &data, 1) == 1 ? 0 : -1;
+}
+
+/*
+    Push items, waits while queue is full
+    Returns number of pushed items, less than count if queue was closed
+*/
+int tsq_push_batch(ThreadSafeQueue *queue, void **items, int count) {
+    if (queue == NULL || items == NULL) return -1;
+
+    int pushed = 0;
+    pthread_mutex_lock(&queue->mutex);
+    while (pushed < count) {
+        while (queue->size == queue->capacity && !queue->closed) {
+            pthread_cond_wait(&queue->not_full, &queue->mutex);
+        }
+        if (queue->closed) break;
+
+        int start = pushed;
+        while (pushed < count && queue->size < queue->capacity) {
+            queue->items[(queue->head + queue->size) % queue->capacity] = items[pushed++];
+            queue->size++;
+        }
+        if (pushed - start > 1) pthread_cond_broadcast(&queue->not_empty);
+        else pthread_cond_signal(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return pushed;
+}
+
+/* Take up to max_count items, queue mutex must be locked */
+int tsq_take_locked(ThreadSafeQueue *queue, void **items, int max_count) {
+    int count = 0;
+    while (count < max_count && queue->size > 0) {
+        items[count++] = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->size--;
+    }
+    if (count > 1) pthread_cond_broadcast(&queue->not_full);
+    else if (count == 1) pthread_cond_signal(&queue->not_full);
+    return count;
+}
+
+void* tsq_pop(ThreadSafeQueue *queue) {
+    void *data = NULL;
+    if (tsq_pop_batch(queue, &data, 1) != 1) return NULL;
+    return data;
+}
+
+/*
+    Pop up to max_count items, waits until queue has items
+    Returns number of popped items, 0 if queue is closed and empty
+*/
+int tsq_pop_batch(ThreadSafeQueue *queue, void **items, int max_count) {
+    if (queue == NULL || items == NULL) return 0;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->size == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    int count = tsq_take_locked(queue, items, max_count);
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+/*
+    Non blocking pop
+    Returns 0 if popped, 1 if queue is empty, -1 if queue is closed and empty
+*/
+int tsq_try_pop(ThreadSafeQueue *queue, void **data) {
+    if (data != NULL) *data = NULL;
+    int count = tsq_try_pop_batch(queue, data, 1);
+    return count > 0 ? 0 : (count == 0 ? 1 : -1);
+}
+
+/*
+    Non blocking pop of up to max_count items
+    Returns number of popped items, -1 if queue is closed and empty
+*/
+int tsq_try_pop_batch(ThreadSafeQueue *queue, void **items, int max_count) {
+    if (queue == NULL || items == NULL) return -1;
+
+    pthread_mutex_lock(&queue->mutex);
+    int count = tsq_take_locked(queue, items, max_count);
+    if (count == 0 && queue->closed) count = -1;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+
+
+
+
+/*
+    MD5
+    RFC 1321, 64 byte blocks, little endian words
+*/
+static const uint32_t gelbooru_md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+static const unsigned char gelbooru_md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+void gelbooru_md5_block(gelbooru_md5_ctx *ctx, const unsigned char *block) {
+    uint32_t w[16];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] | ((uint32_t) block[i * 4 + 1] << 8) |
+            ((uint32_t) block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16)      { f = (b & c) | (~b & d);  g = i; }
+        else if (i < 32) { f = (d & b) | (~d & c);  g = (5 * i + 1) & 15; }
+        else if (i < 48) { f = b ^ c ^ d;           g = (3 * i + 5) & 15; }
+        else             { f = c ^ (b | ~d);        g = (7 * i) & 15; }
+
+        uint32_t t = d;
+        d = c;
+        c = b;
+        uint32_t x = a + f + gelbooru_md5_k[i] + w[g];
+        b = b + ((x << gelbooru_md5_r[i]) | (x >> (32 - gelbooru_md5_r[i])));
+        a = t;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+}
+
+void gelbooru_md5_init(gelbooru_md5_ctx *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->length = 0;
+}
+
+void gelbooru_md5_update(gelbooru_md5_ctx *ctx, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char*) data;
+    size_t used = ctx->length % 64;
+    ctx->length += size;
+
+    // fill buffered block
+    if (used > 0) {
+        size_t take = 64 - used < size ? 64 - used : size;
+        memcpy(ctx->buffer + used, bytes, take);
+        bytes += take;
+        size -= take;
+        if (used + take < 64) return;
+        gelbooru_md5_block(ctx, ctx->buffer);
+    }
+
+    // whole blocks straight from data
+    while (size >= 64) {
+        gelbooru_md5_block(ctx, bytes);
+        bytes += 64;
+        size -= 64;
+    }
+    memcpy(ctx->buffer, bytes, size);
+}
+
+/* Pad and write 16 bytes digest, ctx must be inited again before reuse */
+void gelbooru_md5_final(gelbooru_md5_ctx *ctx, unsigned char *md5) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char padding[72] = { 0x80 };
+    size_t used = ctx->length % 64;
+    size_t pad = used < 56 ? 56 - used : 120 - used;
+    for (int i = 0; i < 8; i++) padding[pad + i] = (unsigned char) (bits >> (i * 8));
+    gelbooru_md5_update(ctx, padding, pad + 8);
+
+    for (int i = 0; i < 4; i++) {
+        md5[i * 4] = (unsigned char) ctx->state[i];
+        md5[i * 4 + 1] = (unsigned char) (ctx->state[i] >> 8);
+        md5[i * 4 + 2] = (unsigned char) (ctx->state[i] >> 16);
+        md5[i * 4 + 3] = (unsigned char) (ctx->state[i] >> 24);
+    }
+}
+
+/*
+    Hash first size bytes of file
+    Returns 0 if OK, -1 if file can't be read or is shorter
+*/
+int gelbooru_md5_update_file(gelbooru_md5_ctx *ctx, const char *path, long long size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    unsigned char buffer[64 * 1024];
+    while (size > 0) {
+        ssize_t count = read(fd, buffer, size < (long long) sizeof(buffer) ? (size_t) size : sizeof(buffer));
+        if (count <= 0) break;
+        gelbooru_md5_update(ctx, buffer, count);
+        size -= count;
+    }
+    close(fd);
+    return size == 0 ? 0 : -1;
+}
+
+
+
+
+/*
+    HASH SET
+    Open addressing (linear probing) set of 128-bit MD5 hashes
+*/
+
+/*
+    Convert 32 hex chars MD5 to 16 bytes
+    Returns 0 if OK, -1 if not a MD5 hex string
+*/
+int gelbooru_md5_from_hex(const char *hex, unsigned char *md5) {
+    if (hex == NULL || md5 == NULL) return -1;
+
+    for (int i = 0; i < 32; i++) {
+        char c = hex[i];
+        int value;
+        if (c >= '0' && c <= '9') value = c - '0';
+        else if (c >= 'a' && c <= 'f') value = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value = c - 'A' + 10;
+        else return -1;
+
+        if (i % 2 == 0) md5[i / 2] = value << 4;
+        else md5[i / 2] |= value;
+    }
+    return hex[32] == '\0' ? 0 : -1;
+}
+
+gelbooru_hash_set* gelbooru_hash_set_create(size_t capacity) {
+    gelbooru_hash_set *set = (gelbooru_hash_set*) malloc(sizeof(gelbooru_hash_set));
+    if (set == NULL) return NULL;
+
+    set->capacity = 1024;
+    while (set->capacity < capacity) set->capacity *= 2;
+    set->keys = (uint64_t*) calloc(set->capacity * 2, sizeof(uint64_t));
+    if (set->keys == NULL) {
+        free(set);
+        return NULL;
+    }
+    set->size = 0;
+    set->has_zero = 0;
+    set->duplicates = 0;
+    pthread_mutex_init(&set->mutex, NULL);
+    return set;
+}
+
+void gelbooru_hash_set_destroy(gelbooru_hash_set *set) {
+    if (set != NULL) {
+        free(set->keys);
+        pthread_mutex_destroy(&set->mutex);
+        free(set);
+    }
+}
+
+/*
+    Find slot of key or empty slot where key should be
+    All-zero key marks empty slot, so it is stored as has_zero flag
+*/
+size_t gelbooru_hash_set_find_locked(uint64_t *keys, size_t capacity, uint64_t lo, uint64_t hi) {
+    size_t mask = capacity - 1;
+    size_t index = (size_t) (lo ^ (hi >> 32)) & mask; // MD5 bits are uniform
+    while (1) {
+        uint64_t *slot = &keys[index * 2];
+        if ((slot[0] == lo && slot[1] == hi) || (slot[0] == 0 && slot[1] == 0)) return index;
+        index = (index + 1) & mask;
+    }
+}
+
+/* Double capacity, set mutex must be locked */
+int gelbooru_hash_set_grow_locked(gelbooru_hash_set *set) {
+    size_t new_capacity = set->capacity * 2;
+    uint64_t *new_keys = (uint64_t*) calloc(new_capacity * 2, sizeof(uint64_t));
+    if (new_keys == NULL) return -1;
+
+    for (size_t i = 0; i < set->capacity; i++) {
+        uint64_t lo = set->keys[i * 2], hi = set->keys[i * 2 + 1];
+        if (lo == 0 && hi == 0) continue;
+        size_t index = gelbooru_hash_set_find_locked(new_keys, new_capacity, lo, hi);
+        new_keys[index * 2] = lo;
+        new_keys[index * 2 + 1] = hi;
+    }
+    free(set->keys);
+    set->keys = new_keys;
+    set->capacity = new_capacity;
+    return 0;
+}
+
+/*
+    Insert 16 bytes MD5
+    Returns 1 if inserted, 0 if already in set (counted as duplicate), -1 on error
+*/
+int gelbooru_hash_set_insert(gelbooru_hash_set *set, const unsigned char *md5) {
+    if (set == NULL || md5 == NULL) return -1;
+
+    uint64_t lo, hi;
+    memcpy(&lo, md5, 8);
+    memcpy(&hi, md5 + 8, 8);
+
+    int inserted = 0;
+    pthread_mutex_lock(&set->mutex);
+    if (lo == 0 && hi == 0) {
+        inserted = !set->has_zero;
+        set->has_zero = 1;
+    } else {
+        // max load 0.7
+        if ((set->size + 1) * 10 > set->capacity * 7 && gelbooru_hash_set_grow_locked(set) != 0) {
+            pthread_mutex_unlock(&set->mutex);
+            return -1;
+        }
+        size_t index = gelbooru_hash_set_find_locked(set->keys, set->capacity, lo, hi);
+        uint64_t *slot = &set->keys[index * 2];
+        if (slot[0] == 0 && slot[1] == 0) {
+            slot[0] = lo;
+            slot[1] = hi;
+            inserted = 1;
+        }
+    }
+    if (inserted) set->size++;
+    else set->duplicates++;
+    pthread_mutex_unlock(&set->mutex);
+    return inserted;
+}
+
+/* Returns 1 if 16 bytes MD5 is in set */
+int gelbooru_hash_set_contains(gelbooru_hash_set *set, const unsigned char *md5) {
+    if (set == NULL || md5 == NULL) return 0;
+
+    uint64_t lo, hi;
+    memcpy(&lo, md5, 8);
+    memcpy(&hi, md5 + 8, 8);
+
+    int found;
+    pthread_mutex_lock(&set->mutex);
+    if (lo == 0 && hi == 0) {
+        found = set->has_zero;
+    } else {
+        size_t index = gelbooru_hash_set_find_locked(set->keys, set->capacity, lo, hi);
+        found = set->keys[index * 2] != 0 || set->keys[index * 2 + 1] != 0;
+    }
+    pthread_mutex_unlock(&set->mutex);
+    return found;
+}
+
+/*
+    Insert MD5 hex string
+    Returns 1 if inserted, 0 if already in set, -1 if not a MD5 or error
+*/
+int gelbooru_hash_set_insert_hex(gelbooru_hash_set *set, const char *hash) {
+    unsigned char md5[16];
+    if (gelbooru_md5_from_hex(hash, md5) != 0) return -1;
+    return gelbooru_hash_set_insert(set, md5);
+}
+
+/* Number of hashes in set */
+size_t gelbooru_hash_set_size(gelbooru_hash_set *set) {
+    if (set == NULL) return 0;
+
+    pthread_mutex_lock(&set->mutex);
+    size_t size = set->size;
+    pthread_mutex_unlock(&set->mutex);
+    return size;
+}
+
+/* Number of rejected duplicate inserts */
+long long gelbooru_hash_set_duplicates(gelbooru_hash_set *set) {
+    if (set == NULL) return 0;
+
+    pthread_mutex_lock(&set->mutex);
+    long long duplicates = set->duplicates;
+    pthread_mutex_unlock(&set->mutex);
+    return duplicates;
+}
+
+
+
+
+
+/*
+    INDEX
+    Append-only file of completed downloads in downloads dir
+*/
+
+/*
+    Open index of dir, loads existing records with mmap
+    Missing index is built by scan of dir first, so index file only exists once it is complete,
+    then images not in index are not searched on disk
+*/
+gelbooru_index* gelbooru_index_open(const char *dir_path) {
+    if (dir_path == NULL) return NULL;
+
+    gelbooru_index *index = (gelbooru_index*) malloc(sizeof(gelbooru_index));
+    if (index == NULL) {
+        printf("Failed to allocate mem for index\n");
+        return NULL;
+    }
+    index->fd = -1;
+    index->path = (char*) malloc(strlen(dir_path) + strlen(GELBOORU_INDEX_FILE_NAME) + 2);
+    index->hashes = gelbooru_hash_set_create(0);
+    pthread_mutex_init(&index->mutex, NULL);
+    if (index->path == NULL || index->hashes == NULL) {
+        printf("Failed to create index\n");
+        gelbooru_index_close(index);
+        return NULL;
+    }
+    sprintf(index->path, "%s/%s", dir_path, GELBOORU_INDEX_FILE_NAME);
+
+    struct stat st;
+    if (stat(index->path, &st) != 0 || st.st_size < GELBOORU_INDEX_HEADER_SIZE) {
+        printf("Indexing images of %s\n", dir_path);
+        if (gelbooru_index_rebuild(dir_path) < 0) {
+            gelbooru_index_close(index);
+            return NULL;
+        }
+    }
+
+    index->fd = open(index->path, O_RDWR | O_APPEND);
+    if (index->fd < 0) {
+        printf("Failed to open index %s\n", index->path);
+        gelbooru_index_close(index);
+        return NULL;
+    }
+
+    if (fstat(index->fd, &st) != 0 || st.st_size < GELBOORU_INDEX_HEADER_SIZE) {
+        printf("Index %s is truncated, run rebuild-index\n", index->path);
+        gelbooru_index_close(index);
+        return NULL;
+    }
+
+    // load records, partial record at end (interrupted append) is ignored
+    char *map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, index->fd, 0);
+    if (map == MAP_FAILED) {
+        printf("Failed to mmap index\n");
+        gelbooru_index_close(index);
+        return NULL;
+    }
+    if (memcmp(map, GELBOORU_INDEX_MAGIC, strlen(GELBOORU_INDEX_MAGIC)) != 0) {
+        printf("Index %s has unknown format, run rebuild-index\n", index->path);
+        munmap(map, st.st_size);
+        gelbooru_index_close(index);
+        return NULL;
+    }
+
+    size_t count = (st.st_size - GELBOORU_INDEX_HEADER_SIZE) / sizeof(gelbooru_index_record);
+    const gelbooru_index_record *records = (const gelbooru_index_record*) (map + GELBOORU_INDEX_HEADER_SIZE);
+    for (size_t i = 0; i < count; i++) {
+        gelbooru_hash_set_insert(index->hashes, records[i].md5);
+    }
+    munmap(map, st.st_size);
+
+    // next appends start at record boundary
+    off_t valid_size = GELBOORU_INDEX_HEADER_SIZE + count * sizeof(gelbooru_index_record);
+    if (valid_size != st.st_size && ftruncate(index->fd, valid_size) != 0) {
+        printf("Failed to truncate index\n");
+    }
+    return index;
+}
+
+/* Close index */
+void gelbooru_index_close(gelbooru_index *index) {
+    if (index != NULL) {
+        if (index->fd >= 0) close(index->fd);
+        gelbooru_hash_set_destroy(index->hashes);
+        pthread_mutex_destroy(&index->mutex);
+        free(index->path);
+        free(index);
+    }
+}
+
+/* Returns 1 if image with MD5 hex hash is downloaded */
+int gelbooru_index_contains(gelbooru_index *index, const char *hash) {
+    if (index == NULL) return 0;
+
+    unsigned char md5[16];
+    if (gelbooru_md5_from_hex(hash, md5) != 0) return 0;
+    return gelbooru_hash_set_contains(index->hashes, md5);
+}
+
+/* Fill record, format is NUL terminated so longer formats are rejected, returns 0 if OK */
+int gelbooru_index_record_init(gelbooru_index_record *record, const char *hash, const char *format, uint64_t size) {
+    memset(record, 0, sizeof(gelbooru_index_record));
+    if (gelbooru_md5_from_hex(hash, record->md5) != 0) return -1;
+    if (format != NULL) {
+        size_t length = strlen(format);
+        if (length >= sizeof(record->format)) return -1;
+        memcpy(record->format, format, length);
+    }
+    record->size = size;
+    return 0;
+}
+
+/*
+    Append downloaded image to index
+    Returns 0 if OK
+*/
+int gelbooru_index_add(gelbooru_index *index, const char *hash, const char *format, uint64_t size) {
+    if (index == NULL) return -1;
+
+    gelbooru_index_record record;
+    if (gelbooru_index_record_init(&record, hash, format, size) != 0) return -1;
+
+    pthread_mutex_lock(&index->mutex);
+    if (gelbooru_hash_set_insert(index->hashes, record.md5) != 1) {
+        pthread_mutex_unlock(&index->mutex);
+        return 0;
+    }
+    ssize_t written = write(index->fd, &record, sizeof(record));
+    pthread_mutex_unlock(&index->mutex);
+    return written == sizeof(record) ? 0 : -1;
+}
+
+/*
+    Split file name "hash.ext" to MD5 hex hash and format
+    Returns 0 if name is image name
+*/
+int gelbooru_split_image_name(const char *name, char *hash, char *format, size_t format_size) {
+    const char *dot = strchr(name, '.');
+    if (dot == NULL || dot - name != 32) return -1;
+    if (strlen(dot + 1) == 0 || strlen(dot + 1) >= format_size || strchr(dot + 1, '.') != NULL) return -1;
+
+    memcpy(hash, name, 32);
+    hash[32] = '\0';
+    unsigned char md5[16];
+    if (gelbooru_md5_from_hex(hash, md5) != 0) return -1;
+
+    strcpy(format, dot + 1);
+    return 0;
+}
+
+/*
+    Recreate index of dir from files in dir
+    Returns number of indexed images or -1
+*/
+int gelbooru_index_rebuild(const char *dir_path) {
+    if (dir_path == NULL) return -1;
+
+    vector *names = vector_create();
+    if (names == NULL || gelbooru_list_images(dir_path, names) < 0) {
+        printf("Failed to open dir %s\n", dir_path);
+        vector_destroy(names);
+        return -1;
+    }
+
+    size_t path_size = strlen(dir_path) + strlen(GELBOORU_INDEX_FILE_NAME) + 16;
+    char *index_path = (char*) malloc(path_size);
+    char *tmp_path = (char*) malloc(path_size);
+    if (index_path == NULL || tmp_path == NULL) {
+        free(index_path);
+        free(tmp_path);
+        for (int i = 0; i < vector_size(names); i++) free(vector_index(names, i));
+        vector_destroy(names);
+        return -1;
+    }
+    sprintf(index_path, "%s/%s", dir_path, GELBOORU_INDEX_FILE_NAME);
+    sprintf(tmp_path, "%s.tmp", index_path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        printf("Failed to create %s\n", tmp_path);
+        free(index_path);
+        free(tmp_path);
+        for (int i = 0; i < vector_size(names); i++) free(vector_index(names, i));
+        vector_destroy(names);
+        return -1;
+    }
+
+    char header[GELBOORU_INDEX_HEADER_SIZE] = {0};
+    memcpy(header, GELBOORU_INDEX_MAGIC, strlen(GELBOORU_INDEX_MAGIC));
+    fwrite(header, sizeof(header), 1, fp);
+
+    int count = 0;
+    for (int i = 0; i < vector_size(names); i++) {
+        char hash[33], format[8];
+        char *path = gelbooru_construct_listed_image_path(dir_path, vector_index(names, i), hash, format, sizeof(format));
+        if (path == NULL) continue;
+        struct stat st;
+        int is_file = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+        free(path);
+        if (!is_file) continue;
+
+        gelbooru_index_record record;
+        if (gelbooru_index_record_init(&record, hash, format, st.st_size) != 0) continue;
+        if (fwrite(&record, sizeof(record), 1, fp) == 1) count++;
+    }
+    for (int i = 0; i < vector_size(names); i++) free(vector_index(names, i));
+    vector_destroy(names);
+
+    int failed = fclose(fp) != 0 || rename(tmp_path, index_path) != 0;
+    if (failed) {
+        printf("Failed to write %s\n", index_path);
+        remove(tmp_path);
+    }
+    free(index_path);
+    free(tmp_path);
+    return failed ? -1 : count;
+}
+
+/* Order index records by MD5 */
+int gelbooru_index_record_compare(const void *a, const void *b) {
+    return memcmp(((const gelbooru_index_record*) a)->md5, ((const gelbooru_index_record*) b)->md5, 16);
+}
+
+/*
+    Read index records of dir sorted by MD5 for bsearch
+    Returns NULL if dir has no index or it has unknown format
 */
-int gelbooru_image_write_progress_curl_callback(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
-    ProgressBar *bar = (ProgressBar*) p;
-    if (dltotal > 0) {
-        ProgressBar_set_max_progress(bar, dltotal);
-        ProgressBar_set_progress(bar, dlnow);
+gelbooru_index_record* gelbooru_index_read_records(const char *dir_path, size_t *count) {
+    *count = 0;
+    char *path = (char*) malloc(strlen(dir_path) + strlen(GELBOORU_INDEX_FILE_NAME) + 2);
+    if (path == NULL) return NULL;
+    sprintf(path, "%s/%s", dir_path, GELBOORU_INDEX_FILE_NAME);
+    FILE *fp = fopen(path, "rb");
+    free(path);
+    if (fp == NULL) return NULL;
+
+    char header[GELBOORU_INDEX_HEADER_SIZE];
+    struct stat st;
+    if (fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, GELBOORU_INDEX_MAGIC, strlen(GELBOORU_INDEX_MAGIC)) != 0
+        || fstat(fileno(fp), &st) != 0) {
+        fclose(fp);
+        return NULL;
+    }
 
-        double dnowMB = (double) dlnow / (1024*1024);
-        double dtotalMB = (double) dltotal / (1024*1024);
-        char postfix[32];
-        sprintf(postfix, "%4.1f / %4.1f %s", dnowMB, dtotalMB, "MB");
-        ProgressBar_set_postfix_text(bar, postfix);
+    size_t capacity = (st.st_size - GELBOORU_INDEX_HEADER_SIZE) / sizeof(gelbooru_index_record);
+    gelbooru_index_record *records = (gelbooru_index_record*) malloc((capacity > 0 ? capacity : 1) * sizeof(gelbooru_index_record));
+    if (records == NULL) {
+        printf("Failed to allocate mem for index records\n");
+        fclose(fp);
+        return NULL;
     }
+    *count = fread(records, sizeof(gelbooru_index_record), capacity, fp);
+    fclose(fp);
 
-    return 0;
+    qsort(records, *count, sizeof(gelbooru_index_record), gelbooru_index_record_compare);
+    return records;
 }
 
 
+
+
+
 /*
-    Download image with hash
-    Check added formats
-    Return 0 if OK
+    RATE LIMITER
 */
-int gelbooru_download_image(gelbooru* gbooru, const char * hash, ProgressBar *bar) {
-    CURL *curl;
-    CURLcode res;
-    curl = curl_easy_init();
-    if (curl == NULL) {
-        printf("Failed to init curl\n");
-        return -1;
+
+/*
+    Create limiter for rate requests per second, rate <= 0 is unlimited
+    Bucket holds up to one second of requests
+*/
+gelbooru_rate_limiter* gelbooru_rate_limiter_create(double rate) {
+    gelbooru_rate_limiter *limiter = (gelbooru_rate_limiter*) malloc(sizeof(gelbooru_rate_limiter));
+    if (limiter == NULL) {
+        printf("Failed to allocate mem for rate limiter\n");
+        return NULL;
     }
+    limiter->max_rate = rate > 0 ? rate : 0;
+    limiter->min_rate = limiter->max_rate / GELBOORU_RATE_MIN_DIVISOR;
+    limiter->rate = limiter->max_rate;
+    limiter->tokens = 1;
+    limiter->last_ms = gelbooru_time_ms();
+    limiter->backoff_ms = 0;
+    limiter->throttled = 0;
+    pthread_mutex_init(&limiter->mutex, NULL);
+    return limiter;
+}
 
-    int success = -1;
-    char prefix[128], postfix[32], *url, *output_path;
-    FILE *fp;
-    for (int i = 0; i < vector_size(gbooru->img_formats); i++) { // check all added formats
-        // construct url
-        url = gelbooru_construct_image_url(hash, vector_index(gbooru->img_formats, i));
-        if (url == NULL) continue;
-
-        // construct output path
-        output_path = gelbooru_construct_image_output_path(
-            gbooru->downloads_dir_path != NULL ? gbooru->downloads_dir_path : GELBOORU_DEFAULT_DOWNLOAD_DIR_PATH, 
-            hash, 
-            vector_index(gbooru->img_formats, i)
-        );
-        if (output_path == NULL) {
-            free(url);
-            break;
-        }
+/* Destroy limiter */
+void gelbooru_rate_limiter_destroy(gelbooru_rate_limiter *limiter) {
+    if (limiter != NULL) {
+        pthread_mutex_destroy(&limiter->mutex);
+        free(limiter);
+    }
+}
 
-        // update bar
-        sprintf(prefix, "%-32s.%-5s", hash, vector_index(gbooru->img_formats, i));
-        ProgressBar_set_prefix_text(bar, prefix);
+/* Add tokens for time since last refill */
+void gelbooru_rate_limiter_refill_locked(gelbooru_rate_limiter *limiter, long long now) {
+    double burst = limiter->rate > 1 ? limiter->rate : 1;
+    limiter->tokens += (now - limiter->last_ms) * limiter->rate / 1000;
+    if (limiter->tokens > burst) limiter->tokens = burst;
+    limiter->last_ms = now;
+}
 
-        // if exists
-        if (gelbooru_file_exists(output_path)) {
-            success = 0;
-            free(url);
-            free(output_path);
-            sprintf(postfix, "%-20s", "Exists");
-            ProgressBar_set_postfix_text(bar, postfix);
-            break;
-        }
+/*
+    Take one token if available
+    Returns 0 if taken, else ms until next token
+*/
+long long gelbooru_rate_limiter_try_take(gelbooru_rate_limiter *limiter) {
+    if (limiter == NULL || limiter->max_rate <= 0) return 0;
 
-        // open
-        fp = fopen(output_path, "wb");
-        if (!fp) {
-            free(url);
-            free(output_path);
-            sprintf(postfix, "%-20s", "Failed to open");
-            ProgressBar_set_postfix_text(bar, postfix);
-            break;
+    pthread_mutex_lock(&limiter->mutex);
+    gelbooru_rate_limiter_refill_locked(limiter, gelbooru_time_ms());
+
+    long long wait_ms = 0;
+    if (limiter->tokens >= 1) {
+        limiter->tokens -= 1;
+    } else {
+        wait_ms = (long long) ((1 - limiter->tokens) * 1000 / limiter->rate) + 1;
+    }
+    pthread_mutex_unlock(&limiter->mutex);
+    return wait_ms;
+}
+
+/* Wait until token is taken */
+void gelbooru_rate_limiter_wait(gelbooru_rate_limiter *limiter) {
+    long long wait_ms;
+    while ((wait_ms = gelbooru_rate_limiter_try_take(limiter)) > 0) {
+        usleep(wait_ms * 1000);
+    }
+}
+
+/*
+    Adapt rate to response (AIMD)
+    429 and 503 halve rate (once per backoff window), other responses add max_rate / GELBOORU_RATE_INCREASE_STEPS
+    Returns 1 if response is throttled
+*/
+int gelbooru_rate_limiter_feedback(gelbooru_rate_limiter *limiter, long http_code) {
+    int throttled = http_code == 429 || http_code == 503;
+    if (limiter == NULL || limiter->max_rate <= 0 || http_code == 0) return throttled;
+
+    pthread_mutex_lock(&limiter->mutex);
+    long long now = gelbooru_time_ms();
+    gelbooru_rate_limiter_refill_locked(limiter, now);
+    if (throttled) {
+        limiter->throttled++;
+        // responses of requests sent before backoff do not count again
+        if (now >= limiter->backoff_ms) {
+            limiter->rate /= 2;
+            if (limiter->rate < limiter->min_rate) limiter->rate = limiter->min_rate;
+            limiter->tokens = 0;
+            double window_ms = 1000 / limiter->rate;
+            limiter->backoff_ms = now + (long long) (window_ms > 1000 ? window_ms : 1000);
         }
+    } else if (limiter->rate < limiter->max_rate) {
+        limiter->rate += limiter->max_rate / GELBOORU_RATE_INCREASE_STEPS;
+        if (limiter->rate > limiter->max_rate) limiter->rate = limiter->max_rate;
+    }
+    pthread_mutex_unlock(&limiter->mutex);
+    return throttled;
+}
 
-        // curl
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, gelbooru_image_write_curl_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) fp);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, gbooru->user_agent != NULL ? gbooru->user_agent : GELBOORU_DEFAULT_USER_AGENT);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+/* Current rate, requests per second */
+double gelbooru_rate_limiter_rate(gelbooru_rate_limiter *limiter) {
+    if (limiter == NULL) return 0;
 
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, gelbooru_image_write_progress_curl_callback);
-        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, bar);
+    pthread_mutex_lock(&limiter->mutex);
+    double rate = limiter->rate;
+    pthread_mutex_unlock(&limiter->mutex);
+    return rate;
+}
 
-        res = curl_easy_perform(curl);
-        long http_code = 0;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-        
-        // close
-        fclose(fp);
-        if (res == CURLE_OK && http_code == 200) {
-            success = 0;
-            free(url);
-            free(output_path);
+
+
+
+
+/*
+    RETRY
+*/
+
+/* Class of failed request */
+int gelbooru_error_class(CURLcode res, long http_code) {
+    switch (res) {
+        case CURLE_OK:
             break;
-        } else {
-            // remove if failed
-            remove(output_path);
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_RESOLVE_PROXY:
+            return GELBOORU_ERROR_DNS;
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+            return GELBOORU_ERROR_NETWORK;
+        case CURLE_RANGE_ERROR:
+            // error status to resumed request has no range, classified by status
+            if (http_code >= 400) break;
+            return GELBOORU_ERROR_OTHER;
+        default:
+            return GELBOORU_ERROR_OTHER;
+    }
+
+    if (http_code == 200 || http_code == 206) return GELBOORU_ERROR_NONE;
+    if (http_code == 404 || http_code == 410) return GELBOORU_ERROR_NOT_FOUND;
+    if (http_code == 429 || http_code >= 500) return GELBOORU_ERROR_SERVER;
+    return GELBOORU_ERROR_OTHER;
+}
+
+/* Error class name for logs */
+const char* gelbooru_error_class_name(int error_class) {
+    switch (error_class) {
+        case GELBOORU_ERROR_NONE:       return "none";
+        case GELBOORU_ERROR_DNS:        return "dns";
+        case GELBOORU_ERROR_NETWORK:    return "network";
+        case GELBOORU_ERROR_SERVER:     return "server";
+        case GELBOORU_ERROR_NOT_FOUND:  return "not-found";
+        case GELBOORU_ERROR_CORRUPT:    return "corrupt";
+        default:                        return "other";
+    }
+}
+
+/* Retries of error class, not found and other errors are not retried */
+int gelbooru_retry_max_attempts(int error_class) {
+    switch (error_class) {
+        case GELBOORU_ERROR_DNS:        return 3;
+        case GELBOORU_ERROR_NETWORK:    return 5;
+        case GELBOORU_ERROR_SERVER:     return 6;
+        case GELBOORU_ERROR_CORRUPT:    return 3;
+        default:                        return 0;
+    }
+}
+
+/*
+    Delay before retry attempt (0 based) of error class
+    Exponential from GELBOORU_RETRY_BASE_MS up to GELBOORU_RETRY_MAX_MS, jittered to 50-100%
+    Returns -1 if no attempts left
+*/
+long long gelbooru_retry_delay_ms(int error_class, int attempt, unsigned int *seed) {
+    if (attempt >= gelbooru_retry_max_attempts(error_class)) return -1;
+
+    long long delay = GELBOORU_RETRY_BASE_MS;
+    if (error_class == GELBOORU_ERROR_DNS) delay *= 4; // resolver failures clear slowly
+    for (int i = 0; i < attempt && delay < GELBOORU_RETRY_MAX_MS; i++) delay *= 2;
+    if (delay > GELBOORU_RETRY_MAX_MS) delay = GELBOORU_RETRY_MAX_MS;
+
+    return delay / 2 + rand_r(seed) % (delay / 2 + 1);
+}
+
+/* Create empty retry heap */
+gelbooru_retry_heap* gelbooru_retry_heap_create(void) {
+    gelbooru_retry_heap *heap = (gelbooru_retry_heap*) malloc(sizeof(gelbooru_retry_heap));
+    if (heap == NULL) {
+        printf("Failed to allocate mem for retry heap\n");
+        return NULL;
+    }
+    heap->items = NULL;
+    heap->size = 0;
+    heap->capacity = 0;
+    return heap;
+}
+
+/* Destroy heap, items are not freed */
+void gelbooru_retry_heap_destroy(gelbooru_retry_heap *heap) {
+    if (heap != NULL) {
+        free(heap->items);
+        free(heap);
+    }
+}
+
+/*
+    Push item ready at ready_at_ms
+    Returns 0 if OK
+*/
+int gelbooru_retry_heap_push(gelbooru_retry_heap *heap, void *item, long long ready_at_ms) {
+    if (heap == NULL) return -1;
+
+    if (heap->size == heap->capacity) {
+        int new_capacity = heap->capacity > 0 ? heap->capacity * 2 : 16;
+        gelbooru_retry_item *new_items = (gelbooru_retry_item*) realloc(heap->items, sizeof(gelbooru_retry_item) * new_capacity);
+        if (new_items == NULL) {
+            printf("Failed to grow retry heap\n");
+            return -1;
         }
+        heap->items = new_items;
+        heap->capacity = new_capacity;
+    }
 
-        // cleanup
-        free(url);
-        free(output_path);
+    // sift up
+    int i = heap->size++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap->items[parent].ready_at_ms <= ready_at_ms) break;
+        heap->items[i] = heap->items[parent];
+        i = parent;
     }
+    heap->items[i].ready_at_ms = ready_at_ms;
+    heap->items[i].item = item;
+    return 0;
+}
 
-    curl_easy_cleanup(curl);
-    return success;
+/* Time of earliest item or -1 if heap is empty */
+long long gelbooru_retry_heap_next_ms(gelbooru_retry_heap *heap) {
+    if (heap == NULL || heap->size == 0) return -1;
+    return heap->items[0].ready_at_ms;
 }
 
+/* Pop earliest item if it is ready at now, else NULL */
+void* gelbooru_retry_heap_pop_ready(gelbooru_retry_heap *heap, long long now) {
+    if (heap == NULL || heap->size == 0 || heap->items[0].ready_at_ms > now) return NULL;
+
+    void *item = heap->items[0].item;
+    gelbooru_retry_item last = heap->items[--heap->size];
+
+    // sift down
+    int i = 0;
+    while (1) {
+        int child = i * 2 + 1;
+        if (child >= heap->size) break;
+        if (child + 1 < heap->size && heap->items[child + 1].ready_at_ms < heap->items[child].ready_at_ms) child++;
+        if (last.ready_at_ms <= heap->items[child].ready_at_ms) break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if (heap->size > 0) heap->items[i] = last;
+    return item;
+}
+
+
 
 
 /*
-    Parser thread function.
-    Parsing all pages, push image hashes to download queue
+    HASH FILE
 */
-void* gelbooru_parser_thread_func(void *arg) {
-    gelbooru_thread_arg* args = (gelbooru_thread_arg*) arg;
-    if (args == NULL) {
-        printf("Gelbooru parser thread: empty args\n");
+
+/* Open hash file name in dir, loads existing hashes */
+gelbooru_hash_file* gelbooru_hash_file_open(const char *dir_path, const char *name) {
+    if (dir_path == NULL || name == NULL) return NULL;
+
+    gelbooru_hash_file *file = (gelbooru_hash_file*) malloc(sizeof(gelbooru_hash_file));
+    if (file == NULL) {
+        printf("Failed to allocate mem for hash file\n");
         return NULL;
     }
-    gelbooru* gbooru = args->gbooru;
-    gelbooru_downloader_data* data = args->data;
-    if (gbooru == NULL || data == NULL) {
+    file->fp = NULL;
+    file->added = 0;
+    file->path = (char*) malloc(strlen(dir_path) + strlen(name) + 2);
+    file->hashes = gelbooru_hash_set_create(0);
+    pthread_mutex_init(&file->mutex, NULL);
+    if (file->path == NULL || file->hashes == NULL) {
+        printf("Failed to create hash file\n");
+        gelbooru_hash_file_close(file);
         return NULL;
     }
-    int pid = 0, max_pid = 0;
-    char prefix[32], postfix[32];
-    char *url;
-    gelbooru_raw_data *raw_data;
-    vector* image_hash_list;
+    sprintf(file->path, "%s/%s", dir_path, name);
+
+    FILE *in = fopen(file->path, "r");
+    if (in != NULL) {
+        char line[128];
+        unsigned char md5[16];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (strlen(line) >= 32) line[32] = '\0';
+            if (gelbooru_md5_from_hex(line, md5) == 0) gelbooru_hash_set_insert(file->hashes, md5);
+        }
+        fclose(in);
+    }
 
-    sprintf(prefix, "%-10s", "Parser");
-    ProgressBar_set_prefix_text(data->parser_bar, prefix);
-    while (1) {
-        url = gelbooru_construct_posts_page_url(data->tags, pid);
-        if (url == NULL) {
-            sprintf(postfix, "Failed to construct url");
-            ProgressBar_set_postfix_text(data->parser_bar, postfix);
+    file->fp = fopen(file->path, "a");
+    if (file->fp == NULL) {
+        printf("Failed to open %s\n", file->path);
+        gelbooru_hash_file_close(file);
+        return NULL;
+    }
+    return file;
+}
 
-            printf("Gelbooru parser thread: failed to construct posts page url\n");
-            break;
-        }
-        
-        raw_data = gelbooru_get_request(gbooru, url);
-        if (raw_data == NULL) {
-            sprintf(postfix, "Failed to GET");
-            ProgressBar_set_postfix_text(data->parser_bar, postfix);
+/* Close hash file */
+void gelbooru_hash_file_close(gelbooru_hash_file *file) {
+    if (file != NULL) {
+        if (file->fp != NULL) fclose(file->fp);
+        gelbooru_hash_set_destroy(file->hashes);
+        pthread_mutex_destroy(&file->mutex);
+        free(file->path);
+        free(file);
+    }
+}
 
-            free(url);
-            break;
-        }
+/* Returns 1 if file has MD5 hex hash */
+int gelbooru_hash_file_contains(gelbooru_hash_file *file, const char *hash) {
+    if (file == NULL) return 0;
+
+    unsigned char md5[16];
+    if (gelbooru_md5_from_hex(hash, md5) != 0) return 0;
+    return gelbooru_hash_set_contains(file->hashes, md5);
+}
+
+/*
+    Append hash with optional note, line is flushed at once
+    Returns 1 if added, 0 if file already has hash, -1 on error
+*/
+int gelbooru_hash_file_add(gelbooru_hash_file *file, const char *hash, const char *note) {
+    if (file == NULL || hash == NULL) return -1;
+
+    unsigned char md5[16];
+    if (gelbooru_md5_from_hex(hash, md5) != 0) return -1;
+
+    pthread_mutex_lock(&file->mutex);
+    int inserted = gelbooru_hash_set_insert(file->hashes, md5);
+    if (inserted == 1) {
+        file->added++;
+        if (note != NULL) fprintf(file->fp, "%.32s %s\n", hash, note);
+        else fprintf(file->fp, "%.32s\n", hash);
+        fflush(file->fp);
+    }
+    pthread_mutex_unlock(&file->mutex);
+    return inserted;
+}
+
+/* Number of hashes added since open */
+long long gelbooru_hash_file_added(gelbooru_hash_file *file) {
+    if (file == NULL) return 0;
+
+    pthread_mutex_lock(&file->mutex);
+    long long added = file->added;
+    pthread_mutex_unlock(&file->mutex);
+    return added;
+}
+
+/* Number of hashes in file */
+long long gelbooru_hash_file_size(gelbooru_hash_file *file) {
+    if (file == NULL) return 0;
+    return gelbooru_hash_set_size(file->hashes);
+}
 
-        // parse max pid
-        if (pid == 0) {
-            max_pid = gelbooru_parse_max_pid(raw_data);
-            if (max_pid < 0) {
-                sprintf(postfix, "Failed to parse max pid");
-                ProgressBar_set_postfix_text(data->parser_bar, postfix);
 
-                printf("Gelbooru parser thread: Failed to parse max pid\n");
-                free(url);
-                gelbooru_raw_data_free(raw_data);
-                break;
+
+
+
+/*
+    VERIFY
+*/
+
+/*
+    Check MD5 of file, expected_size is size from index or 0 if unknown
+    File is mapped and hashed in chunks, pages are read ahead and dropped behind
+    Returns GELBOORU_VERIFY_* result, size is set to file size
+*/
+int gelbooru_verify_file(const char *path, const unsigned char *md5, long long expected_size, long long *size) {
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return GELBOORU_VERIFY_UNREADABLE;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return GELBOORU_VERIFY_UNREADABLE;
+    }
+    *size = st.st_size;
+    if (expected_size > 0 && st.st_size < expected_size) {
+        close(fd);
+        return GELBOORU_VERIFY_TRUNCATED;
+    }
+
+    gelbooru_md5_ctx ctx;
+    gelbooru_md5_init(&ctx);
+    if (st.st_size > 0) {
+        unsigned char *map = (unsigned char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            // fall back to buffered reads, digest is still compared below
+            if (gelbooru_md5_update_file(&ctx, path, st.st_size) != 0) {
+                close(fd);
+                return GELBOORU_VERIFY_UNREADABLE;
+            }
+        } else {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            for (off_t offset = 0; offset < st.st_size; offset += GELBOORU_VERIFY_CHUNK_SIZE) {
+                size_t chunk = st.st_size - offset < GELBOORU_VERIFY_CHUNK_SIZE ? (size_t) (st.st_size - offset) : GELBOORU_VERIFY_CHUNK_SIZE;
+                gelbooru_md5_update(&ctx, map + offset, chunk);
+                madvise(map + offset, chunk, MADV_DONTNEED);
             }
-            ProgressBar_set_max_progress(data->parser_bar, max_pid);
+            munmap(map, st.st_size);
         }
+    }
+    close(fd);
 
-        // parse image hashes
-        image_hash_list = gelbooru_parse_image_hashes(raw_data);
-        if (image_hash_list == NULL) {
-            sprintf(postfix, "Failed to parse image hashes");
-            ProgressBar_set_postfix_text(data->parser_bar, postfix);
+    unsigned char digest[16];
+    gelbooru_md5_final(&ctx, digest);
+    return memcmp(digest, md5, 16) == 0 ? GELBOORU_VERIFY_OK : GELBOORU_VERIFY_CORRUPT;
+}
 
-            printf("Gelbooru parser thread: Failed to parse image hashes\n");
-            free(url);
-            gelbooru_raw_data_free(raw_data);
-            break;
-        }
+/* Verify result name for reports */
+const char* gelbooru_verify_result_name(int result) {
+    switch (result) {
+        case GELBOORU_VERIFY_OK:            return "ok";
+        case GELBOORU_VERIFY_CORRUPT:       return "corrupt";
+        case GELBOORU_VERIFY_TRUNCATED:     return "truncated";
+        case GELBOORU_VERIFY_ORPHAN_PART:   return "orphan-part";
+        default:                            return "unreadable";
+    }
+}
+
+/*
+    Verify thread func
+    Takes next file name until all are checked
+    Part file is orphan if image is complete (removed on requeue) or not downloaded (requeued, kept to resume)
+*/
+void* gelbooru_verify_thread_func(void *arg) {
+    gelbooru_verify *verify = (gelbooru_verify*) arg;
 
+    while (1) {
+        int i = atomic_fetch_add(&verify->next, 1);
+        if (i >= vector_size(verify->names)) break;
+        const char *name = (const char*) vector_index(verify->names, i);
+
+        char image_name[128], hash[33], format[8];
+        size_t length = strlen(name);
+        size_t suffix_length = strlen(GELBOORU_PART_FILE_SUFFIX);
+        int part = length > suffix_length && strcmp(name + length - suffix_length, GELBOORU_PART_FILE_SUFFIX) == 0;
+        snprintf(image_name, sizeof(image_name), "%.*s", (int) (part ? length - suffix_length : length), name);
+
+        char *path = gelbooru_construct_listed_image_path(verify->dir_path, image_name, hash, format, sizeof(format));
+        if (path == NULL) continue;
+
+        int result;
+        long long size = 0;
+        if (part) {
+            result = GELBOORU_VERIFY_ORPHAN_PART;
+            if (verify->requeue != NULL) {
+                char *part_path = (char*) malloc(strlen(path) + suffix_length + 1);
+                if (part_path != NULL && gelbooru_file_exists(path)) {
+                    sprintf(part_path, "%s%s", path, GELBOORU_PART_FILE_SUFFIX);
+                    remove(part_path);
+                } else {
+                    gelbooru_hash_file_add(verify->requeue, hash, NULL);
+                }
+                free(part_path);
+            }
+        } else {
+            unsigned char md5[16];
+            gelbooru_md5_from_hex(hash, md5);
+            long long expected_size = 0;
+            gelbooru_index_record key, *record = NULL;
+            memcpy(key.md5, md5, 16);
+            if (verify->records != NULL) {
+                record = (gelbooru_index_record*) bsearch(&key, verify->records, verify->record_count,
+                    sizeof(gelbooru_index_record), gelbooru_index_record_compare);
+            }
+            if (record != NULL) expected_size = (long long) record->size;
 
-        // push to queue
-        for (int i = 0; i < vector_size(image_hash_list); i++) {
-            char *hash = vector_index(image_hash_list, i);
-            //printf("%s\n", hash);
-            if (tsq_push(data->download_queue, hash) != 0) {
-                printf("Gelbooru parser thread: Failed push to download queue\n");
-                free(hash);
+            result = gelbooru_verify_file(path, md5, expected_size, &size);
+            if (result != GELBOORU_VERIFY_OK && verify->requeue != NULL) {
+                remove(path);
+                gelbooru_hash_file_add(verify->requeue, hash, NULL);
             }
         }
+        free(path);
+
+        pthread_mutex_lock(&verify->mutex);
+        if (!part) verify->report.checked++;
+        verify->report.bytes += size;
+        verify->report.counts[result]++;
+        if (result != GELBOORU_VERIFY_OK) printf("%-12s %s\n", gelbooru_verify_result_name(result), name);
+        pthread_mutex_unlock(&verify->mutex);
+    }
+    return NULL;
+}
 
+/*
+    Verify images of dir with thread_count threads (0 is one per core)
+    With requeue bad images are removed, their hashes saved to requeue file and index is rebuilt
+    Returns number of bad files or -1
+*/
+int gelbooru_verify_dir(const char *dir_path, int thread_count, int requeue, gelbooru_verify_report *report) {
+    if (dir_path == NULL || report == NULL) return -1;
+    memset(report, 0, sizeof(gelbooru_verify_report));
+
+    gelbooru_verify verify;
+    verify.dir_path = dir_path;
+    verify.names = vector_create();
+    atomic_init(&verify.next, 0);
+    verify.records = gelbooru_index_read_records(dir_path, &verify.record_count);
+    verify.requeue = requeue ? gelbooru_hash_file_open(dir_path, GELBOORU_REQUEUE_FILE_NAME) : NULL;
+    memset(&verify.report, 0, sizeof(verify.report));
+    pthread_mutex_init(&verify.mutex, NULL);
+    if (verify.names == NULL || (requeue && verify.requeue == NULL) || gelbooru_list_images(dir_path, verify.names) < 0) {
+        printf("Failed to init verify of %s\n", dir_path);
+        if (verify.names != NULL) {
+            for (int i = 0; i < vector_size(verify.names); i++) free(vector_index(verify.names, i));
+        }
+        vector_destroy(verify.names);
+        free(verify.records);
+        gelbooru_hash_file_close(verify.requeue);
+        pthread_mutex_destroy(&verify.mutex);
+        return -1;
+    }
 
-        free(url);
-        vector_destroy(image_hash_list);
-        gelbooru_raw_data_free(raw_data);
+    if (thread_count <= 0) thread_count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count <= 0) thread_count = 1;
+    pthread_t *threads = (pthread_t*) malloc(sizeof(pthread_t) * thread_count);
+    int started = 0;
+    if (threads != NULL) {
+        for (; started < thread_count; started++) {
+            if (pthread_create(&threads[started], NULL, gelbooru_verify_thread_func, &verify) != 0) break;
+        }
+    }
+    if (started == 0) gelbooru_verify_thread_func(&verify);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
 
-        sprintf(postfix, "%-7d / ~%-7d", pid, max_pid);
-        ProgressBar_set_progress(data->parser_bar, pid);
-        ProgressBar_set_postfix_text(data->parser_bar, postfix);
+    *report = verify.report;
+    int bad = 0;
+    for (int i = GELBOORU_VERIFY_OK + 1; i < GELBOORU_VERIFY_RESULTS; i++) bad += report->counts[i];
 
-        pid += 42;
-        if (pid > max_pid) break;
-        usleep(gbooru->parser_sleep_ms * 1000);
+    // removed images must not be skipped as downloaded
+    if (requeue && bad > 0 && gelbooru_index_rebuild(dir_path) < 0) {
+        printf("Failed to rebuild index, run rebuild-index\n");
     }
 
-    //ProgressBar_set_postfix_text(data->parser_bar, "Finished");
-    return NULL;
+    for (int i = 0; i < vector_size(verify.names); i++) free(vector_index(verify.names, i));
+    vector_destroy(verify.names);
+    free(verify.records);
+    gelbooru_hash_file_close(verify.requeue);
+    pthread_mutex_destroy(&verify.mutex);
+    return bad;
 }
 
+
+
+
+
+
 /*
-    Downloader thread func
-    Pops image from queue and download image
+    PACK
 */
-void* gelbooru_downloader_thread_func(void *arg) {
-    gelbooru_thread_arg* args = (gelbooru_thread_arg*) arg;
-    if (args == NULL) {
-        printf("Gelbooru parser thread: empty args\n");
-        return NULL;
+
+/* Path of segment file, must be freed */
+char* gelbooru_pack_segment_path(const char *dir_path, uint32_t segment) {
+    char *path = (char*) malloc(strlen(dir_path) + 32);
+    if (path == NULL) return NULL;
+    sprintf(path, GELBOORU_PACK_SEGMENT_FORMAT, dir_path, segment);
+    return path;
+}
+
+/* Size of segment file or -1 if it does not exist */
+long long gelbooru_pack_segment_size(const char *dir_path, uint32_t segment) {
+    char *path = gelbooru_pack_segment_path(dir_path, segment);
+    if (path == NULL) return -1;
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+    free(path);
+    return exists ? (long long) st.st_size : -1;
+}
+
+/* Open segment for appending */
+int gelbooru_pack_open_segment(gelbooru_pack *pack, uint32_t segment) {
+    char *path = gelbooru_pack_segment_path(pack->dir_path, segment);
+    if (path == NULL) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Failed to open pack segment %s\n", path);
+        if (fd >= 0) close(fd);
+        free(path);
+        return -1;
     }
-    int thread_id = args->thread_id;
-    gelbooru* gbooru = args->gbooru;
-    gelbooru_downloader_data* data = args->data;
-    if (gbooru == NULL || data == NULL) {
+    free(path);
+
+    if (pack->segment_fd >= 0) close(pack->segment_fd);
+    pack->segment_fd = fd;
+    pack->segment = segment;
+    pack->segment_size = st.st_size;
+    return 0;
+}
+
+/*
+    Read records of pack index in dir
+    Records pointing past end of their segment (lost buffered bytes) are dropped
+    Returns NULL if dir has no pack
+*/
+gelbooru_pack_record* gelbooru_pack_read_records(const char *dir_path, size_t *count) {
+    *count = 0;
+    char *path = (char*) malloc(strlen(dir_path) + strlen(GELBOORU_PACK_INDEX_FILE_NAME) + 2);
+    if (path == NULL) return NULL;
+    sprintf(path, "%s/%s", dir_path, GELBOORU_PACK_INDEX_FILE_NAME);
+    FILE *fp = fopen(path, "rb");
+    free(path);
+    if (fp == NULL) return NULL;
+
+    char header[GELBOORU_INDEX_HEADER_SIZE];
+    struct stat st;
+    if (fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, GELBOORU_PACK_MAGIC, strlen(GELBOORU_PACK_MAGIC)) != 0
+        || fstat(fileno(fp), &st) != 0) {
+        printf("Pack index of %s has unknown format\n", dir_path);
+        fclose(fp);
         return NULL;
     }
 
-    ProgressBar *bar = data->downloader_bars[thread_id];
-    char prefix[32], postfix[32];
-    char *image_hash;
-    sprintf(prefix, "%s %3d", "Downloader", thread_id);
-    ProgressBar_set_prefix_text(bar, prefix);
-    while (1) {
-        image_hash = tsq_pop(data->download_queue);
-        if (image_hash == NULL) break;
-        
-        if (gelbooru_download_image(gbooru, image_hash, bar) != 0) {
-            //ProgressBar_set_postfix_text(bar, "Failed");
+    size_t capacity = (st.st_size - GELBOORU_INDEX_HEADER_SIZE) / sizeof(gelbooru_pack_record);
+    gelbooru_pack_record *records = (gelbooru_pack_record*) malloc((capacity > 0 ? capacity : 1) * sizeof(gelbooru_pack_record));
+    if (records == NULL) {
+        printf("Failed to allocate mem for pack records\n");
+        fclose(fp);
+        return NULL;
+    }
+    size_t read_count = fread(records, sizeof(gelbooru_pack_record), capacity, fp);
+    fclose(fp);
+
+    // records are in segment order
+    long long segment_size = -1;
+    uint32_t segment = UINT32_MAX;
+    for (size_t i = 0; i < read_count; i++) {
+        if (records[i].segment != segment) {
+            segment = records[i].segment;
+            segment_size = gelbooru_pack_segment_size(dir_path, segment);
         }
-
-        free(image_hash);
-        sprintf(postfix, "%-15s", "Sleep...");
-        ProgressBar_set_postfix_text(bar, postfix);
-        usleep(gbooru->downloader_sleep_ms * 1000);
+        if (segment_size < 0 || records[i].offset + records[i].length > (uint64_t) segment_size) continue;
+        records[(*count)++] = records[i];
     }
-    sprintf(postfix, "%-10s", "Finished");
-    ProgressBar_set_postfix_text(bar, postfix);
+    return records;
 }
 
 /*
-    Progress thread func
-    Prints download progress
+    Open pack of dir, appends go to last segment
+    Returns NULL if failed
 */
-void* gelbooru_progress_thread_func(void *arg) {
-    gelbooru_thread_arg* args = (gelbooru_thread_arg*) arg;
-    if (args == NULL) {
-        printf("Gelbooru parser thread: empty args\n");
+gelbooru_pack* gelbooru_pack_open(const char *dir_path) {
+    if (dir_path == NULL) return NULL;
+
+    gelbooru_pack *pack = (gelbooru_pack*) malloc(sizeof(gelbooru_pack));
+    if (pack == NULL) {
+        printf("Failed to allocate mem for pack\n");
+        return NULL;
+    }
+    memset(pack, 0, sizeof(gelbooru_pack));
+    pack->index_fd = -1;
+    pack->segment_fd = -1;
+    pack->dir_path = strdup(dir_path);
+    pack->buffer = (char*) malloc(GELBOORU_PACK_BUFFER_SIZE);
+    pack->hashes = gelbooru_hash_set_create(0);
+    pthread_mutex_init(&pack->mutex, NULL);
+    if (pack->dir_path == NULL || pack->buffer == NULL || pack->hashes == NULL) {
+        printf("Failed to create pack\n");
+        gelbooru_pack_close(pack);
+        return NULL;
+    }
+
+    size_t count;
+    gelbooru_pack_record *records = gelbooru_pack_read_records(dir_path, &count);
+    for (size_t i = 0; i < count; i++) {
+        gelbooru_hash_set_insert(pack->hashes, records[i].md5);
+    }
+    free(records);
+
+    char *path = (char*) malloc(strlen(dir_path) + strlen(GELBOORU_PACK_INDEX_FILE_NAME) + 2);
+    if (path == NULL) {
+        gelbooru_pack_close(pack);
+        return NULL;
+    }
+    sprintf(path, "%s/%s", dir_path, GELBOORU_PACK_INDEX_FILE_NAME);
+    pack->index_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    free(path);
+    struct stat st;
+    if (pack->index_fd < 0 || fstat(pack->index_fd, &st) != 0) {
+        printf("Failed to open pack index of %s\n", dir_path);
+        gelbooru_pack_close(pack);
         return NULL;
     }
-    gelbooru* gbooru = args->gbooru;
-    gelbooru_downloader_data* data = args->data;
-    if (gbooru == NULL || data == NULL) {
+
+    // new index, partial record at end (interrupted append) is cut
+    if (st.st_size < GELBOORU_INDEX_HEADER_SIZE) {
+        char header[GELBOORU_INDEX_HEADER_SIZE] = {0};
+        memcpy(header, GELBOORU_PACK_MAGIC, strlen(GELBOORU_PACK_MAGIC));
+        if (ftruncate(pack->index_fd, 0) != 0 || write(pack->index_fd, header, sizeof(header)) != sizeof(header)) {
+            printf("Failed to write pack index header\n");
+            gelbooru_pack_close(pack);
+            return NULL;
+        }
+    } else {
+        off_t whole = GELBOORU_INDEX_HEADER_SIZE + (st.st_size - GELBOORU_INDEX_HEADER_SIZE) / sizeof(gelbooru_pack_record) * sizeof(gelbooru_pack_record);
+        if (whole != st.st_size && ftruncate(pack->index_fd, whole) != 0) {
+            printf("Failed to truncate pack index\n");
+        }
+    }
+
+    uint32_t segment = 0;
+    while (gelbooru_pack_segment_size(dir_path, segment + 1) >= 0) segment++;
+    if (gelbooru_pack_open_segment(pack, segment) != 0) {
+        gelbooru_pack_close(pack);
         return NULL;
     }
+    return pack;
+}
 
-    ProgressBar *parser_bar = data->parser_bar;
-    ProgressBar **download_bars = data->downloader_bars;
-    int lines_count = data->download_thread_count + 2;
-
-    while (1) {
-        printf("Images in queue: %d\n", tsq_size(data->download_queue));
+/* Flush and close pack */
+void gelbooru_pack_close(gelbooru_pack *pack) {
+    if (pack != NULL) {
+        if (pack->segment_fd >= 0 && pack->index_fd >= 0) gelbooru_pack_flush(pack);
+        if (pack->segment_fd >= 0) close(pack->segment_fd);
+        if (pack->index_fd >= 0) close(pack->index_fd);
+        gelbooru_hash_set_destroy(pack->hashes);
+        pthread_mutex_destroy(&pack->mutex);
+        free(pack->pending);
+        free(pack->buffer);
+        free(pack->dir_path);
+        free(pack);
+    }
+}
 
-        ProgressBar_print(parser_bar);
-        printf("\n");
+/* Returns 1 if pack has image with MD5 hex hash */
+int gelbooru_pack_contains(gelbooru_pack *pack, const char *hash) {
+    if (pack == NULL) return 0;
 
-        for (int i = 0; i < data->download_thread_count; i++) {
-            ProgressBar_print(download_bars[i]);
-            printf("\n");
-        }
-        printf("\033[%dA", lines_count);
+    unsigned char md5[16];
+    if (gelbooru_md5_from_hex(hash, md5) != 0) return 0;
+    return gelbooru_hash_set_contains(pack->hashes, md5);
+}
 
-        usleep(100000); // 100ms
-        if (tsq_closed(data->download_queue) && (tsq_size(data->download_queue) == 0)) {
-            break;
-        }
+/*
+    Write buffered bytes, then records of them, so index never points to unwritten bytes
+    Returns 0 if OK
+*/
+int gelbooru_pack_flush_locked(gelbooru_pack *pack) {
+    if (pack->buffered > 0 && gelbooru_write_all(pack->segment_fd, pack->buffer, pack->buffered) != 0) {
+        printf("Failed to write pack segment\n");
+        return -1;
     }
+    pack->buffered = 0;
 
-    ProgressBar_print(parser_bar);
-    printf("\n");
-    for (int i = 0; i < data->download_thread_count; i++) {
-        ProgressBar_print(download_bars[i]);
-        printf("\n");
+    size_t size = pack->pending_count * sizeof(gelbooru_pack_record);
+    if (size > 0 && gelbooru_write_all(pack->index_fd, (const char*) pack->pending, size) != 0) {
+        printf("Failed to write pack index\n");
+        return -1;
     }
+    pack->pending_count = 0;
+    return 0;
 }
 
+/* Write buffered images, returns 0 if OK */
+int gelbooru_pack_flush(gelbooru_pack *pack) {
+    if (pack == NULL) return -1;
 
+    pthread_mutex_lock(&pack->mutex);
+    int res = gelbooru_pack_flush_locked(pack);
+    pthread_mutex_unlock(&pack->mutex);
+    return res;
+}
 
 /*
-    Download all images multithreaded
-    with progress
+    Write and sync buffered images, segment is synced before records of its images are written
+    Returns 0 if OK
 */
-void gelbooru_download(gelbooru* gbooru, vector* tags) {
-    gelbooru_downloader_data* data = gelbooru_downloader_data_create(gbooru);
-    if (data == NULL) {
-        printf("Failed to create downloader data\n");
-        return;
-    }
-    data->tags = tags;
+int gelbooru_pack_sync(gelbooru_pack *pack) {
+    if (pack == NULL) return -1;
+
+    pthread_mutex_lock(&pack->mutex);
+    int res = 0;
+    if (pack->buffered > 0 && gelbooru_write_all(pack->segment_fd, pack->buffer, pack->buffered) != 0) res = -1;
+    else pack->buffered = 0;
+    if (res == 0 && fsync(pack->segment_fd) != 0) res = -1;
+    if (res == 0) res = gelbooru_pack_flush_locked(pack);
+    if (res == 0 && fsync(pack->index_fd) != 0) res = -1;
+    pthread_mutex_unlock(&pack->mutex);
+    return res;
+}
 
-    // chech dir
-    if (gbooru->downloads_dir_path == NULL) {
-        printf("Output dir not set, set default dir\n");
-        gelbooru_set_downloads_dirpath(gbooru, GELBOORU_DEFAULT_DOWNLOAD_DIR_PATH);
+/* Append bytes to segment through buffer, big writes go straight to file */
+int gelbooru_pack_write_locked(gelbooru_pack *pack, const void *data, size_t size) {
+    if (pack->buffered + size > GELBOORU_PACK_BUFFER_SIZE) {
+        if (pack->buffered > 0 && gelbooru_write_all(pack->segment_fd, pack->buffer, pack->buffered) != 0) return -1;
+        pack->buffered = 0;
     }
-    if (!gelbooru_directory_exists(gbooru->downloads_dir_path)) {
-        printf("Output dir not exists, creating ...\n");
-        if (!gelbooru_mkdir(gbooru->downloads_dir_path)) {
-            printf("Failed to create output dir\n");
-            gelbooru_downloader_data_destroy(data);
-            return;
-        }
+    if (size >= GELBOORU_PACK_BUFFER_SIZE) {
+        if (gelbooru_write_all(pack->segment_fd, (const char*) data, size) != 0) return -1;
+    } else {
+        memcpy(pack->buffer + pack->buffered, data, size);
+        pack->buffered += size;
     }
+    pack->segment_size += size;
+    return 0;
+}
 
+/* Start entry of image, new segment if it does not fit */
+int gelbooru_pack_begin_locked(gelbooru_pack *pack, const char *hash, const char *format, uint64_t size, gelbooru_pack_record *record) {
+    gelbooru_index_record header;
+    if (gelbooru_index_record_init(&header, hash, format, size) != 0) return -1;
 
-    // parser
-    gelbooru_thread_arg* parser_arg = data->parser_arg;
-    parser_arg->thread_id = 0;
-    parser_arg->gbooru = gbooru;
-    parser_arg->data = data;
-    if (pthread_create(data->parser_thread, NULL, gelbooru_parser_thread_func, parser_arg) != 0) {
-        printf("Failed to create parser thread\n");
-        gelbooru_downloader_data_destroy(data);
-        return;
+    if (pack->segment_size > 0 && pack->segment_size + sizeof(header) + size > GELBOORU_PACK_SEGMENT_SIZE) {
+        if (gelbooru_pack_flush_locked(pack) != 0 || gelbooru_pack_open_segment(pack, pack->segment + 1) != 0) return -1;
     }
+    if (gelbooru_pack_write_locked(pack, &header, sizeof(header)) != 0) return -1;
+
+    memset(record, 0, sizeof(gelbooru_pack_record));
+    memcpy(record->md5, header.md5, 16);
+    memcpy(record->format, header.format, sizeof(record->format));
+    record->segment = pack->segment;
+    record->offset = pack->segment_size;
+    record->length = size;
+    return 0;
+}
 
-    // downloaders
-    for (int i = 0; i < data->download_thread_count; i++) {
-        gelbooru_thread_arg* downloader_arg = &data->downloader_args[i];
-        downloader_arg->thread_id = i;
-        downloader_arg->gbooru = gbooru;
-        downloader_arg->data = data;
-        if (pthread_create(&data->downloader_threads[i], NULL, gelbooru_downloader_thread_func, downloader_arg) != 0) {
-            printf("Failed to create parser thread\n");
-            tsq_close(data->download_queue);
-            gelbooru_downloader_data_destroy(data);
-            return;
-        }
+/* Add record of written image, it is written to index on next flush */
+int gelbooru_pack_end_locked(gelbooru_pack *pack, gelbooru_pack_record *record) {
+    if (pack->pending_count == pack->pending_capacity) {
+        int capacity = pack->pending_capacity > 0 ? pack->pending_capacity * 2 : 256;
+        gelbooru_pack_record *pending = (gelbooru_pack_record*) realloc(pack->pending, capacity * sizeof(gelbooru_pack_record));
+        if (pending == NULL) return -1;
+        pack->pending = pending;
+        pack->pending_capacity = capacity;
     }
+    pack->pending[pack->pending_count++] = *record;
+    gelbooru_hash_set_insert(pack->hashes, record->md5);
 
-    // progress
-    gelbooru_thread_arg *progress_arg = data->progress_arg;
-    progress_arg->thread_id = 0;
-    progress_arg->gbooru = gbooru;
-    progress_arg->data = data;
-
-    if (pthread_create(data->progress_thread, NULL, gelbooru_progress_thread_func, progress_arg) != 0) {
-        printf("Failed to create progress thread\n");
-        tsq_close(data->download_queue);
-        gelbooru_downloader_data_destroy(data);
-        return;
-    }
+    // unbuffered image bytes, records can go at once
+    if (pack->buffered == 0) return gelbooru_pack_flush_locked(pack);
+    return 0;
+}
 
+/*
+    Append image from memory
+    Returns 0 if OK
+*/
+int gelbooru_pack_append(gelbooru_pack *pack, const char *hash, const char *format, const void *data, size_t size) {
+    if (pack == NULL || hash == NULL || format == NULL) return -1;
+
+    pthread_mutex_lock(&pack->mutex);
+    gelbooru_pack_record record;
+    int res = gelbooru_pack_begin_locked(pack, hash, format, size, &record);
+    if (res == 0) res = gelbooru_pack_write_locked(pack, data, size);
+    if (res == 0) res = gelbooru_pack_end_locked(pack, &record);
+    pthread_mutex_unlock(&pack->mutex);
+    return res;
+}
 
+/*
+    Append image from file, file is copied in buffer sized chunks
+    Returns 0 if OK
+*/
+int gelbooru_pack_append_file(gelbooru_pack *pack, const char *hash, const char *format, const char *path) {
+    if (pack == NULL || hash == NULL || format == NULL || path == NULL) return -1;
 
-    // parser
-    pthread_join(*(data->parser_thread), NULL);
-    tsq_close(data->download_queue);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
 
-    // downloader
-    for (int i = 0; i < data->download_thread_count; i++) {
-        pthread_join(data->downloader_threads[i], NULL);
+    pthread_mutex_lock(&pack->mutex);
+    gelbooru_pack_record record;
+    int res = gelbooru_pack_begin_locked(pack, hash, format, st.st_size, &record);
+    if (res == 0) res = gelbooru_pack_flush_locked(pack);
+
+    // straight to segment file
+    off_t left = st.st_size;
+    char *chunk = pack->buffer;
+    while (res == 0 && left > 0) {
+        ssize_t count = read(fd, chunk, left < GELBOORU_PACK_BUFFER_SIZE ? (size_t) left : GELBOORU_PACK_BUFFER_SIZE);
+        if (count <= 0 || gelbooru_write_all(pack->segment_fd, chunk, count) != 0) res = -1;
+        else left -= count;
     }
+    if (res == 0) {
+        pack->segment_size += st.st_size;
+        res = gelbooru_pack_end_locked(pack, &record);
+    } else {
+        // entry is cut, next entries start after it
+        struct stat segment_st;
+        if (fstat(pack->segment_fd, &segment_st) == 0) pack->segment_size = segment_st.st_size;
+    }
+    pthread_mutex_unlock(&pack->mutex);
+    close(fd);
+    return res;
+}
 
-    // progress
-    pthread_join(*(data->progress_thread), NULL);
+/*
+    Write images of pack in dir to out_dir as hash.ext files
+    All images if hashes is NULL, else images of MD5 hex hashes
+    Returns number of written images or -1
+*/
+int gelbooru_pack_export(const char *dir_path, const char *out_dir, vector *hashes) {
+    if (dir_path == NULL || out_dir == NULL) return -1;
 
+    size_t count;
+    gelbooru_pack_record *records = gelbooru_pack_read_records(dir_path, &count);
+    if (records == NULL) {
+        printf("No pack in %s\n", dir_path);
+        return -1;
+    }
+    gelbooru_hash_set *wanted = NULL;
+    if (hashes != NULL) {
+        wanted = gelbooru_hash_set_create(vector_size(hashes));
+        for (int i = 0; wanted != NULL && i < vector_size(hashes); i++) {
+            gelbooru_hash_set_insert_hex(wanted, vector_index(hashes, i));
+        }
+    }
+    char *buffer = (char*) malloc(GELBOORU_PACK_BUFFER_SIZE);
+    if (buffer == NULL || (hashes != NULL && wanted == NULL)) {
+        printf("Failed to allocate mem for pack export\n");
+        free(records);
+        free(buffer);
+        gelbooru_hash_set_destroy(wanted);
+        return -1;
+    }
+    if (!gelbooru_directory_exists(out_dir)) gelbooru_mkdir(out_dir);
+
+    int exported = 0, segment_fd = -1;
+    uint32_t segment = UINT32_MAX;
+    for (size_t i = 0; i < count; i++) {
+        gelbooru_pack_record *record = &records[i];
+        if (wanted != NULL && !gelbooru_hash_set_contains(wanted, record->md5)) continue;
+
+        if (record->segment != segment) {
+            if (segment_fd >= 0) close(segment_fd);
+            segment = record->segment;
+            char *path = gelbooru_pack_segment_path(dir_path, segment);
+            segment_fd = path != NULL ? open(path, O_RDONLY) : -1;
+            free(path);
+            if (segment_fd < 0) continue;
+        }
+        if (segment_fd < 0) continue;
+
+        char hash[33], format[sizeof(record->format) + 1];
+        for (int j = 0; j < 16; j++) sprintf(hash + j * 2, "%02x", record->md5[j]);
+        memcpy(format, record->format, sizeof(record->format));
+        format[sizeof(record->format)] = '\0';
+        char *path = gelbooru_construct_image_output_path(out_dir, hash, format);
+        int fd = path != NULL ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+        if (fd < 0) {
+            printf("Failed to create %s\n", path != NULL ? path : hash);
+            free(path);
+            continue;
+        }
 
-    gelbooru_downloader_data_destroy(data);
+        uint64_t done = 0;
+        while (done < record->length) {
+            size_t want = record->length - done < GELBOORU_PACK_BUFFER_SIZE ? (size_t) (record->length - done) : GELBOORU_PACK_BUFFER_SIZE;
+            ssize_t got = pread(segment_fd, buffer, want, record->offset + done);
+            if (got <= 0 || gelbooru_write_all(fd, buffer, got) != 0) break;
+            done += got;
+        }
+        close(fd);
+        if (done == record->length) exported++;
+        else {
+            printf("Failed to export %s\n", path);
+            remove(path);
+        }
+        free(path);
+    }
+    if (segment_fd >= 0) close(segment_fd);
+    free(buffer);
+    free(records);
+    gelbooru_hash_set_destroy(wanted);
+    return exported;
 }
 
 
 
 
 /*
-    VECTOR
+    EVENT LOG
 */
-vector* vector_create() {
-    vector* v = (vector*) malloc(sizeof(vector));
-    if (v == NULL) return NULL;
 
-    v->data = NULL;
-    v->size = 0;
-    v->capacity = 0;
-    return v;
-}
+/* Create event log writing to fd, fd is not closed by log */
+gelbooru_event_log* gelbooru_event_log_create(int fd) {
+    if (fd < 0) return NULL;
 
-void vector_destroy(vector* v) {
-    if (v != NULL) {
-        free(v->data);
-        free(v);
+    gelbooru_event_log *log = (gelbooru_event_log*) malloc(sizeof(gelbooru_event_log));
+    if (log == NULL) {
+        printf("Failed to allocate mem for event log\n");
+        return NULL;
     }
+    log->buffer = (char*) malloc(GELBOORU_EVENT_BUFFER_SIZE);
+    if (log->buffer == NULL) {
+        printf("Failed to allocate mem for event log buffer\n");
+        free(log);
+        return NULL;
+    }
+    log->fd = fd;
+    log->size = 0;
+    pthread_mutex_init(&log->mutex, NULL);
+    return log;
 }
 
-int vector_size(vector* v) {
-    if (v == NULL) return -1;
-    return v->size;
-}
-
-int vector_push_back(vector* v, void *item) {
-    if (v == NULL) return -1;
-
-    if (v->size == v->capacity) {
-        int new_cap = v->capacity == 0 ? 1 : v->capacity * 2;
-        void **new_data = (void**) realloc(v->data, new_cap * sizeof(void*));
-        if (new_data == NULL) return -1;
-
-        v->data = new_data;
-        v->capacity = new_cap;
+/* Flush and destroy event log */
+void gelbooru_event_log_destroy(gelbooru_event_log *log) {
+    if (log != NULL) {
+        gelbooru_event_log_flush(log);
+        pthread_mutex_destroy(&log->mutex);
+        free(log->buffer);
+        free(log);
     }
-    v->data[v->size] = item;
-    v->size++;
-    return 0;
 }
 
-void* vector_pop_back(vector *v) {
-    if (v == NULL || v->size == 0) return NULL;
-    v->size--;
-    return v->data[v->size];
+/* Write buffered events */
+void gelbooru_event_log_flush(gelbooru_event_log *log) {
+    if (log == NULL) return;
+
+    pthread_mutex_lock(&log->mutex);
+    gelbooru_write_all(log->fd, log->buffer, log->size);
+    log->size = 0;
+    pthread_mutex_unlock(&log->mutex);
 }
 
-void* vector_index(vector* v, int index) {
-    if (v == NULL) return NULL;
-    return v->data[index];
+/*
+    Add event {"t":unix ms,"ev":"type",fields}
+    fields_format is printf format of JSON fields without braces, may be NULL
+    Buffer is written when full, long events are truncated
+*/
+void gelbooru_event(gelbooru_event_log *log, const char *type, const char *fields_format, ...) {
+    if (log == NULL) return;
+
+    // wall clock ms, durations in fields are measured with monotonic clock
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long t = (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    char line[GELBOORU_EVENT_LINE_SIZE];
+    int length = snprintf(line, sizeof(line), "{\"t\":%lld,\"ev\":\"%s\"", t, type);
+    if (fields_format != NULL) {
+        line[length++] = ',';
+        va_list args;
+        va_start(args, fields_format);
+        length += vsnprintf(line + length, sizeof(line) - length, fields_format, args);
+        va_end(args);
+    }
+    if (length > (int) sizeof(line) - 3) length = sizeof(line) - 3;
+    line[length++] = '}';
+    line[length++] = '\n';
+
+    pthread_mutex_lock(&log->mutex);
+    if (log->size + length > GELBOORU_EVENT_BUFFER_SIZE) {
+        gelbooru_write_all(log->fd, log->buffer, log->size);
+        log->size = 0;
+    }
+    memcpy(log->buffer + log->size, line, length);
+    log->size += length;
+    pthread_mutex_unlock(&log->mutex);
 }
 
 
@@ -1283,115 +6537,242 @@ void* vector_index(vector* v, int index) {
 
 
 /*
-    THREAD SAFE QUEUE
+    METRICS
 */
 
-ThreadSafeQueue* tsq_create() {
-    ThreadSafeQueue *queue = (ThreadSafeQueue*) malloc(sizeof(ThreadSafeQueue));
-    if (queue == NULL) {
-        return NULL;
-    }
-    queue->head = NULL;
-    queue->tail = NULL;
-    queue->size = 0;
-    queue->closed = 0;
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->cond, NULL);
-    return queue;
-}
+/* Bucket of value, values below GELBOORU_HISTOGRAM_SUB_COUNT have own buckets */
+int gelbooru_histogram_bucket(long long value) {
+    if (value < 0) value = 0;
+    if (value < GELBOORU_HISTOGRAM_SUB_COUNT) return (int) value;
 
-void tsq_destroy(ThreadSafeQueue *queue) {
-    if (queue == NULL) return;
+    int exponent = 63 - __builtin_clzll((unsigned long long) value);
+    if (exponent > GELBOORU_HISTOGRAM_MAX_EXPONENT) return GELBOORU_HISTOGRAM_BUCKETS - 1;
 
-    pthread_mutex_lock(&queue->mutex);
-    TSQ_Node *current = queue->head;
-    while (current != NULL) {
-        TSQ_Node *temp = current;
-        current = current->next;
-        free(temp);
-    }
-    pthread_mutex_unlock(&queue->mutex);
+    int sub = (int) (value >> (exponent - GELBOORU_HISTOGRAM_SUB_BITS)) & (GELBOORU_HISTOGRAM_SUB_COUNT - 1);
+    return (exponent - GELBOORU_HISTOGRAM_SUB_BITS + 1) * GELBOORU_HISTOGRAM_SUB_COUNT + sub;
+}
 
-    pthread_mutex_destroy(&queue->mutex);
-    pthread_cond_destroy(&queue->cond);
-    free(queue);
+/* Highest value of bucket */
+long long gelbooru_histogram_bucket_upper(int bucket) {
+    if (bucket < GELBOORU_HISTOGRAM_SUB_COUNT) return bucket;
+
+    int exponent = bucket / GELBOORU_HISTOGRAM_SUB_COUNT + GELBOORU_HISTOGRAM_SUB_BITS - 1;
+    long long sub = bucket % GELBOORU_HISTOGRAM_SUB_COUNT;
+    int shift = exponent - GELBOORU_HISTOGRAM_SUB_BITS;
+    return ((GELBOORU_HISTOGRAM_SUB_COUNT + sub + 1) << shift) - 1;
 }
 
-int tsq_size(ThreadSafeQueue *queue) {
-    if (queue == NULL) return 0;
+void gelbooru_histogram_record(gelbooru_histogram *histogram, long long value) {
+    if (value < 0) value = 0;
+    atomic_fetch_add_explicit(&histogram->counts[gelbooru_histogram_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
 
-    int size;
-    pthread_mutex_lock(&queue->mutex);
-    size = queue->size;
-    pthread_mutex_unlock(&queue->mutex);
-    return size;
+    long long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value, memory_order_relaxed, memory_order_relaxed));
 }
 
-int tsq_closed(ThreadSafeQueue *queue) {
-    if (queue == NULL) return 1;
+/*
+    Value at percentile (0-100), upper bound of its bucket (not above max)
+    Returns 0 if histogram is empty
+*/
+long long gelbooru_histogram_percentile(gelbooru_histogram *histogram, double percentile) {
+    long long count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    if (count == 0) return 0;
+
+    long long rank = (long long) (percentile / 100 * count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+
+    long long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    long long seen = 0;
+    for (int i = 0; i < GELBOORU_HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            long long upper = gelbooru_histogram_bucket_upper(i);
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
 
-    pthread_mutex_lock(&queue->mutex);
-    int closed = queue->closed;
-    pthread_mutex_unlock(&queue->mutex);
+gelbooru_metrics* gelbooru_metrics_create(void) {
+    gelbooru_metrics *metrics = (gelbooru_metrics*) calloc(1, sizeof(gelbooru_metrics));
+    if (metrics == NULL) {
+        printf("Failed to allocate mem for metrics\n");
+        return NULL;
+    }
+    return metrics;
+}
 
-    return closed;
+void gelbooru_metrics_destroy(gelbooru_metrics *metrics) {
+    free(metrics);
 }
 
-void tsq_close(ThreadSafeQueue *queue) {
-    if (queue == NULL) return;
+/* Record phases of finished request in us and downloaded bytes */
+void gelbooru_metrics_record_request(gelbooru_metrics *metrics, int kind, CURL *curl, CURLcode res) {
+    if (metrics == NULL || curl == NULL || kind < 0 || kind >= GELBOORU_REQUEST_KINDS) return;
+    gelbooru_request_metrics *request = &metrics->kinds[kind];
+
+    long http_code = 0;
+    curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0, bytes = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+
+    atomic_fetch_add_explicit(&request->requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&request->bytes, bytes, memory_order_relaxed);
+    if (res != CURLE_OK || (http_code != 200 && http_code != 206)) {
+        atomic_fetch_add_explicit(&request->errors, 1, memory_order_relaxed);
+    }
 
-    pthread_mutex_lock(&queue->mutex);
-    queue->closed = 1;
-    pthread_cond_broadcast(&queue->cond);
-    pthread_mutex_unlock(&queue->mutex);
+    // reused connection has no dns, connect and tls phases
+    if (connect > 0) {
+        gelbooru_histogram_record(&request->stages[GELBOORU_STAGE_DNS], namelookup);
+        gelbooru_histogram_record(&request->stages[GELBOORU_STAGE_CONNECT], connect - namelookup);
+        if (appconnect > 0) gelbooru_histogram_record(&request->stages[GELBOORU_STAGE_TLS], appconnect - connect);
+    }
+    if (starttransfer > 0) {
+        gelbooru_histogram_record(&request->stages[GELBOORU_STAGE_TTFB], starttransfer - pretransfer);
+        gelbooru_histogram_record(&request->stages[GELBOORU_STAGE_TRANSFER], total - starttransfer);
+    }
+    gelbooru_histogram_record(&request->stages[GELBOORU_STAGE_TOTAL], total);
 }
 
-int tsq_push(ThreadSafeQueue *queue, void *data) {
-    if (queue == NULL) return -1;
+const char* gelbooru_metrics_kind_name(int kind) {
+    return kind == GELBOORU_REQUEST_IMAGE ? "image" : "page";
+}
 
-    TSQ_Node *new_node = (TSQ_Node*) malloc(sizeof(TSQ_Node));
-    if (new_node == NULL) return -1;
+const char* gelbooru_metrics_stage_name(int stage) {
+    switch (stage) {
+        case GELBOORU_STAGE_DNS:        return "dns";
+        case GELBOORU_STAGE_CONNECT:    return "connect";
+        case GELBOORU_STAGE_TLS:        return "tls";
+        case GELBOORU_STAGE_TTFB:       return "ttfb";
+        case GELBOORU_STAGE_TRANSFER:   return "transfer";
+        default:                        return "total";
+    }
+}
 
-    new_node->data = data;
-    new_node->next = NULL;
+/* Print table of stages in ms */
+void gelbooru_metrics_print(gelbooru_metrics *metrics, FILE *fp) {
+    if (metrics == NULL || fp == NULL) return;
+
+    fprintf(fp, "%-6s %-9s %9s %10s %10s %10s %10s\n", "Kind", "Stage", "Count", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (int kind = 0; kind < GELBOORU_REQUEST_KINDS; kind++) {
+        gelbooru_request_metrics *request = &metrics->kinds[kind];
+        if (atomic_load(&request->requests) == 0) continue;
+
+        for (int stage = 0; stage < GELBOORU_STAGES; stage++) {
+            gelbooru_histogram *histogram = &request->stages[stage];
+            long long count = atomic_load(&histogram->count);
+            if (count == 0) continue;
+
+            fprintf(fp, "%-6s %-9s %9lld %10.1f %10.1f %10.1f %10.1f\n",
+                gelbooru_metrics_kind_name(kind), gelbooru_metrics_stage_name(stage), count,
+                gelbooru_histogram_percentile(histogram, 50) / 1000.0,
+                gelbooru_histogram_percentile(histogram, 99) / 1000.0,
+                gelbooru_histogram_percentile(histogram, 99.9) / 1000.0,
+                atomic_load(&histogram->max) / 1000.0);
+        }
+        fprintf(fp, "%-6s requests %lld, errors %lld, %.1f MB\n", gelbooru_metrics_kind_name(kind),
+            atomic_load(&request->requests), atomic_load(&request->errors), atomic_load(&request->bytes) / (1024.0 * 1024.0));
+    }
+}
 
-    pthread_mutex_lock(&queue->mutex);
-    if (queue->tail == NULL) {
-        queue->head = new_node;
-        queue->tail = new_node;
-    } else {
-        queue->tail->next = new_node;
-        queue->tail = new_node;
+/* Write metrics as one JSON object, times in ms */
+int gelbooru_metrics_write_json(gelbooru_metrics *metrics, FILE *fp) {
+    if (metrics == NULL || fp == NULL) return -1;
+
+    fprintf(fp, "{");
+    for (int kind = 0; kind < GELBOORU_REQUEST_KINDS; kind++) {
+        gelbooru_request_metrics *request = &metrics->kinds[kind];
+        fprintf(fp, "%s\"%s\":{\"requests\":%lld,\"errors\":%lld,\"bytes\":%lld,\"stages\":{", kind > 0 ? "," : "",
+            gelbooru_metrics_kind_name(kind), atomic_load(&request->requests), atomic_load(&request->errors), atomic_load(&request->bytes));
+
+        for (int stage = 0; stage < GELBOORU_STAGES; stage++) {
+            gelbooru_histogram *histogram = &request->stages[stage];
+            long long count = atomic_load(&histogram->count);
+            fprintf(fp, "%s\"%s\":{\"count\":%lld,\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}",
+                stage > 0 ? "," : "", gelbooru_metrics_stage_name(stage), count,
+                count > 0 ? atomic_load(&histogram->sum) / 1000.0 / count : 0.0,
+                gelbooru_histogram_percentile(histogram, 50) / 1000.0,
+                gelbooru_histogram_percentile(histogram, 99) / 1000.0,
+                gelbooru_histogram_percentile(histogram, 99.9) / 1000.0,
+                atomic_load(&histogram->max) / 1000.0);
+        }
+        fprintf(fp, "}}");
     }
-    queue->size++;
-    pthread_cond_signal(&queue->cond);
-    pthread_mutex_unlock(&queue->mutex);
-    return 0;
+    fprintf(fp, "}\n");
+    return ferror(fp) ? -1 : 0;
 }
 
-void* tsq_pop(ThreadSafeQueue *queue) {
-    if (queue == NULL) return NULL;
+/* Write metrics in Prometheus text format, stages as summaries in seconds */
+int gelbooru_metrics_write_prometheus(gelbooru_metrics *metrics, FILE *fp) {
+    if (metrics == NULL || fp == NULL) return -1;
+
+    const double quantiles[] = {50, 99, 99.9};
+    fprintf(fp, "# TYPE gelbooru_request_stage_seconds summary\n");
+    for (int kind = 0; kind < GELBOORU_REQUEST_KINDS; kind++) {
+        for (int stage = 0; stage < GELBOORU_STAGES; stage++) {
+            gelbooru_histogram *histogram = &metrics->kinds[kind].stages[stage];
+            const char *kind_name = gelbooru_metrics_kind_name(kind);
+            const char *stage_name = gelbooru_metrics_stage_name(stage);
+            for (int i = 0; i < 3; i++) {
+                fprintf(fp, "gelbooru_request_stage_seconds{kind=\"%s\",stage=\"%s\",quantile=\"%g\"} %.6f\n",
+                    kind_name, stage_name, quantiles[i] / 100, gelbooru_histogram_percentile(histogram, quantiles[i]) / 1e6);
+            }
+            fprintf(fp, "gelbooru_request_stage_seconds_sum{kind=\"%s\",stage=\"%s\"} %.6f\n", kind_name, stage_name, atomic_load(&histogram->sum) / 1e6);
+            fprintf(fp, "gelbooru_request_stage_seconds_count{kind=\"%s\",stage=\"%s\"} %lld\n", kind_name, stage_name, atomic_load(&histogram->count));
+        }
+    }
 
-    pthread_mutex_lock(&queue->mutex);
-    while (queue->head == NULL && !queue->closed) {
-        pthread_cond_wait(&queue->cond, &queue->mutex);
+    fprintf(fp, "# TYPE gelbooru_requests_total counter\n");
+    for (int kind = 0; kind < GELBOORU_REQUEST_KINDS; kind++) {
+        fprintf(fp, "gelbooru_requests_total{kind=\"%s\"} %lld\n", gelbooru_metrics_kind_name(kind), atomic_load(&metrics->kinds[kind].requests));
     }
-    if (queue->head == NULL) {
-        pthread_mutex_unlock(&queue->mutex);
-        return NULL;
+    fprintf(fp, "# TYPE gelbooru_request_errors_total counter\n");
+    for (int kind = 0; kind < GELBOORU_REQUEST_KINDS; kind++) {
+        fprintf(fp, "gelbooru_request_errors_total{kind=\"%s\"} %lld\n", gelbooru_metrics_kind_name(kind), atomic_load(&metrics->kinds[kind].errors));
     }
-    
-    TSQ_Node *node = queue->head;
-    void *data = node->data;
-    queue->head = node->next;
-    if (queue->head == NULL) {
-        queue->tail = NULL;
+    fprintf(fp, "# TYPE gelbooru_response_bytes_total counter\n");
+    for (int kind = 0; kind < GELBOORU_REQUEST_KINDS; kind++) {
+        fprintf(fp, "gelbooru_response_bytes_total{kind=\"%s\"} %lld\n", gelbooru_metrics_kind_name(kind), atomic_load(&metrics->kinds[kind].bytes));
     }
-    queue->size--;
-    pthread_mutex_unlock(&queue->mutex);
+    return ferror(fp) ? -1 : 0;
+}
 
-    free(node);
-    return data;
+/*
+    Replace file at path with metrics, Prometheus text if path ends with .prom, else JSON
+    Returns 0 if OK
+*/
+int gelbooru_metrics_dump(gelbooru_metrics *metrics, const char *path) {
+    if (metrics == NULL || path == NULL) return -1;
+
+    char *tmp_path = (char*) malloc(strlen(path) + 5);
+    if (tmp_path == NULL) return -1;
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+
+    size_t length = strlen(path);
+    int prometheus = length >= 5 && strcmp(path + length - 5, ".prom") == 0;
+    int failed = prometheus ? gelbooru_metrics_write_prometheus(metrics, fp) : gelbooru_metrics_write_json(metrics, fp);
+    failed = fclose(fp) != 0 || failed != 0;
+    if (!failed) failed = rename(tmp_path, path) != 0;
+    if (failed) remove(tmp_path);
+
+    free(tmp_path);
+    return failed ? -1 : 0;
 }
 
 
@@ -1408,11 +6789,13 @@ ProgressBar* ProgressBar_create(int bar_width) {
         return NULL;
     }
 
-    progress_bar->progress = 0;
-    progress_bar->max_progress = 100;
+    atomic_init(&progress_bar->progress, 0);
+    atomic_init(&progress_bar->max_progress, 100);
     progress_bar->bar_width = bar_width >= 10 ? bar_width : 10;
-    progress_bar->prefix_text = NULL;
-    progress_bar->postfix_text = NULL;
+    if (progress_bar->bar_width > PROGRESS_BAR_MAX_WIDTH) progress_bar->bar_width = PROGRESS_BAR_MAX_WIDTH;
+    progress_bar->unit = PROGRESS_BAR_UNIT_NONE;
+    progress_bar->prefix_text[0] = '\0';
+    progress_bar->postfix_text[0] = '\0';
     pthread_mutex_init(&progress_bar->mutex, NULL);
 
     return progress_bar;
@@ -1420,75 +6803,86 @@ ProgressBar* ProgressBar_create(int bar_width) {
 
 void ProgressBar_destroy(ProgressBar *bar) {
     if (bar != NULL) {
-        free(bar->prefix_text);
-        free(bar->postfix_text);
         pthread_mutex_destroy(&bar->mutex);
     }
     free(bar);
 }
 
-void ProgressBar_set_progress(ProgressBar* bar, int progress) {
+/* Lock free, progress is clamped to max progress when rendered */
+void ProgressBar_set_progress(ProgressBar* bar, long long progress) {
     if (bar == NULL) return;
-
-    pthread_mutex_lock(&bar->mutex);
-    bar->progress = progress < bar->max_progress ? progress : bar->max_progress;
-    pthread_mutex_unlock(&bar->mutex);
+    atomic_store_explicit(&bar->progress, progress, memory_order_relaxed);
 }
 
-void ProgressBar_set_max_progress(ProgressBar* bar, int max_progress) {
+/* Lock free */
+void ProgressBar_set_max_progress(ProgressBar* bar, long long max_progress) {
     if (bar == NULL) return;
+    atomic_store_explicit(&bar->max_progress, max_progress > 0 ? max_progress : 1, memory_order_relaxed);
+}
 
-    pthread_mutex_lock(&bar->mutex);
-    bar->max_progress = max_progress > 0 ? max_progress : 1;
-    pthread_mutex_unlock(&bar->mutex);
+/* PROGRESS_BAR_UNIT_BYTES shows progress as MB instead of postfix text while progress > 0 */
+void ProgressBar_set_unit(ProgressBar* bar, int unit) {
+    if (bar == NULL) return;
+    bar->unit = unit;
 }
 
 void ProgressBar_set_prefix_text(ProgressBar* bar, const char *text) {
     if (bar == NULL || text == NULL) return;
 
-    char *new_prefix = strdup(text); 
-    if (new_prefix == NULL) return;
-
     pthread_mutex_lock(&bar->mutex);
-
-    free(bar->prefix_text);
-    bar->prefix_text = new_prefix;
-
+    snprintf(bar->prefix_text, sizeof(bar->prefix_text), "%s", text);
     pthread_mutex_unlock(&bar->mutex);
 }
 
 void ProgressBar_set_postfix_text(ProgressBar* bar, const char *text) {
     if (bar == NULL || text == NULL) return;
 
-    char *new_postfix = strdup(text); 
-    if (new_postfix == NULL) return;
-
     pthread_mutex_lock(&bar->mutex);
-    
-    free(bar->postfix_text);
-    bar->postfix_text = new_postfix;
-    
+    snprintf(bar->postfix_text, sizeof(bar->postfix_text), "%s", text);
     pthread_mutex_unlock(&bar->mutex);
 }
 
-void ProgressBar_print(ProgressBar* bar) {
-    if (bar == NULL) return;
+/*
+    Render bar line (without newline) into buffer
+    Returns length, buffer of PROGRESS_BAR_LINE_SIZE always fits
+*/
+int ProgressBar_render(ProgressBar* bar, char *buffer, size_t size) {
+    if (bar == NULL || buffer == NULL || size == 0) return 0;
 
-    pthread_mutex_lock(&bar->mutex);
-    
-    float ratio = (float) bar->progress / bar->max_progress;
+    long long max_progress = atomic_load_explicit(&bar->max_progress, memory_order_relaxed);
+    long long progress = atomic_load_explicit(&bar->progress, memory_order_relaxed);
+    if (progress > max_progress) progress = max_progress;
+    if (progress < 0) progress = 0;
+
+    double ratio = (double) progress / max_progress;
     int filled_width = (int) (ratio * bar->bar_width);
     int percent = (int) (ratio * 100);
 
-    printf("\r%s [", bar->prefix_text ? bar->prefix_text : "");
-    for (int i = 0; i < bar->bar_width; i++) {
-        if (i < filled_width) printf("#");
-        else printf("-");
-    }
-    printf("] %3d%% %s", percent, bar->postfix_text ? bar->postfix_text : "");
-    fflush(stdout);
+    char line[PROGRESS_BAR_MAX_WIDTH + 1];
+    memset(line, '#', filled_width);
+    memset(line + filled_width, '-', bar->bar_width - filled_width);
+    line[bar->bar_width] = '\0';
 
+    pthread_mutex_lock(&bar->mutex);
+    int length;
+    if (bar->unit == PROGRESS_BAR_UNIT_BYTES && progress > 0) {
+        length = snprintf(buffer, size, "\r%s [%s] %3d%% %4.1f / %4.1f MB", bar->prefix_text, line, percent,
+            (double) progress / (1024*1024), (double) max_progress / (1024*1024));
+    } else {
+        length = snprintf(buffer, size, "\r%s [%s] %3d%% %s", bar->prefix_text, line, percent, bar->postfix_text);
+    }
     pthread_mutex_unlock(&bar->mutex);
+
+    return length < (int) size ? length : (int) size - 1;
+}
+
+void ProgressBar_print(ProgressBar* bar) {
+    if (bar == NULL) return;
+
+    char buffer[PROGRESS_BAR_LINE_SIZE];
+    int length = ProgressBar_render(bar, buffer, sizeof(buffer));
+    fwrite(buffer, 1, length, stdout);
+    fflush(stdout);
 }
 
 #endif
@@ -35,7 +35,10 @@ void search_tags(const char *query) {
 
 
 
-void download_images(int tags_count, char **input_tags) {
+/*
+    Download images with tags, or images of jobs in job file if batch
+*/
+void download_images(int argc, char **argv, int batch) {
     vector *tags = vector_create();
     if (tags == NULL) {
         printf("Failed to create tags vector\n");
@@ -47,6 +50,77 @@ void download_images(int tags_count, char **input_tags) {
         printf("Failed to create Gelbooru object\n");
         return;
     }
+    gelbooru_set_page_rate(gbooru, 2);
+    gelbooru_set_image_rate(gbooru, 20);
+
+    // options
+    const char *user_id = NULL, *api_key = NULL, *events_path = NULL;
+    int options_count = 0;
+    while (options_count < argc && strncmp(argv[options_count], "--", 2) == 0) {
+        const char *option = argv[options_count++];
+        const char *value = options_count < argc ? argv[options_count] : NULL;
+
+        if (strcmp(option, "--api") == 0) {
+            gelbooru_set_listing_mode(gbooru, GELBOORU_LISTING_API);
+        } else if (strcmp(option, "--user-id") == 0 && value != NULL) {
+            user_id = value;
+            options_count++;
+        } else if (strcmp(option, "--api-key") == 0 && value != NULL) {
+            api_key = value;
+            options_count++;
+        } else if (strcmp(option, "--page-rate") == 0 && value != NULL) {
+            gelbooru_set_page_rate(gbooru, atof(value));
+            options_count++;
+        } else if (strcmp(option, "--image-rate") == 0 && value != NULL) {
+            gelbooru_set_image_rate(gbooru, atof(value));
+            options_count++;
+        } else if (strcmp(option, "--writers") == 0 && value != NULL) {
+            gelbooru_set_writer_thread_count(gbooru, atoi(value));
+            options_count++;
+        } else if (strcmp(option, "--memory") == 0 && value != NULL) {
+            gelbooru_set_memory_budget(gbooru, atoll(value) * 1024 * 1024);
+            options_count++;
+        } else if (strcmp(option, "--fsync") == 0 && value != NULL) {
+            if (strcmp(value, "image") == 0) gelbooru_set_fsync_policy(gbooru, GELBOORU_FSYNC_IMAGE);
+            else if (strcmp(value, "batch") == 0) gelbooru_set_fsync_policy(gbooru, GELBOORU_FSYNC_BATCH);
+            else gelbooru_set_fsync_policy(gbooru, GELBOORU_FSYNC_NONE);
+            options_count++;
+        } else if (strcmp(option, "--pack") == 0) {
+            gelbooru_set_storage(gbooru, GELBOORU_STORAGE_PACK);
+        } else if (strcmp(option, "--sharded") == 0) {
+            gelbooru_set_layout(gbooru, GELBOORU_LAYOUT_SHARDED);
+        } else if (strcmp(option, "--sync") == 0) {
+            gelbooru_set_sync(gbooru, 1);
+        } else if (strcmp(option, "--no-verify") == 0) {
+            gelbooru_set_verify_md5(gbooru, 0);
+        } else if (strcmp(option, "--headless") == 0) {
+            gelbooru_set_headless(gbooru, 1);
+        } else if (strcmp(option, "--events") == 0 && value != NULL) {
+            events_path = value;
+            options_count++;
+        } else if (strcmp(option, "--host") == 0 && value != NULL) {
+            gelbooru_set_host(gbooru, value);
+            options_count++;
+        } else if (strcmp(option, "--metrics") == 0 && value != NULL) {
+            gelbooru_set_metrics_path(gbooru, value);
+            options_count++;
+        } else {
+            printf("Unknown option %s\n", option);
+        }
+    }
+    if (user_id != NULL && api_key != NULL) {
+        gelbooru_set_api_credentials(gbooru, user_id, api_key);
+    }
+
+    // events to file or stdout
+    int events_fd = -1;
+    if (events_path != NULL) {
+        events_fd = strcmp(events_path, "-") == 0 ? STDOUT_FILENO : open(events_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (events_fd < 0) printf("Failed to open events file %s\n", events_path);
+        gelbooru_set_event_fd(gbooru, events_fd);
+    }
+    int tags_count = batch ? 0 : argc - options_count;
+    char **input_tags = argv + options_count;
 
     for (int i = 0; i < tags_count; i++) {
         char *tag = strdup(input_tags[i]);
@@ -60,11 +134,28 @@ void download_images(int tags_count, char **input_tags) {
         }
     }
 
-    printf("Download images with tags: ");
-    for (int i = 0; i < vector_size(tags); i++) {
-        printf("%s, ", vector_index(tags, i));
+    // jobs, each with own output dir, formats and tags
+    vector *jobs = NULL;
+    if (batch) {
+        if (options_count >= argc || (jobs = gelbooru_read_jobs(argv[options_count])) == NULL) {
+            printf("Job file not set or not readable\n");
+            vector_destroy(tags);
+            gelbooru_destroy(gbooru);
+            if (events_fd > STDOUT_FILENO) close(events_fd);
+            return;
+        }
+    }
+
+    printf("Listing mode: %s\n", gbooru->listing_mode == GELBOORU_LISTING_API ? "API" : "HTML");
+    if (batch) {
+        printf("Jobs: %d\n", vector_size(jobs));
+    } else {
+        printf("Download images with tags: ");
+        for (int i = 0; i < vector_size(tags); i++) {
+            printf("%s, ", vector_index(tags, i));
+        }
+        printf("\n");
     }
-    printf("\n");
 
 
     // formats
@@ -82,18 +173,24 @@ void download_images(int tags_count, char **input_tags) {
 
 
     // params
-    gelbooru_set_parser_sleep_ms(gbooru, 500);
-    gelbooru_set_downloader_sleep_ms(gbooru, 100);
-    printf("Parser sleep %d ms\n", gbooru->parser_sleep_ms);
-    printf("Downloader sleep %d ms\n", gbooru->downloader_sleep_ms);
+    printf("Page requests per second: %.1f\n", gbooru->page_rate);
+    printf("Image requests per second: %.1f\n", gbooru->image_rate);
 
-    int thread_count = 10;
+    gelbooru_set_parser_thread_count(gbooru, 4);
+    printf("Parser threads: %d\n", gbooru->parser_thread_count);
+
+    int thread_count = 2;
     gelbooru_set_download_thread_count(gbooru, thread_count);
     printf("Download threads: %d\n", gbooru->download_thread_count);
 
+    gelbooru_set_download_transfers_per_thread(gbooru, 16);
+    printf("Transfers per thread: %d\n", gbooru->download_transfers_per_thread);
+
 
     // download
-    gelbooru_download(gbooru, tags);
+    if (batch) gelbooru_download_jobs(gbooru, jobs);
+    else gelbooru_download(gbooru, tags);
+    gelbooru_job_list_free(jobs);
 
 
     // cleanup
@@ -103,6 +200,7 @@ void download_images(int tags_count, char **input_tags) {
     }
     vector_destroy(tags);
     gelbooru_destroy(gbooru);
+    if (events_fd > STDOUT_FILENO) close(events_fd);
 }
 
 
@@ -111,7 +209,30 @@ int main(int argc, char **argv) {
 
     char msg[] = "Usage:\n"
                 "gbooru search-tags <query>\n"
-                "gbooru download <tag1> [<tag2> ...]\n";
+                "gbooru download [options] <tag1> [<tag2> ...]\n"
+                "gbooru batch [options] <job_file>   download many queries at once, one job per line:\n"
+                "                            <out_dir> <format,format,...|-> <tag1> [<tag2> ...]\n"
+                "gbooru rebuild-index <dir>\n"
+                "gbooru migrate <dir>        move images to sharded ab/cd/hash.ext layout\n"
+                "gbooru pack-export <dir> <out_dir> [<hash> ...]   write packed images as files\n"
+                "gbooru verify <dir> [--requeue]   check MD5 of images, requeue removes bad ones for next download\n"
+                "Download options:\n"
+                "  --api                     list posts with JSON API instead of HTML pages\n"
+                "  --user-id <id>            API user id\n"
+                "  --api-key <key>           API key\n"
+                "  --page-rate <n>           page requests per second (0 is unlimited)\n"
+                "  --image-rate <n>          image requests per second (0 is unlimited)\n"
+                "  --writers <n>             threads storing downloaded images, default 2 (0 stores in downloaders)\n"
+                "  --memory <mb>             downloaded images kept in memory, default 256 (rest goes to part files)\n"
+                "  --fsync <policy>          none (default), image (each image) or batch (written images together)\n"
+                "  --pack                    append images to large segment files instead of file per image\n"
+                "  --sharded                 store images in ab/cd/hash.ext dirs (kept for dir once used)\n"
+                "  --sync                    list only posts newer than last complete run of same tags (.gelbooru_sync)\n"
+                "  --no-verify               do not check MD5 of downloaded images\n"
+                "  --headless                no progress bars, for logs\n"
+                "  --events <path>           write NDJSON events to file (- is stdout)\n"
+                "  --host <url>              site host, default " GELBOORU_HOST "\n"
+                "  --metrics <path>          dump request timings every 5s, JSON or Prometheus text (.prom)\n";
 
     if (argc < 3) {
         printf(msg);
@@ -122,7 +243,58 @@ int main(int argc, char **argv) {
         search_tags(argv[2]);
     }
     else if (strcmp(argv[1], "download") == 0) {
-        download_images(argc - 2, argv + 2);
+        download_images(argc - 2, argv + 2, 0);
+    }
+    else if (strcmp(argv[1], "batch") == 0) {
+        download_images(argc - 2, argv + 2, 1);
+    }
+    else if (strcmp(argv[1], "rebuild-index") == 0) {
+        int count = gelbooru_index_rebuild(argv[2]);
+        if (count < 0) {
+            printf("Failed to rebuild index of %s\n", argv[2]);
+            return 1;
+        }
+        printf("Indexed %d images in %s\n", count, argv[2]);
+    }
+    else if (strcmp(argv[1], "pack-export") == 0 && argc > 3) {
+        vector *hashes = NULL;
+        if (argc > 4) {
+            hashes = vector_create();
+            for (int i = 4; hashes != NULL && i < argc; i++) vector_push_back(hashes, argv[i]);
+        }
+        int count = gelbooru_pack_export(argv[2], argv[3], hashes);
+        vector_destroy(hashes);
+        if (count < 0) {
+            printf("Failed to export pack of %s\n", argv[2]);
+            return 1;
+        }
+        printf("Exported %d images to %s\n", count, argv[3]);
+    }
+    else if (strcmp(argv[1], "migrate") == 0) {
+        int count = gelbooru_migrate_to_sharded(argv[2], 0);
+        if (count < 0) {
+            printf("Failed to migrate %s\n", argv[2]);
+            return 1;
+        }
+        printf("Moved %d files of %s to shard dirs\n", count, argv[2]);
+    }
+    else if (strcmp(argv[1], "verify") == 0) {
+        int requeue = argc > 3 && strcmp(argv[3], "--requeue") == 0;
+        gelbooru_verify_report report;
+        long long started_ms = gelbooru_time_ms();
+        int bad = gelbooru_verify_dir(argv[2], 0, requeue, &report);
+        if (bad < 0) {
+            printf("Failed to verify %s\n", argv[2]);
+            return 1;
+        }
+        double seconds = (gelbooru_time_ms() - started_ms) / 1000.0;
+        double megabytes = report.bytes / (1024.0 * 1024.0);
+        printf("Checked %lld images, %.1f MB in %.1f s (%.1f MB/s): %lld ok, %lld corrupt, %lld truncated, %lld orphan .part, %lld unreadable\n",
+            report.checked, megabytes, seconds, seconds > 0 ? megabytes / seconds : 0,
+            report.counts[GELBOORU_VERIFY_OK], report.counts[GELBOORU_VERIFY_CORRUPT], report.counts[GELBOORU_VERIFY_TRUNCATED],
+            report.counts[GELBOORU_VERIFY_ORPHAN_PART], report.counts[GELBOORU_VERIFY_UNREADABLE]);
+        if (requeue && bad > 0) printf("Bad images are requeued for next download\n");
+        return bad > 0;
     }
     else {
         printf(msg);
@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+"""
+Offline test of listing modes against tests/fake_server.py
+
+Downloads all posts with HTML listing and with JSON API listing (--api),
+checks every post is stored with correct MD5 and API listing needs less than half the page requests
+
+    python3 tests/api_test.py ./gbooru
+"""
+import os
+import sys
+
+import harness
+
+POSTS = 500
+
+
+def check(name, condition, detail=""):
+    print("%-4s %s%s" % ("ok" if condition else "FAIL", name, " (%s)" % detail if detail else ""))
+    return condition
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else "./gbooru"
+    passed = True
+    with harness.FakeServer("--posts", POSTS, "--min-size", 1000, "--max-size", 8000) as server:
+        runs = {}
+        for mode, options in (("html", []), ("api", ["--api"])):
+            with harness.scratch_dir() as cwd:
+                run = harness.download(binary, server, cwd, *options)
+                dir_path = os.path.join(cwd, "gelbooru_downloads")
+                ok, checked = harness.verify(binary, dir_path)
+                passed &= check("%s listing downloads all posts" % mode, run.images == POSTS and harness.image_count(dir_path) == POSTS,
+                                "%s images" % run.images)
+                passed &= check("%s listing images verify" % mode, ok and checked == POSTS, "%d checked" % checked)
+                passed &= check("%s listing loses no post" % mode, run.lost_posts == 0)
+                runs[mode] = run
+
+        html_pages, api_pages = runs["html"].page_requests, runs["api"].page_requests
+        passed &= check("api listing needs less than half the page requests", api_pages * 2 < html_pages,
+                        "%s api, %s html" % (api_pages, html_pages))
+        # API posts have exact file url, no request for other formats
+        passed &= check("api listing requests each image once", runs["api"].image_requests == POSTS,
+                        "%s requests" % runs["api"].image_requests)
+    return 0 if passed else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
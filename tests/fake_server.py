@@ -0,0 +1,333 @@
+#!/usr/bin/env python3
+"""
+Local stand-in for the Gelbooru endpoints used by gbooru, for offline tests
+
+    index.php?page=post&s=list    HTML listing, 42 posts per page with paginator
+    index.php?page=dapi&s=post    JSON API listing (json=1, limit, pid)
+    index.php?page=autocomplete2  tag suggestions
+    images/ab/cd/<hash>.<ext>     image payloads, Range requests are served
+
+Posts are random payloads of a fixed seed, tags are ignored except the id:>N filter.
+Image sizes follow --size-dist between --min-size and --max-size, payloads are generated per request,
+so large sets do not stay in memory. --latency delays every response, --bandwidth caps each connection.
+Port 0 picks a free port, the port is printed as first line of stdout.
+
+--faults injects failures into listing pages and images (--fault-scope), kind:probability per response
+
+    reset       connection reset before response or in the middle of body
+    stall       half of body, then no data for --stall seconds and close
+    truncate    full Content-Length, half of body, close
+    error       500, 502 or 503
+    storm       429/503 to every request for --storm seconds
+    slowloris   headers and body trickled in small pieces, completes slowly
+
+    python3 tests/fake_server.py --port 8765 --posts 300
+    python3 tests/fake_server.py --posts 2000 --size-dist lognormal --max-size 4000000 --latency 30 --bandwidth 2000
+    python3 tests/fake_server.py --faults reset:0.1,truncate:0.1,storm:0.01 --fault-scope images
+"""
+import argparse
+import hashlib
+import http.server
+import json
+import math
+import random
+import socket
+import socketserver
+import struct
+import sys
+import time
+import urllib.parse
+
+HTML_POSTS_PER_PAGE = 42
+FORMATS = ["jpg", "jpg", "jpg", "png", "gif"]
+FAULTS = ["reset", "stall", "truncate", "error", "storm", "slowloris"]
+
+
+class Post:
+    def __init__(self, post_id, seed, size, ext):
+        self.id = post_id
+        self.seed = seed
+        self.size = size
+        self.ext = ext
+        self.md5 = hashlib.md5(self.data()).hexdigest()
+
+    def data(self):
+        return random.Random(self.seed).randbytes(self.size)
+
+
+def image_size(rng, dist, min_size, max_size):
+    if dist == "lognormal":
+        # median at geometric mean of bounds, most images small, long tail of large ones
+        median = math.sqrt(min_size * max_size)
+        sigma = math.log(max_size / min_size) / 6
+        return int(min(max_size, max(min_size, rng.lognormvariate(math.log(median), sigma))))
+    return rng.randint(min_size, max_size)
+
+
+def make_posts(count, seed, dist, min_size, max_size):
+    rng = random.Random(seed)
+    posts = []
+    for i in range(count):
+        size = image_size(rng, dist, min_size, max_size)
+        posts.append(Post(100000 + i, rng.getrandbits(64), size, rng.choice(FORMATS)))
+    return posts
+
+
+def parse_faults(text):
+    """[(kind, probability)] of kind:probability list"""
+    faults = []
+    for item in filter(None, text.split(",")):
+        kind, _, probability = item.partition(":")
+        if kind not in FAULTS:
+            raise argparse.ArgumentTypeError("unknown fault %s, one of %s" % (kind, ", ".join(FAULTS)))
+        faults.append((kind, float(probability or 0.1)))
+    return faults
+
+
+def filter_posts(posts, tags):
+    """Newest first, only id:>N of tags is applied"""
+    result = posts
+    for tag in tags.split():
+        if tag.startswith("id:>"):
+            min_id = int(tag[4:])
+            result = [post for post in result if post.id > min_id]
+    return result
+
+
+def html_page(posts, pid):
+    items = []
+    for post in posts[pid:pid + HTML_POSTS_PER_PAGE]:
+        items.append(
+            '<article class="thumbnail-preview"><a id="p%d" href="https://gelbooru.com/index.php?page=post&amp;s=view&amp;id=%d&amp;tags=all">'
+            '<img src="https://img3.gelbooru.com/thumbnails/%s/%s/thumbnail_%s.jpg" title="tags"/></a></article>'
+            % (post.id, post.id, post.md5[:2], post.md5[2:4], post.md5))
+    last_pid = max(0, (len(posts) - 1) // HTML_POSTS_PER_PAGE * HTML_POSTS_PER_PAGE)
+    paginator = ""
+    if len(posts) > HTML_POSTS_PER_PAGE:
+        paginator = ('<div id="paginator"><a href="?page=post&amp;s=list&amp;tags=all&amp;pid=%d">2</a>'
+                     '<a href="?page=post&amp;s=list&amp;tags=all&amp;pid=%d">&raquo;</a></div>'
+                     % (HTML_POSTS_PER_PAGE, last_pid))
+    # real pages carry a lot of markup around the posts
+    filler = "<script>var x = 0;</script>" * 600
+    return ("<html><head>%s</head><body>%s%s%s</body></html>" % (filler, "".join(items), paginator, filler)).encode()
+
+
+def api_page(posts, pid, limit, host):
+    chunk = posts[pid * limit:(pid + 1) * limit]
+    result = {"@attributes": {"limit": limit, "offset": pid * limit, "count": len(posts)}}
+    if chunk:
+        result["post"] = [{
+            "id": post.id,
+            "created_at": "Sat Jan 01 00:00:00 -0500 2022",
+            "score": 1,
+            "width": 100,
+            "height": 100,
+            "md5": post.md5,
+            "directory": post.md5[:2] + "/" + post.md5[2:4],
+            "image": post.md5 + "." + post.ext,
+            "rating": "general",
+            "source": "",
+            "change": 1,
+            "owner": "fake",
+            "creator_id": 1,
+            "parent_id": 0,
+            "sample": 0,
+            "preview_height": 100,
+            "preview_width": 100,
+            "tags": "tag_a tag_b \"quoted\"",
+            "title": "",
+            "has_notes": "false",
+            "has_comments": "false",
+            "file_url": "http://%s/images/%s/%s/%s.%s" % (host, post.md5[:2], post.md5[2:4], post.md5, post.ext),
+            "preview_url": "",
+            "sample_url": "",
+            "sample_height": 0,
+            "sample_width": 0,
+            "status": "active",
+            "post_locked": 0,
+            "has_children": "false",
+        } for post in chunk]
+    return json.dumps(result, separators=(",", ":")).encode()
+
+
+AUTOCOMPLETE = json.dumps([
+    {"type": "tag", "label": "cat_ears", "value": "cat_ears", "post_count": "1234", "category": "tag"},
+    {"type": "tag", "label": "cat", "value": "cat", "post_count": "99", "category": "tag"},
+], separators=(",", ":")).encode()
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def send_body(self, code, body, content_type="text/html", headers=None, head=False, endpoint=None):
+        if self.server.latency > 0:
+            time.sleep(self.server.latency)
+        fault = self.server.fault(endpoint) if code in (200, 206) else None
+        if fault == "storm" or fault == "error":
+            code = self.server.rng.choice([429, 503] if fault == "storm" else [500, 502, 503])
+            body, headers = b"fault", {}
+        elif fault == "reset" and self.server.rng.random() < 0.5:
+            self.reset()
+            return
+        slow = fault == "slowloris"
+        self.send_response_only(code)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        for key, value in (headers or {}).items():
+            self.send_header(key, value)
+        self.send_header("Connection", "close" if fault else "keep-alive")
+        if slow:
+            self.trickle(b"".join(self._headers_buffer) + b"\r\n")
+            self._headers_buffer = []
+        else:
+            self.end_headers()
+        if head:
+            return
+        if fault in ("reset", "stall", "truncate"):
+            self.wfile.write(body[:len(body) // 2])
+            if fault == "stall":
+                time.sleep(self.server.stall)
+            if fault == "reset":
+                self.reset()
+            self.close_connection = True
+        elif slow:
+            self.trickle(body)
+        else:
+            self.write_body(body)
+
+    def reset(self):
+        """Close with RST instead of FIN"""
+        self.connection.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        self.connection.close()
+        self.close_connection = True
+
+    def trickle(self, data):
+        # 5 KB/s, above low speed limit of gbooru
+        for offset in range(0, len(data), 256):
+            self.wfile.write(data[offset:offset + 256])
+            time.sleep(0.05)
+
+    def write_body(self, body):
+        bandwidth = self.server.bandwidth
+        if bandwidth <= 0:
+            self.wfile.write(body)
+            return
+        chunk_size = 16 * 1024
+        started = time.monotonic()
+        for offset in range(0, len(body), chunk_size):
+            self.wfile.write(body[offset:offset + chunk_size])
+            ahead = (offset + chunk_size) / bandwidth - (time.monotonic() - started)
+            if ahead > 0:
+                time.sleep(ahead)
+
+    def do_HEAD(self):
+        self.do_GET(head=True)
+
+    def do_GET(self, head=False):
+        url = urllib.parse.urlparse(self.path)
+        query = urllib.parse.parse_qs(url.query)
+        if url.path == "/index.php":
+            self.listing(query, head)
+        elif url.path.startswith("/images/"):
+            self.image(url.path.rsplit("/", 1)[1], head)
+        else:
+            self.send_body(404, b"not found", head=head)
+
+    def listing(self, query, head):
+        page = query.get("page", [""])[0]
+        if page == "autocomplete2":
+            self.send_body(200, AUTOCOMPLETE, "application/json", head=head)
+            return
+        posts = filter_posts(self.server.posts, query.get("tags", [""])[0])
+        pid = int(query.get("pid", ["0"])[0])
+        if page == "post":
+            self.send_body(200, html_page(posts, pid), head=head, endpoint="pages")
+        elif page == "dapi":
+            limit = min(int(query.get("limit", ["100"])[0]), 1000)
+            self.send_body(200, api_page(posts, pid, limit, self.headers["Host"]), "application/json", head=head, endpoint="pages")
+        else:
+            self.send_body(404, b"unknown page", head=head)
+
+    def image(self, name, head):
+        md5, _, ext = name.partition(".")
+        post = self.server.by_md5.get(md5)
+        if post is None or post.ext != ext:
+            self.send_body(404, b"not found", head=head)
+            return
+
+        data = post.data()
+        content_range = self.headers.get("Range")
+        if content_range:
+            start = int(content_range.split("=")[1].split("-")[0])
+            if start >= len(data):
+                self.send_body(416, b"", headers={"Content-Range": "bytes */%d" % len(data)}, head=head)
+                return
+            self.send_body(206, data[start:], "image/" + ext,
+                           {"Content-Range": "bytes %d-%d/%d" % (start, len(data) - 1, len(data))}, head=head, endpoint="images")
+            return
+        self.send_body(200, data, "image/" + ext, head=head, endpoint="images")
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 256
+    faults = []
+    fault_scope = "all"
+    storm_until = 0
+
+    def fault(self, endpoint):
+        """Fault kind of next response of endpoint or None"""
+        if endpoint is None or self.fault_scope not in ("all", endpoint):
+            return None
+        if time.monotonic() < self.storm_until:
+            return "storm"
+        draw = self.rng.random()
+        for kind, probability in self.faults:
+            if draw < probability:
+                if kind == "storm":
+                    self.storm_until = time.monotonic() + self.storm
+                return kind
+            draw -= probability
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local stand-in Gelbooru server")
+    parser.add_argument("--port", type=int, default=8765)
+    parser.add_argument("--posts", type=int, default=300)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--size-dist", choices=["uniform", "lognormal"], default="uniform", help="image size distribution")
+    parser.add_argument("--min-size", type=int, default=2000, help="smallest image in bytes")
+    parser.add_argument("--max-size", type=int, default=60000, help="largest image in bytes")
+    parser.add_argument("--latency", type=float, default=0, help="delay of each response in ms")
+    parser.add_argument("--bandwidth", type=float, default=0, help="KB/s of each connection, 0 is unlimited")
+    parser.add_argument("--faults", type=parse_faults, default=[], help="kind:probability list, kinds: " + ", ".join(FAULTS))
+    parser.add_argument("--fault-scope", choices=["all", "pages", "images"], default="all")
+    parser.add_argument("--stall", type=float, default=40, help="seconds without data of stall fault")
+    parser.add_argument("--storm", type=float, default=2, help="seconds of 429/503 storm")
+    args = parser.parse_args()
+
+    server = Server(("127.0.0.1", args.port), Handler)
+    server.latency = args.latency / 1000
+    server.bandwidth = args.bandwidth * 1024
+    server.faults = args.faults
+    server.fault_scope = args.fault_scope
+    server.stall = args.stall
+    server.storm = args.storm
+    server.rng = random.Random(args.seed)
+    server.posts = sorted(make_posts(args.posts, args.seed, args.size_dist, args.min_size, args.max_size), key=lambda post: -post.id)
+    server.by_md5 = {post.md5: post for post in server.posts}
+    print(server.server_address[1], flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    sys.exit(main())
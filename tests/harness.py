@@ -0,0 +1,108 @@
+"""
+Helpers of offline tests and benchmarks: stand-in server process, gbooru runs and their summaries
+"""
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+SERVER = os.path.join(TESTS_DIR, "fake_server.py")
+
+
+class FakeServer:
+    """tests/fake_server.py on a free port, stopped on exit of with block"""
+
+    def __init__(self, *args):
+        self.args = [str(arg) for arg in args]
+        self.process = None
+        self.port = None
+
+    def __enter__(self):
+        self.process = subprocess.Popen([sys.executable, SERVER, "--port", "0"] + self.args,
+                                        stdout=subprocess.PIPE, text=True)
+        self.port = int(self.process.stdout.readline())
+        return self
+
+    def __exit__(self, *exc):
+        self.process.terminate()
+        self.process.wait()
+
+    @property
+    def host(self):
+        return "http://127.0.0.1:%d" % self.port
+
+
+class Run:
+    """Output of one gbooru run with parsed summary"""
+
+    def __init__(self, returncode, output):
+        self.returncode = returncode
+        self.output = output
+        self.images = self.number(r"Downloaded (\d+) images")
+        self.megabytes = self.number(r"images, ([\d.]+) MB in")
+        self.seconds = self.number(r"MB in ([\d.]+) s")
+        self.images_per_second = self.number(r"([\d.]+) images/s")
+        self.megabytes_per_second = self.number(r"([\d.]+) MB/s")
+        self.user_seconds = self.number(r"CPU time: ([\d.]+) s user")
+        self.system_seconds = self.number(r"([\d.]+) s system")
+        self.peak_rss_mb = self.number(r"peak RSS: ([\d.]+) MB")
+        self.page_requests = self.number(r"page\s+requests (\d+)")
+        self.image_requests = self.number(r"image\s+requests (\d+)")
+        self.page_errors = self.number(r"page\s+requests \d+, errors (\d+)")
+        self.image_errors = self.number(r"image\s+requests \d+, errors (\d+)")
+        self.lost_posts = self.number(r"Warning: (-?\d+) queued posts were not finished") or 0
+
+    def number(self, pattern):
+        match = re.search(pattern, self.output)
+        if match is None:
+            return None
+        value = float(match.group(1))
+        return int(value) if value.is_integer() else value
+
+
+def run_gbooru(binary, args, cwd, timeout=600):
+    """Run gbooru with args in cwd, returns Run"""
+    result = subprocess.run([os.path.abspath(binary)] + [str(arg) for arg in args], cwd=cwd,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True, timeout=timeout)
+    return Run(result.returncode, result.stdout)
+
+
+def download(binary, server, cwd, *options, tags=("all",)):
+    """Headless unthrottled download of tags from server into cwd/gelbooru_downloads"""
+    args = ["download", "--host", server.host, "--headless", "--page-rate", "0", "--image-rate", "0"]
+    return run_gbooru(binary, args + list(options) + list(tags), cwd)
+
+
+def verify(binary, dir_path):
+    """Returns (ok, checked) of gbooru verify of dir"""
+    run = run_gbooru(binary, ["verify", dir_path], os.getcwd())
+    match = re.search(r"Checked (\d+) images.*: (\d+) ok", run.output)
+    if match is None:
+        return False, 0
+    return run.returncode == 0, int(match.group(1))
+
+
+def run_end(events_path):
+    """Fields of run_end event of --events file, empty if run did not end"""
+    if not os.path.exists(events_path):
+        return {}
+    with open(events_path) as file:
+        for line in file:
+            event = json.loads(line)
+            if event.get("ev") == "run_end":
+                return event
+    return {}
+
+
+def image_count(dir_path):
+    """Number of image files of flat downloads dir"""
+    if not os.path.isdir(dir_path):
+        return 0
+    return sum(1 for name in os.listdir(dir_path) if not name.startswith(".") and not name.endswith(".part"))
+
+
+def scratch_dir():
+    return tempfile.TemporaryDirectory(prefix="gbooru-test-")
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""
+Fault injection stress test of gbooru against tests/fake_server.py --faults
+
+Every profile injects one kind of failure (or all of them) into listing pages and images,
+downloads all posts and checks the invariants of the run:
+
+    correct files   every post is stored, gbooru verify finds no bad image or orphan part file
+    no lost posts   no failed post and no queued post left unfinished
+    bounded memory  peak RSS below RSS_LIMIT_MB
+
+Throughput and request errors of each profile are printed as table.
+Stalls last longer than low speed time of gbooru (30 s), so the stall profile takes about a minute.
+
+    python3 tests/stress.py ./gbooru
+    python3 tests/stress.py ./gbooru --only storm
+"""
+import argparse
+import os
+import sys
+
+import harness
+
+POSTS = 300
+RSS_LIMIT_MB = 64
+SIZES = ["--min-size", 2000, "--max-size", 60000]
+
+
+class Profile:
+    def __init__(self, name, faults, server_args=(), options=()):
+        self.name = name
+        self.server_args = ["--posts", POSTS, "--faults", faults] + SIZES + list(server_args)
+        self.options = list(options)
+
+
+PROFILES = [
+    Profile("clean", ""),
+    Profile("resets", "reset:0.1"),
+    Profile("truncated", "truncate:0.15"),
+    Profile("5xx", "error:0.15"),
+    Profile("429/503 storms", "storm:0.005", ["--storm", 2]),
+    Profile("slowloris", "slowloris:0.05"),
+    Profile("stalls", "stall:0.01", ["--stall", 35]),
+    Profile("large images", "", ["--size-dist", "lognormal", "--min-size", 200000, "--max-size", 8000000],
+            ["--api", "--memory", 32]),
+    Profile("mixed api", "reset:0.05,truncate:0.05,error:0.05,storm:0.002,slowloris:0.02", options=["--api"]),
+]
+
+
+def run_profile(binary, profile):
+    """Returns (run, failed posts, problems)"""
+    with harness.FakeServer(*profile.server_args) as server, harness.scratch_dir() as cwd:
+        events_path = os.path.join(cwd, "events.jsonl")
+        run = harness.download(binary, server, cwd, "--events", events_path, *profile.options)
+        dir_path = os.path.join(cwd, "gelbooru_downloads")
+        ok, checked = harness.verify(binary, dir_path)
+        end = harness.run_end(events_path)
+
+    failed = end.get("failed", -1)
+    problems = []
+    if not end:
+        problems.append("run did not end, exit code %d" % run.returncode)
+    if run.images != POSTS:
+        problems.append("%s of %d posts downloaded" % (run.images, POSTS))
+    if not ok or checked != POSTS:
+        problems.append("verify failed, %d checked" % checked)
+    if failed != 0 or end.get("pages_failed", 0) != 0:
+        problems.append("%d failed posts, %d failed pages" % (failed, end.get("pages_failed", 0)))
+    if run.lost_posts != 0:
+        problems.append("%d lost posts" % run.lost_posts)
+    if run.peak_rss_mb is None or run.peak_rss_mb > RSS_LIMIT_MB:
+        problems.append("peak RSS %s MB over %d MB" % (run.peak_rss_mb, RSS_LIMIT_MB))
+    return run, failed, problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description="gbooru fault injection stress test")
+    parser.add_argument("binary", nargs="?", default="./gbooru")
+    parser.add_argument("--only", help="run profiles with this text in name")
+    args = parser.parse_args()
+
+    print("%-16s %6s %6s %9s %7s %13s %13s %7s %7s" % (
+        "profile", "images", "failed", "images/s", "MB/s", "page req/err", "image req/err", "RSS MB", "time s"))
+    passed = True
+    for profile in PROFILES:
+        if args.only and args.only not in profile.name:
+            continue
+        run, failed, problems = run_profile(args.binary, profile)
+        passed &= not problems
+        print("%-16s %6s %6d %9.1f %7.2f %6s/%-6s %6s/%-6s %7.1f %7.1f  %s" % (
+            profile.name, run.images, failed, run.images_per_second or 0, run.megabytes_per_second or 0,
+            run.page_requests, run.page_errors, run.image_requests, run.image_errors,
+            run.peak_rss_mb or 0, run.seconds or 0, "ok" if not problems else "FAIL: " + ", ".join(problems)), flush=True)
+    return 0 if passed else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())